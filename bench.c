@@ -0,0 +1,503 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// Benchmark for the duplicate detection pipeline and the jpg decoder.
+//
+// A deterministic synthetic photo library is generated from a seed, then each
+// stage of the pipeline is timed on its own over all files. The report is
+// printed as JSON so results can be compared across commits.
+//
+// The library has files with sizes distributed log-uniformly between
+// --min-size and --max-size. JPEG files are built from the images in --assets
+// by adding a COM segment with random bytes after SOI, so they are unique files
+// that still decode. Other files are random bytes. A --dup-ratio fraction of
+// the files are exact copies of an earlier one, named the way copies usually
+// end up named: "IMG_00012 (1).jpg", "IMG_00012 copy.jpg" or the same name in
+// another directory.
+//
+// The library is generated in DIR/library, next to a DIR/params file. Running
+// again with the same parameters reuses it, so timings are for a warm page
+// cache.
+
+#define main scrapbook_main
+#include "scrapbook.c"
+#undef main
+
+struct bench_config_t {
+    uint64_t files;
+    double dup_ratio;
+    double jpg_ratio;
+    uint64_t min_size;
+    uint64_t max_size;
+    uint64_t seed;
+    char *assets;
+};
+
+// splitmix64, same as the one used for the CDC gear table.
+uint64_t bench_rand (uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double bench_rand_unit (uint64_t *state)
+{
+    return (bench_rand (state) >> 11) * (1.0/(1ULL<<53));
+}
+
+void bench_rand_fill (uint64_t *state, uint8_t *data, uint64_t len)
+{
+    for (uint64_t i=0; i<len; i+=sizeof(uint64_t)) {
+        uint64_t r = bench_rand (state);
+        memcpy (data + i, &r, MIN(sizeof(uint64_t), len - i));
+    }
+}
+
+struct bench_asset_t {
+    uint8_t *data;
+    uint64_t size;
+};
+
+struct bench_source_t {
+    string_t path;
+    uint64_t seed;
+    uint64_t size;
+    bool is_jpg;
+    uint32_t copies;
+};
+
+uint64_t bench_file_content (struct bench_config_t *cfg, struct bench_source_t *src,
+                             struct bench_asset_t *assets, int assets_len, uint8_t *buff)
+{
+    uint64_t state = src->seed;
+    if (!src->is_jpg) {
+        bench_rand_fill (&state, buff, src->size);
+        return src->size;
+    }
+
+    struct bench_asset_t *asset = &assets[bench_rand (&state) % assets_len];
+
+    // SOI, then COM segments of random bytes up to the target size, then the
+    // rest of the asset.
+    uint64_t len = 0;
+    buff[len++] = JPG_MARKER_SOI >> 8;
+    buff[len++] = JPG_MARKER_SOI & 0xFF;
+
+    uint64_t padding = src->size > asset->size + 4 ? src->size - asset->size : 4;
+    while (padding >= 4) {
+        uint64_t segment_len = MIN(padding - 2, 0xFFFF);
+        buff[len++] = JPG_MARKER_COM >> 8;
+        buff[len++] = JPG_MARKER_COM & 0xFF;
+        buff[len++] = segment_len >> 8;
+        buff[len++] = segment_len & 0xFF;
+        bench_rand_fill (&state, buff + len, segment_len - 2);
+        len += segment_len - 2;
+        padding -= segment_len + 2;
+    }
+
+    memcpy (buff + len, asset->data + 2, asset->size - 2);
+    len += asset->size - 2;
+    return len;
+}
+
+bool bench_generate (struct bench_config_t *cfg, char *library_path)
+{
+    mem_pool_t pool = {0};
+    bool success = true;
+
+    struct bench_asset_t *assets = NULL;
+    int assets_len = 0;
+    {
+        char *paths[] = {cfg->assets};
+        struct file_header_t *asset_files = collect_files_from_cli_full (&pool, "jpg", paths, 1, false, 1);
+        assets_len = file_list_len (asset_files);
+        assets = mem_pool_push_array (&pool, assets_len, struct bench_asset_t);
+
+        int i = 0;
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, asset_files) {
+            assets[i].data = (uint8_t*)full_file_read (&pool, str_data(&curr_file->path), &assets[i].size);
+            i++;
+        }
+    }
+
+    if (assets_len == 0 && cfg->jpg_ratio > 0) {
+        printf (ECMA_RED("error:") " no jpg assets found in %s\n", cfg->assets);
+        mem_pool_destroy (&pool);
+        return false;
+    }
+
+    uint64_t max_asset_size = 0;
+    for (int i=0; i<assets_len; i++) {
+        max_asset_size = MAX(max_asset_size, assets[i].size);
+    }
+    uint64_t buff_size = cfg->max_size + max_asset_size + 2*(cfg->max_size/0xFFFF + 2)*4;
+    uint8_t *buff = pom_push_size (&pool, buff_size);
+
+    struct bench_source_t *sources = mem_pool_push_array (&pool, cfg->files, struct bench_source_t);
+    uint64_t sources_len = 0;
+
+    uint64_t state = cfg->seed;
+    string_t path = {0};
+    struct progress_t progress;
+    progress_begin (&progress, "Files generated: ", cfg->files);
+    for (uint64_t i=0; i<cfg->files; i++) {
+        int year = 2015 + bench_rand (&state) % 8;
+        int month = 1 + bench_rand (&state) % 12;
+
+        struct bench_source_t *src;
+        if (sources_len > 0 && bench_rand_unit (&state) < cfg->dup_ratio) {
+            src = &sources[bench_rand (&state) % sources_len];
+            src->copies++;
+
+            char *dirname = NULL;
+            char *basename = NULL;
+            path_split (&pool, str_data(&src->path), &dirname, &basename);
+            char *extension = get_extension (basename);
+            int name_len = extension - basename - 1;
+
+            int pattern = src->copies == 1 ? bench_rand (&state) % 3 : 0;
+            if (pattern == 0) {
+                str_set_printf (&path, "%s/%.*s (%d).%s", dirname, name_len, basename, src->copies, extension);
+            } else if (pattern == 1) {
+                str_set_printf (&path, "%s/%.*s copy.%s", dirname, name_len, basename, extension);
+            } else {
+                str_set_printf (&path, "%s/Backup/%04d/%02d/%s", library_path, year, month, basename);
+            }
+
+        } else {
+            src = &sources[sources_len++];
+            *src = ZERO_INIT (struct bench_source_t);
+            src->seed = bench_rand (&state);
+            src->is_jpg = bench_rand_unit (&state) < cfg->jpg_ratio;
+
+            double log_min = log (cfg->min_size);
+            double log_max = log (cfg->max_size);
+            src->size = exp (log_min + bench_rand_unit (&state)*(log_max - log_min));
+
+            str_set_printf (&src->path, "%s/%04d/%02d/%s_%05lu.%s", library_path, year, month,
+                            src->is_jpg ? "IMG" : "VID", i, src->is_jpg ? "jpg" : "mp4");
+            str_set (&path, str_data(&src->path));
+        }
+
+        uint64_t len = bench_file_content (cfg, src, assets, assets_len, buff);
+        if (!ensure_path_exists (str_data(&path)) || full_file_write (buff, len, str_data(&path))) {
+            success = false;
+            break;
+        }
+        progress_add (&progress, 1, len);
+    }
+    progress_end (&progress);
+
+    for (uint64_t i=0; i<sources_len; i++) {
+        str_free (&sources[i].path);
+    }
+    str_free (&path);
+    mem_pool_destroy (&pool);
+    return success;
+}
+
+uint64_t bench_time_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Latencies are recorded for each item processed by a stage, like a file or a
+// pair of files, so the report can include percentiles.
+struct bench_stage_t {
+    char *name;
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t *latencies;
+};
+
+void bench_stage_begin (mem_pool_t *pool, struct bench_stage_t *stage, char *name, uint64_t max_items)
+{
+    *stage = ZERO_INIT (struct bench_stage_t);
+    stage->name = name;
+    stage->latencies = mem_pool_push_array (pool, MAX(max_items, 1), uint64_t);
+}
+
+static inline
+void bench_stage_item (struct bench_stage_t *stage, uint64_t start_ns, uint64_t bytes)
+{
+    uint64_t latency = bench_time_ns () - start_ns;
+    stage->latencies[stage->items++] = latency;
+    stage->total_ns += latency;
+    stage->bytes += bytes;
+}
+
+uint64_t bench_percentile (uint64_t *sorted, uint64_t len, double p)
+{
+    if (len == 0) return 0;
+    return sorted[MIN((uint64_t)(p*len), len-1)];
+}
+
+void str_cat_bench_stage (string_t *str, struct bench_stage_t *stage, bool has_latencies)
+{
+    double seconds = stage->total_ns/1e9;
+    str_cat_printf (str, "    \"%s\": {\"items\": %lu, \"bytes\": %lu, \"seconds\": %.6f, "
+                    "\"items_per_s\": %.1f, \"mib_per_s\": %.2f",
+                    stage->name, stage->items, stage->bytes, seconds,
+                    seconds > 0 ? stage->items/seconds : 0,
+                    seconds > 0 ? stage->bytes/seconds/megabyte(1) : 0);
+
+    if (has_latencies) {
+        uint64_radix_sort (stage->latencies, stage->items);
+        str_cat_printf (str, ", \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+                        bench_percentile (stage->latencies, stage->items, 0.50)/1e3,
+                        bench_percentile (stage->latencies, stage->items, 0.90)/1e3,
+                        bench_percentile (stage->latencies, stage->items, 0.99)/1e3,
+                        bench_percentile (stage->latencies, stage->items, 1)/1e3);
+    }
+    str_cat_c (str, "}");
+}
+
+struct bench_file_t {
+    char *path;
+    uint64_t size;
+    uint64_t partial_hash;
+
+    // Only set for files that share their partial hash with another one.
+    uint64_t sample_signature;
+};
+templ_radix_sort (bench_file_sort, struct bench_file_t, a->partial_hash);
+templ_radix_sort (bench_file_signature_sort, struct bench_file_t, a->sample_signature);
+
+void bench_run (struct bench_config_t *cfg, char *library_path, string_t *report)
+{
+    mem_pool_t pool = {0};
+
+    struct bench_stage_t walk, stat_stage, partial_hash, sample_signature, full_compare, fingerprint, decode;
+
+    // Walk
+    uint64_t start_ns = bench_time_ns ();
+    struct file_header_t *files = collect_files_from_cli_full (&pool, NULL, &library_path, 1, false, 1);
+    uint64_t files_len = file_list_len (files);
+    bench_stage_begin (&pool, &walk, "walk", 0);
+    walk.items = files_len;
+    walk.total_ns = bench_time_ns () - start_ns;
+
+    struct bench_file_t *bench_files = mem_pool_push_array (&pool, MAX(files_len, 1), struct bench_file_t);
+    {
+        uint64_t i = 0;
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+            bench_files[i] = ZERO_INIT (struct bench_file_t);
+            bench_files[i].path = str_data(&curr_file->path);
+            i++;
+        }
+    }
+
+    // Stat
+    bench_stage_begin (&pool, &stat_stage, "stat", files_len);
+    for (uint64_t i=0; i<files_len; i++) {
+        start_ns = bench_time_ns ();
+        struct stat st;
+        if (stat (bench_files[i].path, &st) == 0) {
+            bench_files[i].size = st.st_size;
+        }
+        bench_stage_item (&stat_stage, start_ns, 0);
+    }
+
+    // Partial hash, like find_file_duplicates() does it. The default prefix
+    // size is fixed so results don't depend on the sizes learned in the
+    // user's cache.
+    mem_pool_t pool_l = {0};
+    struct partial_reads_t partial_reads;
+    partial_reads_begin (&partial_reads, PARTIAL_READ_DEFAULT_PREFIX);
+    bench_stage_begin (&pool, &partial_hash, "partial_hash", files_len);
+    for (uint64_t i=0; i<files_len; i++) {
+        start_ns = bench_time_ns ();
+        uint64_t file_len = 0;
+        partial_reads_hash (&partial_reads, bench_files[i].path, &pool_l, &bench_files[i].partial_hash, &file_len);
+        mem_pool_reset (&pool_l);
+        bench_stage_item (&partial_hash, start_ns, file_len);
+    }
+    partial_reads_end (&partial_reads);
+    mem_pool_destroy (&pool_l);
+
+    // Sample signature of files that share their partial hash.
+    bench_file_sort (bench_files, files_len);
+    bench_stage_begin (&pool, &sample_signature, "sample_signature", files_len);
+    char *sample_buff = mem_pool_push_size (&pool, 3*SAMPLE_SIGNATURE_SIZE);
+    for (uint64_t i=0; i<files_len; i++) {
+        bool has_duplicate = (i > 0 && bench_files[i-1].partial_hash == bench_files[i].partial_hash) ||
+            (i+1 < files_len && bench_files[i+1].partial_hash == bench_files[i].partial_hash);
+        if (!has_duplicate) continue;
+
+        start_ns = bench_time_ns ();
+        uint64_t file_size, bytes_read;
+        file_sample_signature (bench_files[i].path, sample_buff, &bench_files[i].sample_signature, &file_size, &bytes_read);
+        bench_stage_item (&sample_signature, start_ns, bytes_read);
+    }
+
+    // Full compare of each file against the first one with the same sample
+    // signature.
+    bench_file_signature_sort (bench_files, files_len);
+    bench_stage_begin (&pool, &full_compare, "full_compare", files_len);
+    uint64_t run_start = 0;
+    for (uint64_t i=1; i<files_len; i++) {
+        if (bench_files[i].sample_signature == 0 ||
+            bench_files[i].sample_signature != bench_files[run_start].sample_signature) {
+            run_start = i;
+            continue;
+        }
+
+        start_ns = bench_time_ns ();
+        file_content_equal (bench_files[run_start].path, bench_files[i].path, NULL);
+        bench_stage_item (&full_compare, start_ns, bench_files[run_start].size + bench_files[i].size);
+    }
+
+    // Image stream fingerprint and full decode of JPEG files.
+    bench_stage_begin (&pool, &fingerprint, "fingerprint", files_len);
+    bench_stage_begin (&pool, &decode, "decode", files_len);
+    string_t error_msg = {0};
+    string_t structure = {0};
+    for (uint64_t i=0; i<files_len; i++) {
+        bool is_heif;
+        if (!is_image_stream_path (bench_files[i].path, &is_heif) || is_heif) {
+            continue;
+        }
+
+        start_ns = bench_time_ns ();
+        struct jpg_fingerprint_t fp;
+        jpg_fingerprint (bench_files[i].path, &fp, &error_msg);
+        bench_stage_item (&fingerprint, start_ns, bench_files[i].size);
+
+        start_ns = bench_time_ns ();
+        str_set (&structure, "");
+        cat_jpeg_structure (&structure, bench_files[i].path);
+        bench_stage_item (&decode, start_ns, bench_files[i].size);
+    }
+    str_free (&error_msg);
+    str_free (&structure);
+
+    str_cat_c (report, "  \"stages\": {\n");
+    str_cat_bench_stage (report, &walk, false);
+    str_cat_c (report, ",\n");
+    str_cat_bench_stage (report, &stat_stage, true);
+    str_cat_c (report, ",\n");
+    str_cat_bench_stage (report, &partial_hash, true);
+    str_cat_c (report, ",\n");
+    str_cat_bench_stage (report, &sample_signature, true);
+    str_cat_c (report, ",\n");
+    str_cat_bench_stage (report, &full_compare, true);
+    str_cat_c (report, ",\n");
+    str_cat_bench_stage (report, &fingerprint, true);
+    str_cat_c (report, ",\n");
+    str_cat_bench_stage (report, &decode, true);
+    str_cat_c (report, "\n  }\n");
+
+    mem_pool_destroy (&pool);
+}
+
+int main (int argc, char **argv)
+{
+    struct bench_config_t cfg = {
+        .files = 10000,
+        .dup_ratio = 0.2,
+        .jpg_ratio = 0.5,
+        .min_size = kilobyte(16),
+        .max_size = megabyte(4),
+        .seed = 1,
+        .assets = "tests",
+    };
+
+    char *arg;
+    if ((arg = get_cli_arg_opt ("--files", argv, argc)) != NULL) cfg.files = strtoull (arg, NULL, 10);
+    if ((arg = get_cli_arg_opt ("--dup-ratio", argv, argc)) != NULL) cfg.dup_ratio = strtod (arg, NULL);
+    if ((arg = get_cli_arg_opt ("--jpg-ratio", argv, argc)) != NULL) cfg.jpg_ratio = strtod (arg, NULL);
+    if ((arg = get_cli_arg_opt ("--min-size", argv, argc)) != NULL) cfg.min_size = strtoull (arg, NULL, 10);
+    if ((arg = get_cli_arg_opt ("--max-size", argv, argc)) != NULL) cfg.max_size = strtoull (arg, NULL, 10);
+    if ((arg = get_cli_arg_opt ("--seed", argv, argc)) != NULL) cfg.seed = strtoull (arg, NULL, 10);
+    if ((arg = get_cli_arg_opt ("--assets", argv, argc)) != NULL) cfg.assets = arg;
+    char *output_path = get_cli_arg_opt ("--output", argv, argc);
+
+    // All options take a value, so the last argument is the directory unless
+    // it's an option or its value.
+    char *dir = argc > 1 ? argv[argc-1] : NULL;
+    if (dir == NULL || dir[0] == '-' || (argc > 2 && argv[argc-2][0] == '-')) {
+        printf ("Usage:\n");
+        printf ("bench [--files N] [--dup-ratio R] [--jpg-ratio R] [--min-size BYTES] [--max-size BYTES] [--seed S] [--assets DIR] [--output FILE] DIR\n");
+        return 1;
+    }
+
+    if (cfg.files == 0 || cfg.min_size == 0 || cfg.max_size < cfg.min_size ||
+        cfg.dup_ratio < 0 || cfg.dup_ratio >= 1 || cfg.jpg_ratio < 0 || cfg.jpg_ratio > 1) {
+        printf (ECMA_RED("error:") " invalid parameters.\n");
+        return 1;
+    }
+
+    mem_pool_t pool = {0};
+    // abs_path() only works for existing paths.
+    char *dir_path = NULL;
+    {
+        string_t dir_slash = {0};
+        str_set_printf (&dir_slash, "%s/", dir);
+        if (ensure_path_exists (str_data(&dir_slash))) {
+            dir_path = abs_path (dir, &pool);
+        }
+        str_free (&dir_slash);
+    }
+
+    if (dir_path == NULL || *dir_path == '\0') {
+        printf (ECMA_RED("error:") " could not create directory %s.\n", dir);
+        mem_pool_destroy (&pool);
+        return 1;
+    }
+
+    char *library_path = pprintf (&pool, "%s/library", dir_path);
+    char *params_path = pprintf (&pool, "%s/params", dir_path);
+
+    string_t params = {0};
+    str_set_printf (&params, "files=%lu dup_ratio=%g jpg_ratio=%g min_size=%lu max_size=%lu seed=%lu assets=%s\n",
+                    cfg.files, cfg.dup_ratio, cfg.jpg_ratio, cfg.min_size, cfg.max_size, cfg.seed, cfg.assets);
+
+    int retval = 0;
+    if (path_exists (params_path)) {
+        char *existing_params = full_file_read (&pool, params_path, NULL);
+        if (strcmp (existing_params, str_data(&params)) != 0) {
+            printf (ECMA_RED("error:") " %s has a library generated with different parameters, remove it first.\n", dir_path);
+            retval = 1;
+        } else {
+            fprintf (stderr, "Reusing library in %s\n", library_path);
+        }
+
+    } else if (path_exists (library_path)) {
+        printf (ECMA_RED("error:") " %s exists but wasn't generated by bench.\n", library_path);
+        retval = 1;
+
+    } else {
+        if (!bench_generate (&cfg, library_path) || full_file_write (str_data(&params), str_len(&params), params_path)) {
+            retval = 1;
+        }
+    }
+
+    if (retval == 0) {
+        string_t report = {0};
+        str_cat_c (&report, "{\n");
+        str_cat_printf (&report, "  \"config\": {\"files\": %lu, \"dup_ratio\": %g, \"jpg_ratio\": %g, "
+                        "\"min_size\": %lu, \"max_size\": %lu, \"seed\": %lu},\n",
+                        cfg.files, cfg.dup_ratio, cfg.jpg_ratio, cfg.min_size, cfg.max_size, cfg.seed);
+        bench_run (&cfg, library_path, &report);
+        str_cat_c (&report, "}\n");
+
+        if (output_path != NULL) {
+            if (full_file_write (str_data(&report), str_len(&report), output_path)) {
+                retval = 1;
+            }
+        } else {
+            printf ("%s", str_data(&report));
+        }
+        str_free (&report);
+    }
+
+    str_free (&params);
+    mem_pool_destroy (&pool);
+    return retval;
+}
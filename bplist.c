@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// Decoder for Apple's binary property lists ("bplist00"). These show up inside
+// the MakerNotes of pictures taken with iOS devices.
+//
+// A bplist is a list of objects, followed by a table with the offset of each
+// object and a 32 byte trailer. Containers reference their children by index
+// into the offset table. All values are big endian.
+//
+// Decoded values are allocated in the passed pool and don't point into the
+// decoded buffer, so it can be freed afterwards.
+
+#define BPLIST_MAX_DEPTH 32
+
+// Objects can be referenced more than once, so a small file can expand into a
+// huge tree. Decoding fails after this many values.
+#define BPLIST_MAX_VALUES 100000
+
+#define BPLIST_TRAILER_SIZE 32
+
+enum bplist_type_t {
+    BPLIST_TYPE_NULL,
+    BPLIST_TYPE_BOOL,
+    BPLIST_TYPE_INT,
+    BPLIST_TYPE_REAL,
+    BPLIST_TYPE_DATE,
+    BPLIST_TYPE_DATA,
+    BPLIST_TYPE_STRING,
+    BPLIST_TYPE_UID,
+    BPLIST_TYPE_ARRAY,
+    BPLIST_TYPE_DICT
+};
+
+struct bplist_value_t {
+    enum bplist_type_t type;
+
+    bool bool_value;
+    int64_t int_value; // Also used for UID
+    double real_value; // Dates are seconds since 2001-01-01
+
+    // DATA. Strings are NULL terminated UTF-8, UTF-16 ones are converted.
+    uint8_t *data;
+    uint64_t data_len;
+    char *str;
+
+    // ARRAY and DICT, keys is NULL for arrays.
+    struct bplist_value_t **keys;
+    struct bplist_value_t **values;
+    uint64_t len;
+};
+
+struct bplist_reader_t {
+    mem_pool_t *pool;
+
+    uint8_t *data;
+    uint64_t data_len;
+
+    uint8_t offset_int_size;
+    uint8_t object_ref_size;
+    uint64_t num_objects;
+    uint64_t top_object;
+    uint64_t offset_table_offset;
+
+    uint64_t values_len;
+
+    bool error;
+    string_t *error_msg;
+};
+
+GCC_PRINTF_FORMAT(2, 3)
+void bplist_error (struct bplist_reader_t *bp, const char *format, ...)
+{
+    if (!bp->error && bp->error_msg != NULL) {
+        PRINTF_INIT (format, size, args);
+        str_maybe_grow (bp->error_msg, size-1, false);
+        PRINTF_SET (str_data(bp->error_msg), size, format, args);
+    }
+
+    bp->error = true;
+}
+
+static inline
+uint64_t bplist_read_uint (uint8_t *bytes, int size)
+{
+    uint64_t value = 0;
+    for (int i=0; i<size; i++) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+// Returns a pointer to len bytes at offset, or NULL if they are outside of the
+// object area.
+uint8_t* bplist_bytes (struct bplist_reader_t *bp, uint64_t offset, uint64_t len)
+{
+    if (offset > bp->offset_table_offset || len > bp->offset_table_offset - offset) {
+        bplist_error (bp, "Object at offset %lu of length %lu is out of bounds.", offset, len);
+        return NULL;
+    }
+
+    return bp->data + offset;
+}
+
+// Reads the length that follows the marker of data, strings and containers.
+// The marker's low nibble is the length, or 0xF if it's stored in the next int
+// object.
+uint64_t bplist_read_length (struct bplist_reader_t *bp, uint8_t marker, uint64_t *offset)
+{
+    uint64_t len = marker & 0xF;
+    if (len == 0xF) {
+        uint8_t *int_marker = bplist_bytes (bp, *offset, 1);
+        if (int_marker == NULL) return 0;
+
+        if ((*int_marker & 0xF0) != 0x10 || (*int_marker & 0xF) > 3) {
+            bplist_error (bp, "Invalid length marker 0x%X.", *int_marker);
+            return 0;
+        }
+
+        int size = 1 << (*int_marker & 0xF);
+        uint8_t *bytes = bplist_bytes (bp, *offset + 1, size);
+        if (bytes == NULL) return 0;
+
+        len = bplist_read_uint (bytes, size);
+        *offset += 1 + size;
+    }
+
+    return len;
+}
+
+// Appends the UTF-8 encoding of a UTF-16BE string.
+void str_cat_utf16be (string_t *str, uint8_t *data, uint64_t len)
+{
+    for (uint64_t i=0; i<len; i++) {
+        uint32_t c = bplist_read_uint (data + 2*i, 2);
+        if (c >= 0xD800 && c < 0xDC00 && i+1 < len) {
+            uint32_t low = bplist_read_uint (data + 2*(i+1), 2);
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+
+        char buff[4];
+        int buff_len;
+        if (c < 0x80) {
+            buff[0] = c;
+            buff_len = 1;
+        } else if (c < 0x800) {
+            buff[0] = 0xC0 | (c >> 6);
+            buff[1] = 0x80 | (c & 0x3F);
+            buff_len = 2;
+        } else if (c < 0x10000) {
+            buff[0] = 0xE0 | (c >> 12);
+            buff[1] = 0x80 | ((c >> 6) & 0x3F);
+            buff[2] = 0x80 | (c & 0x3F);
+            buff_len = 3;
+        } else {
+            buff[0] = 0xF0 | (c >> 18);
+            buff[1] = 0x80 | ((c >> 12) & 0x3F);
+            buff[2] = 0x80 | ((c >> 6) & 0x3F);
+            buff[3] = 0x80 | (c & 0x3F);
+            buff_len = 4;
+        }
+        strn_cat_c (str, buff, buff_len);
+    }
+}
+
+struct bplist_value_t* bplist_read_object (struct bplist_reader_t *bp, uint64_t ref, int depth);
+
+struct bplist_value_t** bplist_read_refs (struct bplist_reader_t *bp, uint64_t offset, uint64_t len, int depth)
+{
+    uint8_t *refs = len <= BPLIST_MAX_VALUES ? bplist_bytes (bp, offset, len*bp->object_ref_size) : NULL;
+    if (refs == NULL) {
+        bplist_error (bp, "Container of %lu elements is out of bounds.", len);
+        return NULL;
+    }
+
+    struct bplist_value_t **values = mem_pool_push_array (bp->pool, len, struct bplist_value_t*);
+    for (uint64_t i=0; !bp->error && i<len; i++) {
+        uint64_t child_ref = bplist_read_uint (refs + i*bp->object_ref_size, bp->object_ref_size);
+        values[i] = bplist_read_object (bp, child_ref, depth + 1);
+    }
+
+    return values;
+}
+
+struct bplist_value_t* bplist_read_object (struct bplist_reader_t *bp, uint64_t ref, int depth)
+{
+    if (ref >= bp->num_objects) {
+        bplist_error (bp, "Invalid object reference %lu.", ref);
+        return NULL;
+    }
+
+    if (depth > BPLIST_MAX_DEPTH) {
+        bplist_error (bp, "Objects nested more than %d levels.", BPLIST_MAX_DEPTH);
+        return NULL;
+    }
+
+    if (++bp->values_len > BPLIST_MAX_VALUES) {
+        bplist_error (bp, "More than %d values.", BPLIST_MAX_VALUES);
+        return NULL;
+    }
+
+    uint8_t *offset_bytes = bp->data + bp->offset_table_offset + ref*bp->offset_int_size;
+    uint64_t offset = bplist_read_uint (offset_bytes, bp->offset_int_size);
+
+    uint8_t *marker_ptr = bplist_bytes (bp, offset, 1);
+    if (marker_ptr == NULL) return NULL;
+    uint8_t marker = *marker_ptr;
+    offset++;
+
+    struct bplist_value_t *value = mem_pool_push_struct (bp->pool, struct bplist_value_t);
+    *value = ZERO_INIT (struct bplist_value_t);
+
+    uint8_t *bytes;
+    switch (marker >> 4) {
+        case 0x0:
+            if (marker == 0x08 || marker == 0x09) {
+                value->type = BPLIST_TYPE_BOOL;
+                value->bool_value = marker == 0x09;
+            } else {
+                value->type = BPLIST_TYPE_NULL;
+            }
+            break;
+
+        case 0x1:
+            {
+                int size = 1 << (marker & 0xF);
+                if (size > 8) {
+                    // 16 byte ints are only used for values that don't fit
+                    // in 64 bits, we don't support them.
+                    bplist_error (bp, "Unsupported integer of %d bytes.", size);
+                } else if ((bytes = bplist_bytes (bp, offset, size)) != NULL) {
+                    value->type = BPLIST_TYPE_INT;
+                    value->int_value = (int64_t)bplist_read_uint (bytes, size);
+                }
+            } break;
+
+        case 0x2:
+        case 0x3:
+            {
+                int size = marker == 0x33 ? 8 : 1 << (marker & 0xF);
+                if (size != 4 && size != 8) {
+                    bplist_error (bp, "Unsupported real of %d bytes.", size);
+                } else if ((bytes = bplist_bytes (bp, offset, size)) != NULL) {
+                    value->type = (marker >> 4) == 0x3 ? BPLIST_TYPE_DATE : BPLIST_TYPE_REAL;
+                    if (size == 4) {
+                        uint32_t bits = bplist_read_uint (bytes, 4);
+                        float f;
+                        memcpy (&f, &bits, 4);
+                        value->real_value = f;
+                    } else {
+                        uint64_t bits = bplist_read_uint (bytes, 8);
+                        memcpy (&value->real_value, &bits, 8);
+                    }
+                }
+            } break;
+
+        case 0x4:
+        case 0x5:
+        case 0x6:
+            {
+                uint64_t len = bplist_read_length (bp, marker, &offset);
+
+                // UTF-16 strings store len code units of 2 bytes, check the
+                // length before multiplying so it can't wrap around.
+                uint64_t byte_len = len;
+                if ((marker >> 4) == 0x6) {
+                    if (len > UINT64_MAX/2) {
+                        bplist_error (bp, "String of %lu code units is out of bounds.", len);
+                    }
+                    byte_len = 2*len;
+                }
+
+                if (!bp->error && (bytes = bplist_bytes (bp, offset, byte_len)) != NULL) {
+                    if ((marker >> 4) == 0x4) {
+                        value->type = BPLIST_TYPE_DATA;
+                        value->data = pom_dup (bp->pool, bytes, len);
+                        value->data_len = len;
+
+                    } else if ((marker >> 4) == 0x5) {
+                        value->type = BPLIST_TYPE_STRING;
+                        value->str = pom_strndup (bp->pool, (char*)bytes, len);
+
+                    } else {
+                        string_t str = {0};
+                        str_cat_utf16be (&str, bytes, len);
+                        value->type = BPLIST_TYPE_STRING;
+                        value->str = pom_strndup (bp->pool, str_data(&str), str_len(&str));
+                        str_free (&str);
+                    }
+                }
+            } break;
+
+        case 0x8:
+            {
+                int size = (marker & 0xF) + 1;
+                if ((bytes = bplist_bytes (bp, offset, size)) != NULL) {
+                    value->type = BPLIST_TYPE_UID;
+                    value->int_value = bplist_read_uint (bytes, size);
+                }
+            } break;
+
+        case 0xA:
+        case 0xC: // Sets are decoded as arrays.
+            {
+                uint64_t len = bplist_read_length (bp, marker, &offset);
+                if (!bp->error) {
+                    value->type = BPLIST_TYPE_ARRAY;
+                    value->len = len;
+                    value->values = bplist_read_refs (bp, offset, len, depth);
+                }
+            } break;
+
+        case 0xD:
+            {
+                uint64_t len = bplist_read_length (bp, marker, &offset);
+                if (!bp->error) {
+                    value->type = BPLIST_TYPE_DICT;
+                    value->len = len;
+                    value->keys = bplist_read_refs (bp, offset, len, depth);
+                    value->values = bplist_read_refs (bp, offset + len*bp->object_ref_size, len, depth);
+                }
+            } break;
+
+        default:
+            bplist_error (bp, "Unknown object marker 0x%X.", marker);
+    }
+
+    return bp->error ? NULL : value;
+}
+
+bool is_bplist (uint8_t *data, uint64_t data_len)
+{
+    return data_len >= 8 + BPLIST_TRAILER_SIZE && memcmp (data, "bplist00", 8) == 0;
+}
+
+// Returns the top object, or NULL if the data isn't a valid bplist, in which
+// case the reason is set in error_msg if it's not NULL.
+struct bplist_value_t* bplist_decode (mem_pool_t *pool, uint8_t *data, uint64_t data_len, string_t *error_msg)
+{
+    struct bplist_reader_t _bp = {0};
+    struct bplist_reader_t *bp = &_bp;
+    bp->pool = pool;
+    bp->data = data;
+    bp->data_len = data_len;
+    bp->error_msg = error_msg;
+
+    if (!is_bplist (data, data_len)) {
+        bplist_error (bp, "Missing bplist00 header.");
+        return NULL;
+    }
+
+    uint8_t *trailer = data + data_len - BPLIST_TRAILER_SIZE;
+    bp->offset_int_size = trailer[6];
+    bp->object_ref_size = trailer[7];
+    bp->num_objects = bplist_read_uint (trailer + 8, 8);
+    bp->top_object = bplist_read_uint (trailer + 16, 8);
+    bp->offset_table_offset = bplist_read_uint (trailer + 24, 8);
+
+    uint64_t trailer_offset = data_len - BPLIST_TRAILER_SIZE;
+    if (bp->offset_int_size < 1 || bp->offset_int_size > 8 ||
+        bp->object_ref_size < 1 || bp->object_ref_size > 8 ||
+        bp->offset_table_offset < 8 || bp->offset_table_offset > trailer_offset ||
+        bp->num_objects > (trailer_offset - bp->offset_table_offset)/bp->offset_int_size) {
+        bplist_error (bp, "Invalid bplist trailer.");
+        return NULL;
+    }
+
+    return bplist_read_object (bp, bp->top_object, 0);
+}
+
+void str_cat_bplist_value (string_t *str, struct bplist_value_t *value)
+{
+    switch (value->type) {
+        case BPLIST_TYPE_NULL:
+            str_cat_c (str, "null");
+            break;
+        case BPLIST_TYPE_BOOL:
+            str_cat_c (str, value->bool_value ? "true" : "false");
+            break;
+        case BPLIST_TYPE_INT:
+            str_cat_printf (str, "%ld", value->int_value);
+            break;
+        case BPLIST_TYPE_REAL:
+            str_cat_printf (str, "%g", value->real_value);
+            break;
+        case BPLIST_TYPE_DATE:
+            str_cat_printf (str, "date(%f)", value->real_value);
+            break;
+        case BPLIST_TYPE_UID:
+            str_cat_printf (str, "uid(%ld)", value->int_value);
+            break;
+        case BPLIST_TYPE_STRING:
+            str_cat_printf (str, "\"%s\"", value->str);
+            break;
+        case BPLIST_TYPE_DATA:
+            str_cat_c (str, "<");
+            for (uint64_t i=0; i<value->data_len; i++) {
+                str_cat_printf (str, "%02X", value->data[i]);
+            }
+            str_cat_c (str, ">");
+            break;
+        case BPLIST_TYPE_ARRAY:
+            str_cat_c (str, "[");
+            for (uint64_t i=0; i<value->len; i++) {
+                if (i > 0) str_cat_c (str, ", ");
+                str_cat_bplist_value (str, value->values[i]);
+            }
+            str_cat_c (str, "]");
+            break;
+        case BPLIST_TYPE_DICT:
+            str_cat_c (str, "{");
+            for (uint64_t i=0; i<value->len; i++) {
+                if (i > 0) str_cat_c (str, ", ");
+                str_cat_bplist_value (str, value->keys[i]);
+                str_cat_c (str, ": ");
+                str_cat_bplist_value (str, value->values[i]);
+            }
+            str_cat_c (str, "}");
+            break;
+    }
+}
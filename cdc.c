@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// Content defined chunking using the FastCDC algorithm.
+//
+// Files are split at positions chosen by a rolling hash of the content
+// instead of at fixed offsets. Inserting or removing bytes only changes
+// the chunks around the edit, so a trimmed or truncated copy of a file
+// still shares most of its chunk hashes with the original.
+//
+// The rolling hash is a gear hash: h = (h << 1) + gear[byte]. Each byte
+// shifts out of the hash after 64 steps, so bit k only depends on the
+// last k+1 bytes. That's why the cut masks test the high bits. Each
+// step depends on the previous hash, so the loop is scalar.
+//
+// Chunk sizes use normalized chunking. A stricter mask is used before
+// CDC_AVG_SIZE and a looser one after it, which keeps chunk sizes close
+// to the average.
+
+#define CDC_MIN_SIZE kilobyte(16)
+#define CDC_AVG_BITS 16
+#define CDC_AVG_SIZE (1LL<<CDC_AVG_BITS)
+#define CDC_MAX_SIZE kilobyte(256)
+
+#define CDC_MASK(bits) (~0ULL << (64-(bits)))
+#define CDC_MASK_S CDC_MASK(CDC_AVG_BITS+2)
+#define CDC_MASK_L CDC_MASK(CDC_AVG_BITS-2)
+
+// Size of the buffer used to stream files, must be larger than
+// CDC_MAX_SIZE.
+#define CDC_READ_SIZE megabyte(4)
+
+// Read buffers are reused across files instead of being allocated, and
+// page faulted in, again for every file.
+static struct buff_recycler_t g_cdc_read_buffs = BUFF_RECYCLER_INIT(CDC_READ_SIZE);
+
+static uint64_t g_cdc_gear[256];
+static bool g_cdc_gear_ready = false;
+
+// The gear table only needs to be random looking, but it has to be the
+// same across runs so chunk hashes can be compared. It's generated with
+// splitmix64 from a fixed seed.
+void cdc_gear_init ()
+{
+    if (g_cdc_gear_ready) return;
+
+    uint64_t state = 0x5eed5c7a9b00c0deULL;
+    for (int i=0; i<ARRAY_SIZE(g_cdc_gear); i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g_cdc_gear[i] = z ^ (z >> 31);
+    }
+    g_cdc_gear_ready = true;
+}
+
+// Returns the length of the chunk that starts at data. If len is smaller
+// than CDC_MIN_SIZE the whole buffer is a single chunk, this only
+// happens at the end of a file.
+uint64_t cdc_cut (uint8_t *data, uint64_t len)
+{
+    if (len <= CDC_MIN_SIZE) {
+        return len;
+    }
+
+    uint64_t end = MIN(len, CDC_MAX_SIZE);
+    uint64_t normal = MIN(CDC_AVG_SIZE, end);
+
+    uint64_t h = 0;
+    uint64_t i = CDC_MIN_SIZE;
+    for (; i<normal; i++) {
+        h = (h << 1) + g_cdc_gear[data[i]];
+        if (!(h & CDC_MASK_S)) return i+1;
+    }
+
+    for (; i<end; i++) {
+        h = (h << 1) + g_cdc_gear[data[i]];
+        if (!(h & CDC_MASK_L)) return i+1;
+    }
+
+    return end;
+}
+
+struct cdc_chunk_t {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t len;
+};
+
+#define CDC_CHUNK_CB(name) void name(struct cdc_chunk_t *chunk, void *data)
+typedef CDC_CHUNK_CB(cdc_chunk_cb_t);
+
+// Reads the file at path in blocks of CDC_READ_SIZE and calls cb for each
+// chunk in order. Memory use doesn't depend on the size of the file.
+bool cdc_file_chunks (char *path, cdc_chunk_cb_t *cb, void *cb_data, uint64_t *file_size, string_t *error_msg)
+{
+    assert (CDC_READ_SIZE > CDC_MAX_SIZE);
+    cdc_gear_init ();
+
+    int file = open (path, O_RDONLY);
+    trace_count (TRACE_COUNTER_OPEN, 1);
+    if (file == -1) {
+        if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+        return false;
+    }
+
+    bool success = true;
+    uint8_t *buff = buff_recycler_get (&g_cdc_read_buffs);
+    uint64_t buff_len = 0;
+    uint64_t pos = 0;
+    bool eof = false;
+
+    struct cdc_chunk_t chunk = {0};
+    while (true) {
+        // Keep at least CDC_MAX_SIZE bytes ahead of pos so chunk boundaries
+        // don't depend on where block reads ended.
+        if (!eof && buff_len - pos < CDC_MAX_SIZE) {
+            memmove (buff, buff + pos, buff_len - pos);
+            buff_len -= pos;
+            pos = 0;
+
+            while (!eof && buff_len < CDC_READ_SIZE) {
+                ssize_t status = read (file, buff + buff_len, CDC_READ_SIZE - buff_len);
+                trace_count (TRACE_COUNTER_READ, 1);
+                if (status == -1) {
+                    if (errno == EINTR) continue;
+
+                    success = false;
+                    if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+                    break;
+
+                } else if (status == 0) {
+                    eof = true;
+
+                } else {
+                    buff_len += status;
+                    trace_count (TRACE_COUNTER_BYTES_READ, status);
+                }
+            }
+
+            if (!success) break;
+        }
+
+        if (pos == buff_len) break;
+
+        chunk.len = cdc_cut (buff + pos, buff_len - pos);
+        chunk.hash = hash_64_unpadded (buff + pos, chunk.len);
+
+        cb (&chunk, cb_data);
+
+        chunk.offset += chunk.len;
+        pos += chunk.len;
+    }
+
+    if (file_size != NULL) {
+        *file_size = chunk.offset;
+    }
+
+    buff_recycler_put (&g_cdc_read_buffs, buff);
+    close (file);
+    return success;
+}
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
@@ -1816,54 +1817,98 @@ void swap_n_bytes (void *a, void*b, uint32_t n)
 // IS_A_LT_B is an expression where a and b are pointers
 // to _arr_ true when *a<*b.
 // NOTE: IS_A_LT_B as defined, will sort the array in ascending order.
-#define templ_sort(FUNCNAME,TYPE,IS_A_LT_B)                                       \
+//
+// The merge sort is bottom up. Runs of TEMPL_SORT_INSERTION_CUTOFF elements
+// are sorted with insertion sort, then merged in passes of doubling width that
+// alternate between the array and a single scratch buffer of n elements. This
+// keeps stack usage constant regardless of n, and each pass moves elements
+// once instead of merging into a temporary and copying back.
+#define TEMPL_SORT_INSERTION_CUTOFF 16
+
+// Implementation shared by all array sorts. It expects FUNCNAME ## _take_left()
+// to be defined, it must return true if, while merging, element a of the left
+// run should go before element b of the right run.
+#define _templ_sort_implementation(FUNCNAME,TYPE)                                 \
+static inline                                                                     \
+void FUNCNAME ## _insertion (TYPE *arr, int64_t n, void *user_data)               \
+{                                                                                 \
+    for (int64_t i=1; i<n; i++) {                                                 \
+        TYPE tmp = arr[i];                                                        \
+        int64_t j = i;                                                            \
+        while (j > 0 && !FUNCNAME ## _take_left (&arr[j-1], &tmp, user_data)) {  \
+            arr[j] = arr[j-1];                                                    \
+            j--;                                                                  \
+        }                                                                         \
+        arr[j] = tmp;                                                             \
+    }                                                                             \
+}                                                                                 \
+                                                                                  \
+static inline                                                                     \
+void FUNCNAME ## _merge (TYPE *src, int64_t lo, int64_t mid, int64_t hi,          \
+                         TYPE *dst, void *user_data)                              \
+{                                                                                 \
+    int64_t i = lo;                                                               \
+    int64_t h = lo;                                                               \
+    int64_t k = mid;                                                              \
+    while (h < mid && k < hi) {                                                   \
+        if (FUNCNAME ## _take_left (&src[h], &src[k], user_data)) {               \
+            dst[i++] = src[h++];                                                  \
+        } else {                                                                  \
+            dst[i++] = src[k++];                                                  \
+        }                                                                         \
+    }                                                                             \
+                                                                                  \
+    while (h < mid) dst[i++] = src[h++];                                          \
+    while (k < hi) dst[i++] = src[k++];                                           \
+}                                                                                 \
+                                                                                  \
+/* Sorts arr using tmp as scratch buffer of the same size. The result may end
+ * up in either of them, the one that has it is returned.
+ */                                                                               \
+static inline                                                                     \
+TYPE* FUNCNAME ## _sort_into (TYPE *arr, TYPE *tmp, int64_t n, void *user_data)   \
+{                                                                                 \
+    for (int64_t lo=0; lo<n; lo+=TEMPL_SORT_INSERTION_CUTOFF) {                   \
+        FUNCNAME ## _insertion (&arr[lo], MIN(TEMPL_SORT_INSERTION_CUTOFF, n-lo), \
+                                user_data);                                       \
+    }                                                                             \
+                                                                                  \
+    TYPE *src = arr;                                                              \
+    TYPE *dst = tmp;                                                              \
+    for (int64_t width=TEMPL_SORT_INSERTION_CUTOFF; width<n; width*=2) {          \
+        for (int64_t lo=0; lo<n; lo+=2*width) {                                   \
+            FUNCNAME ## _merge (src, lo, MIN(lo+width, n), MIN(lo+2*width, n),    \
+                                dst, user_data);                                  \
+        }                                                                         \
+                                                                                  \
+        TYPE *swap_tmp = src;                                                     \
+        src = dst;                                                                \
+        dst = swap_tmp;                                                           \
+    }                                                                             \
+                                                                                  \
+    return src;                                                                   \
+}                                                                                 \
+                                                                                  \
 void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                   \
 {                                                                                 \
     if (arr == NULL || n<=1) {                                                    \
         return;                                                                   \
-    } else if (n == 2) {                                                          \
-        TYPE *a = &arr[1];                                                        \
-        TYPE *b = &arr[0];                                                        \
-        int c = IS_A_LT_B;                                                        \
-        if (c) {                                                                  \
-            swap_n_bytes (&arr[0], &arr[1], sizeof(TYPE));                        \
-        }                                                                         \
-    } else {                                                                      \
-        TYPE res[n];                                                              \
-        FUNCNAME ## _user_data (arr, n/2, user_data);                             \
-        FUNCNAME ## _user_data (&arr[n/2], n-n/2, user_data);                     \
                                                                                   \
-        /* Merge halfs until one of them runs out*/                               \
-        int i;                                                                    \
-        int h=0;                                                                  \
-        int k=n/2;                                                                \
-        for (i=0; k<n && h<n/2; i++) {                                            \
-            TYPE *a = &arr[h];                                                    \
-            TYPE *b = &arr[k];                                                    \
-            int c = IS_A_LT_B;                                                    \
-            if (c) {                                                              \
-                res[i] = arr[h];                                                  \
-                h++;                                                              \
-            } else {                                                              \
-                res[i] = arr[k];                                                  \
-                k++;                                                              \
-            }                                                                     \
-        }                                                                         \
+    } else if (n <= TEMPL_SORT_INSERTION_CUTOFF) {                                \
+        FUNCNAME ## _insertion (arr, n, user_data);                               \
                                                                                   \
-        /* If there are elements remaining in one half copy them. Separating
-         * loop this way avoids evaluating CMP_A_TO_B for invalid elements (past
-         * the maximum value for h).
-         */                                                                       \
-        int rest_idx = k==n ? h : k;                                              \
-        for (; i<n; i++) {                                                        \
-            res[i] = arr[rest_idx];                                               \
-            rest_idx++;                                                           \
+    } else {                                                                      \
+        TYPE *tmp = malloc (n*sizeof(TYPE));                                      \
+        if (tmp == NULL) {                                                        \
+            FUNCNAME ## _insertion (arr, n, user_data);                           \
+            return;                                                               \
         }                                                                         \
                                                                                   \
-        /* Copy the sorted array back from the temporary array. */                \
-        for (i=0; i<n; i++) {                                                     \
-            arr[i] = res[i];                                                      \
+        TYPE *res = FUNCNAME ## _sort_into (arr, tmp, n, user_data);              \
+        if (res != arr) {                                                         \
+            memcpy (arr, res, n*sizeof(TYPE));                                    \
         }                                                                         \
+        free (tmp);                                                               \
     }                                                                             \
 }                                                                                 \
                                                                                   \
@@ -1871,6 +1916,15 @@ void FUNCNAME(TYPE *arr, int n) {
     FUNCNAME ## _user_data (arr,n,NULL);                                          \
 }
 
+#define templ_sort(FUNCNAME,TYPE,IS_A_LT_B)                                       \
+static inline                                                                     \
+bool FUNCNAME ## _take_left (TYPE *a, TYPE *b, void *user_data)                   \
+{                                                                                 \
+    int c = IS_A_LT_B;                                                            \
+    return c;                                                                     \
+}                                                                                 \
+_templ_sort_implementation(FUNCNAME,TYPE)
+
 // Stable templetized merge sort for arrays
 //
 // CMP_A_TO_B is an expression where a and b are pointers to _arr_. Its value is
@@ -1884,59 +1938,221 @@ void FUNCNAME(TYPE *arr, int n) {
 //
 // NOTE: CMP_A_TO_B as defined, will sort the array in ascending order.
 #define templ_sort_stable(FUNCNAME,TYPE,CMP_A_TO_B)                               \
-void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                   \
+static inline                                                                     \
+bool FUNCNAME ## _take_left (TYPE *a, TYPE *b, void *user_data)                   \
+{                                                                                 \
+    int c = CMP_A_TO_B;                                                           \
+    return c < 1;                                                                 \
+}                                                                                 \
+_templ_sort_implementation(FUNCNAME,TYPE)
+
+#ifdef _PTHREAD_H
+// Parallel versions of templ_sort() and templ_sort_stable(). Besides the usual
+// functions they define FUNCNAME ## _parallel(), which splits the array in one
+// part per thread, sorts each part on its own thread and then merges pairs of
+// parts, also in parallel, until a single one is left. If num_threads is 0,
+// the number of online processors is used.
+//
+// Starting threads isn't free, callers decide which arrays are large, or have
+// expensive enough comparisons, for this to pay off. Parts are never smaller
+// than TEMPL_SORT_INSERTION_CUTOFF elements, smaller arrays are sorted by the
+// calling thread.
+//
+// NOTE: These are only available if pthread.h is included before common.h.
+
+#define _templ_sort_parallel_implementation(FUNCNAME,TYPE)                        \
+struct FUNCNAME ## _parallel_task_t {                                             \
+    TYPE *src;                                                                    \
+    TYPE *dst;                                                                    \
+    int64_t lo;                                                                   \
+    int64_t mid;                                                                  \
+    int64_t hi;                                                                   \
+    void *user_data;                                                              \
+};                                                                                \
+                                                                                  \
+void* FUNCNAME ## _parallel_sort_worker (void *data)                              \
+{                                                                                 \
+    struct FUNCNAME ## _parallel_task_t *task = data;                             \
+    int64_t len = task->hi - task->lo;                                            \
+    TYPE *res = FUNCNAME ## _sort_into (&task->src[task->lo], &task->dst[task->lo],\
+                                        len, task->user_data);                    \
+    if (res != &task->src[task->lo]) {                                            \
+        memcpy (&task->src[task->lo], res, len*sizeof(TYPE));                     \
+    }                                                                             \
+    return NULL;                                                                  \
+}                                                                                 \
+                                                                                  \
+void* FUNCNAME ## _parallel_merge_worker (void *data)                             \
+{                                                                                 \
+    struct FUNCNAME ## _parallel_task_t *task = data;                             \
+    FUNCNAME ## _merge (task->src, task->lo, task->mid, task->hi, task->dst,      \
+                        task->user_data);                                         \
+    return NULL;                                                                  \
+}                                                                                 \
+                                                                                  \
+void FUNCNAME ## _parallel_user_data (TYPE *arr, int n, int num_threads,          \
+                                      void *user_data)                            \
+{                                                                                 \
+    if (num_threads <= 0) {                                                       \
+        num_threads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));                    \
+    }                                                                             \
+    num_threads = MIN (num_threads, n/TEMPL_SORT_INSERTION_CUTOFF);               \
+                                                                                  \
+    TYPE *tmp = NULL;                                                             \
+    if (num_threads > 1) {                                                        \
+        tmp = malloc (n*sizeof(TYPE));                                            \
+    }                                                                             \
+                                                                                  \
+    if (tmp == NULL) {                                                            \
+        FUNCNAME ## _user_data (arr, n, user_data);                               \
+        return;                                                                   \
+    }                                                                             \
+                                                                                  \
+    int num_parts = num_threads;                                                  \
+    int64_t bounds[num_parts+1];                                                  \
+    for (int i=0; i<=num_parts; i++) {                                            \
+        bounds[i] = (int64_t)n*i/num_parts;                                       \
+    }                                                                             \
+                                                                                  \
+    pthread_t threads[num_parts];                                                 \
+    struct FUNCNAME ## _parallel_task_t tasks[num_parts];                         \
+    for (int i=0; i<num_parts; i++) {                                             \
+        tasks[i] = (struct FUNCNAME ## _parallel_task_t){                         \
+            .src = arr, .dst = tmp,                                               \
+            .lo = bounds[i], .hi = bounds[i+1],                                   \
+            .user_data = user_data                                                \
+        };                                                                        \
+        pthread_create (&threads[i], NULL, FUNCNAME ## _parallel_sort_worker, &tasks[i]);\
+    }                                                                             \
+    for (int i=0; i<num_parts; i++) {                                             \
+        pthread_join (threads[i], NULL);                                          \
+    }                                                                             \
+                                                                                  \
+    TYPE *src = arr;                                                              \
+    TYPE *dst = tmp;                                                              \
+    while (num_parts > 1) {                                                       \
+        int num_tasks = (num_parts+1)/2;                                          \
+        for (int i=0; i<num_tasks; i++) {                                         \
+            int64_t hi = bounds[MIN(2*i+2, num_parts)];                           \
+            tasks[i] = (struct FUNCNAME ## _parallel_task_t){                     \
+                .src = src, .dst = dst,                                           \
+                .lo = bounds[2*i], .mid = bounds[MIN(2*i+1, num_parts)], .hi = hi,\
+                .user_data = user_data                                            \
+            };                                                                    \
+            pthread_create (&threads[i], NULL, FUNCNAME ## _parallel_merge_worker, &tasks[i]);\
+        }                                                                         \
+        for (int i=0; i<num_tasks; i++) {                                         \
+            pthread_join (threads[i], NULL);                                      \
+        }                                                                         \
+                                                                                  \
+        for (int i=0; i<num_tasks; i++) {                                         \
+            bounds[i+1] = bounds[MIN(2*i+2, num_parts)];                          \
+        }                                                                         \
+        num_parts = num_tasks;                                                    \
+                                                                                  \
+        TYPE *swap_tmp = src;                                                     \
+        src = dst;                                                                \
+        dst = swap_tmp;                                                           \
+    }                                                                             \
+                                                                                  \
+    if (src != arr) {                                                             \
+        memcpy (arr, src, n*sizeof(TYPE));                                        \
+    }                                                                             \
+    free (tmp);                                                                   \
+}                                                                                 \
+                                                                                  \
+void FUNCNAME ## _parallel (TYPE *arr, int n, int num_threads) {                  \
+    FUNCNAME ## _parallel_user_data (arr,n,num_threads,NULL);                     \
+}
+
+#define templ_sort_parallel(FUNCNAME,TYPE,IS_A_LT_B)                              \
+templ_sort(FUNCNAME,TYPE,IS_A_LT_B)                                               \
+_templ_sort_parallel_implementation(FUNCNAME,TYPE)
+
+#define templ_sort_stable_parallel(FUNCNAME,TYPE,CMP_A_TO_B)                      \
+templ_sort_stable(FUNCNAME,TYPE,CMP_A_TO_B)                                       \
+_templ_sort_parallel_implementation(FUNCNAME,TYPE)
+#endif /*_PTHREAD_H*/
+
+// Templetized LSD radix sort for arrays
+//
+// KEY is an expression where a is a pointer to an element of _arr_, it
+// evaluates to the unsigned integer of up to 64 bits the array is sorted by,
+// in ascending order. The sort is stable and takes linear time, it's better
+// than templ_sort() for large arrays keyed by sizes or hashes.
+//
+// Keys are sorted by digits of TEMPL_RADIX_SORT_DIGIT_BITS. Histograms for all
+// digits are computed in a single pass, digits where all keys are the same are
+// skipped, so small keys only cost the passes they need. Passes alternate
+// between the array and a scratch buffer of n elements. If the scratch buffer
+// can't be allocated, the array is sorted with templ_sort_stable() instead.
+#define TEMPL_RADIX_SORT_DIGIT_BITS 8
+#define TEMPL_RADIX_SORT_NUM_DIGITS (64/TEMPL_RADIX_SORT_DIGIT_BITS)
+#define TEMPL_RADIX_SORT_RADIX (1<<TEMPL_RADIX_SORT_DIGIT_BITS)
+#define TEMPL_RADIX_SORT_DIGIT(key,d) \
+    (((key) >> ((d)*TEMPL_RADIX_SORT_DIGIT_BITS)) & (TEMPL_RADIX_SORT_RADIX-1))
+
+#define templ_radix_sort(FUNCNAME,TYPE,KEY)                                       \
+static inline                                                                     \
+uint64_t FUNCNAME ## _key (TYPE *a)                                               \
+{                                                                                 \
+    return (KEY);                                                                 \
+}                                                                                 \
+                                                                                  \
+templ_sort_stable (FUNCNAME ## _fallback, TYPE,                                   \
+                   (FUNCNAME ## _key (a) > FUNCNAME ## _key (b)) -                \
+                   (FUNCNAME ## _key (a) < FUNCNAME ## _key (b)))                 \
+                                                                                  \
+void FUNCNAME (TYPE *arr, int n)                                                  \
 {                                                                                 \
     if (arr == NULL || n<=1) {                                                    \
         return;                                                                   \
-    } else if (n == 2) {                                                          \
-        TYPE *a = &arr[1];                                                        \
-        TYPE *b = &arr[0];                                                        \
-        int c = CMP_A_TO_B;                                                       \
-        if (c < 0) {                                                              \
-            swap_n_bytes (&arr[0], &arr[1], sizeof(TYPE));                        \
+    }                                                                             \
+                                                                                  \
+    uint64_t counts[TEMPL_RADIX_SORT_NUM_DIGITS][TEMPL_RADIX_SORT_RADIX] = {0};   \
+    for (int i=0; i<n; i++) {                                                     \
+        uint64_t key = FUNCNAME ## _key (&arr[i]);                                \
+        for (int d=0; d<TEMPL_RADIX_SORT_NUM_DIGITS; d++) {                       \
+            counts[d][TEMPL_RADIX_SORT_DIGIT(key, d)]++;                          \
         }                                                                         \
+    }                                                                             \
                                                                                   \
-    } else {                                                                      \
-        TYPE res[n];                                                              \
-        FUNCNAME ## _user_data (arr, n/2, user_data);                             \
-        FUNCNAME ## _user_data (&arr[n/2], n-n/2, user_data);                     \
+    TYPE *tmp = NULL;                                                             \
+    TYPE *src = arr;                                                              \
+    uint64_t first_key = FUNCNAME ## _key (&arr[0]);                              \
+    for (int d=0; d<TEMPL_RADIX_SORT_NUM_DIGITS; d++) {                           \
+        if (counts[d][TEMPL_RADIX_SORT_DIGIT(first_key, d)] == (uint64_t)n) {     \
+            continue;                                                             \
+        }                                                                         \
                                                                                   \
-        /* Merge halfs until one of them runs out*/                               \
-        int i;                                                                    \
-        int h=0;                                                                  \
-        int k=n/2;                                                                \
-        for (i=0; k<n && h<n/2; i++) {                                            \
-            TYPE *a = &arr[h];                                                    \
-            TYPE *b = &arr[k];                                                    \
-            int c = CMP_A_TO_B;                                                   \
-            if (c < 1) {                                                          \
-                res[i] = arr[h];                                                  \
-                h++;                                                              \
-            } else {                                                              \
-                res[i] = arr[k];                                                  \
-                k++;                                                              \
+        /* Only the first pass allocates, nothing was moved yet if it fails. */   \
+        if (tmp == NULL) {                                                        \
+            tmp = malloc (n*sizeof(TYPE));                                        \
+            if (tmp == NULL) {                                                    \
+                FUNCNAME ## _fallback (arr, n);                                   \
+                return;                                                           \
             }                                                                     \
         }                                                                         \
+        TYPE *dst = src == arr ? tmp : arr;                                       \
                                                                                   \
-        /* If there are elements remaining in one half copy them. Separating
-         * loop this way avoids evaluating CMP_A_TO_B for invalid elements, past
-         * the end of the array.
-         */                                                                       \
-        int rest_idx = k==n ? h : k;                                              \
-        for (; i<n; i++) {                                                        \
-            res[i] = arr[rest_idx];                                               \
-            rest_idx++;                                                           \
+        uint64_t offsets[TEMPL_RADIX_SORT_RADIX];                                 \
+        uint64_t offset = 0;                                                      \
+        for (int r=0; r<TEMPL_RADIX_SORT_RADIX; r++) {                            \
+            offsets[r] = offset;                                                  \
+            offset += counts[d][r];                                               \
         }                                                                         \
                                                                                   \
-        /* Copy the sorted array back from the temporary array. */                \
-        for (i=0; i<n; i++) {                                                     \
-            arr[i] = res[i];                                                      \
+        for (int i=0; i<n; i++) {                                                 \
+            uint64_t key = FUNCNAME ## _key (&src[i]);                            \
+            dst[offsets[TEMPL_RADIX_SORT_DIGIT(key, d)]++] = src[i];              \
         }                                                                         \
+        src = dst;                                                                \
     }                                                                             \
-}                                                                                 \
                                                                                   \
-void FUNCNAME(TYPE *arr, int n) {                                                 \
-    FUNCNAME ## _user_data (arr,n,NULL);                                          \
+    if (src != arr) {                                                             \
+        memcpy (arr, src, n*sizeof(TYPE));                                        \
+    }                                                                             \
+    free (tmp);                                                                   \
 }
 
 // This is a function type to define sorting callbacks. It's not used in the
@@ -2320,18 +2536,39 @@ void cont_buff_destroy (cont_buff_t *buff)
     struct_type * ptr_name = &_ ## ptr_name
 
 // Memory pool that grows as needed, and can be freed easily.
+//
+// Each new bin is twice as big as the previous one, starting at min_bin_size
+// and up to MEM_POOL_MAX_BIN_SIZE. Pools that store lots of small things end
+// up using a few big bins instead of lots of small ones.
+//
+// Allocations of at least MEM_POOL_LARGE_ALLOC_SIZE that don't fit in the
+// current bin get a bin of their own, mapped with mmap() so it's returned to
+// the system as soon as it's freed.
+//
+// If huge_pages is set, bins of MEM_POOL_MAX_BIN_SIZE and large allocations
+// are backed by huge pages. MAP_HUGETLB is tried first, it only works if the
+// system has reserved huge pages, otherwise transparent huge pages are
+// requested with madvise().
 #define MEM_POOL_DEFAULT_MIN_BIN_SIZE 1024u
+#define MEM_POOL_HUGE_PAGE_SIZE megabyte(2)
+#define MEM_POOL_LARGE_ALLOC_SIZE megabyte(1)
 typedef struct {
-    uint32_t min_bin_size;
-    uint32_t size;
-    uint32_t used;
+    uint64_t min_bin_size;
+    uint64_t size;
+    uint64_t used;
     void *base;
 
     // total_data is the total used memory minus the memory used for
     // on_destroy_callback_info_t structs. We use this variable to compute the
     // ammount of empty space left in previous bins.
-    uint32_t total_data;
+    uint64_t total_data;
     uint32_t num_bins;
+
+    // Size of the last bin allocated because of normal growth, the next one
+    // will be twice as big.
+    uint64_t bin_size;
+
+    bool huge_pages;
 } mem_pool_t;
 
 // Sometimes we want to execute code when something we allocated in a pool gets
@@ -2371,14 +2608,80 @@ struct on_destroy_callback_info_t {
 
 struct _bin_info_t {
     void *base;
-    uint32_t size;
+    uint64_t size;
     struct _bin_info_t *prev_bin_info;
 
     struct on_destroy_callback_info_t *last_cb_info;
+
+    // Size of the mapping for bins allocated with mmap(), 0 if the bin was
+    // allocated with malloc().
+    uint64_t mapped_size;
 };
 
 typedef struct _bin_info_t bin_info_t;
 
+// Bins of this size fill exactly one huge page, including their bin_info_t.
+#define MEM_POOL_MAX_BIN_SIZE (MEM_POOL_HUGE_PAGE_SIZE - sizeof(bin_info_t))
+
+// The bin_info_t is stored at the end of the bin, size is rounded up so it's
+// aligned. Bins allocated with mmap() are rounded up to fill their mapping.
+bin_info_t* mem_pool_bin_new (uint64_t size, bool use_mmap, bool huge_pages)
+{
+    size = (size + 7) & ~(uint64_t)7;
+
+    void *base = NULL;
+    uint64_t mapped_size = 0;
+    if (use_mmap) {
+#ifdef MAP_HUGETLB
+        if (huge_pages) {
+            mapped_size = (size + sizeof(bin_info_t) + MEM_POOL_HUGE_PAGE_SIZE - 1) & ~(MEM_POOL_HUGE_PAGE_SIZE - 1);
+            base = mmap (NULL, mapped_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+            if (base == MAP_FAILED) base = NULL;
+        }
+#endif
+
+        if (base == NULL) {
+            uint64_t page_size = sysconf (_SC_PAGESIZE);
+            mapped_size = (size + sizeof(bin_info_t) + page_size - 1) & ~(page_size - 1);
+            base = mmap (NULL, mapped_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                base = NULL;
+            }
+#ifdef MADV_HUGEPAGE
+            else if (huge_pages) {
+                madvise (base, mapped_size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        size = mapped_size - sizeof(bin_info_t);
+
+    } else {
+        base = malloc (size + sizeof(bin_info_t));
+    }
+
+    if (base == NULL) {
+        return NULL;
+    }
+
+    bin_info_t *info = (bin_info_t*)((uint8_t*)base + size);
+    info->base = base;
+    info->size = size;
+    info->prev_bin_info = NULL;
+    info->last_cb_info = NULL;
+    info->mapped_size = mapped_size;
+    return info;
+}
+
+void mem_pool_bin_free (bin_info_t *info)
+{
+    if (info->mapped_size != 0) {
+        munmap (info->base, info->mapped_size);
+    } else {
+        free (info->base);
+    }
+}
+
 // TODO: I hardly ever use these, instead I use ZERO_INIT, remove them?
 enum alloc_opts {
     POOL_UNINITIALIZED,
@@ -2408,48 +2711,49 @@ enum alloc_opts {
 #define mem_pool_push_size(pool,size) mem_pool_push_size_full(pool,size,POOL_UNINITIALIZED,NULL,NULL)
 #define mem_pool_push_struct(pool,type) ((type*)mem_pool_push_size(pool,sizeof(type)))
 #define mem_pool_push_array(pool,n,type) mem_pool_push_size(pool,(n)*sizeof(type))
-void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts opts,
+void* mem_pool_push_size_full (mem_pool_t *pool, uint64_t size, enum alloc_opts opts,
                                mem_pool_on_destroy_callback_t *cb, void *clsr)
 {
     assert (pool != NULL);
 
-    uint32_t required_size = cb == NULL ? size : size + sizeof(struct on_destroy_callback_info_t);
+    uint64_t required_size = cb == NULL ? size : size + sizeof(struct on_destroy_callback_info_t);
 
     if (required_size == 0) return NULL;
 
     // If not enough space left in the current bin, grow the pool by adding a
     // new one.
     if (pool->used + required_size > pool->size) {
-        pool->num_bins++;
-
         if (pool->min_bin_size == 0) {
             pool->min_bin_size = MEM_POOL_DEFAULT_MIN_BIN_SIZE;
         }
 
-        int new_bin_size = MAX(pool->min_bin_size, required_size);
-        void *new_bin;
         bin_info_t *new_info;
-        if ((new_bin = malloc (new_bin_size + sizeof(bin_info_t)))) {
-            new_info = (bin_info_t*)((uint8_t*)new_bin + new_bin_size);
+        if (required_size >= MEM_POOL_LARGE_ALLOC_SIZE && required_size > pool->min_bin_size) {
+            new_info = mem_pool_bin_new (required_size, true, pool->huge_pages);
+
         } else {
+            uint64_t next_bin_size = pool->bin_size == 0 ? pool->min_bin_size : MIN(2*pool->bin_size, MEM_POOL_MAX_BIN_SIZE);
+            next_bin_size = MAX(next_bin_size, pool->min_bin_size);
+            pool->bin_size = next_bin_size;
+
+            bool use_mmap = pool->huge_pages && next_bin_size == MEM_POOL_MAX_BIN_SIZE;
+            new_info = mem_pool_bin_new (MAX(next_bin_size, required_size), use_mmap, pool->huge_pages);
+        }
+
+        if (new_info == NULL) {
             printf ("Malloc failed.\n");
             return NULL;
         }
 
-        new_info->base = new_bin;
-        new_info->size = new_bin_size;
-        new_info->last_cb_info = NULL;
-
-        if (pool->base == NULL) {
-            new_info->prev_bin_info = NULL;
-        } else {
+        if (pool->base != NULL) {
             bin_info_t *prev_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
             new_info->prev_bin_info = prev_info;
         }
 
+        pool->num_bins++;
         pool->used = 0;
-        pool->size = new_bin_size;
-        pool->base = new_bin;
+        pool->size = new_info->size;
+        pool->base = new_info->base;
     }
 
     void *ret = (uint8_t*)pool->base + pool->used;
@@ -2474,39 +2778,77 @@ void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts
     return ret;
 }
 
+void mem_pool_call_destroy_callbacks (mem_pool_t *pool)
+{
+    bin_info_t *curr_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
+    while (curr_info != NULL) {
+        struct on_destroy_callback_info_t *cb_info = curr_info->last_cb_info;
+        while (cb_info != NULL) {
+            cb_info->cb(cb_info->allocated, cb_info->clsr);
+            cb_info = cb_info->prev;
+        }
+
+        curr_info = curr_info->prev_bin_info;
+    }
+}
+
 // NOTE: Do NOT use _pool_ again after calling this. We don't reset pool because
 // it could have been bootstrapped into itself. Reusing is better hendled by
-// mem_pool_end_temporary_memory().
+// mem_pool_end_temporary_memory() or mem_pool_reset().
 void mem_pool_destroy (mem_pool_t *pool)
 {
     if (pool->base != NULL) {
-        bin_info_t *curr_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
-
         // Call all on_destroy callbacks
-        while (curr_info != NULL) {
-            struct on_destroy_callback_info_t *cb_info = curr_info->last_cb_info;
-            while (cb_info != NULL) {
-                cb_info->cb(cb_info->allocated, cb_info->clsr);
-                cb_info = cb_info->prev;
-            }
-
-            curr_info = curr_info->prev_bin_info;
-        }
+        mem_pool_call_destroy_callbacks (pool);
 
         // Free all allocated bins
-        curr_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
-        void *to_free = curr_info->base;
-        curr_info = curr_info->prev_bin_info;
+        bin_info_t *curr_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
         while (curr_info != NULL) {
-            free (to_free);
-            to_free = curr_info->base;
-            curr_info = curr_info->prev_bin_info;
+            bin_info_t *prev_info = curr_info->prev_bin_info;
+            mem_pool_bin_free (curr_info);
+            curr_info = prev_info;
         }
-        free (to_free);
     }
 }
 
-uint32_t mem_pool_allocated (mem_pool_t *pool)
+// Frees everything allocated in the pool but keeps its last bin, so a pool
+// used for scratch data of each item in a loop doesn't call malloc() again
+// for every item. The last bin isn't kept if it's a dedicated bin of a large
+// allocation.
+//
+// Unlike mem_pool_destroy() the pool can be used again after this, so it can't
+// be bootstrapped into itself.
+void mem_pool_reset (mem_pool_t *pool)
+{
+    if (pool->base == NULL) return;
+
+    mem_pool_call_destroy_callbacks (pool);
+
+    bin_info_t *last_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
+    bin_info_t *curr_info = last_info->prev_bin_info;
+    while (curr_info != NULL) {
+        bin_info_t *prev_info = curr_info->prev_bin_info;
+        mem_pool_bin_free (curr_info);
+        curr_info = prev_info;
+    }
+
+    if (pool->size > MAX(MEM_POOL_MAX_BIN_SIZE, pool->min_bin_size)) {
+        mem_pool_bin_free (last_info);
+        pool->base = NULL;
+        pool->size = 0;
+        pool->num_bins = 0;
+
+    } else {
+        last_info->prev_bin_info = NULL;
+        last_info->last_cb_info = NULL;
+        pool->num_bins = 1;
+    }
+
+    pool->used = 0;
+    pool->total_data = 0;
+}
+
+uint64_t mem_pool_allocated (mem_pool_t *pool)
 {
     uint64_t allocated = 0;
     if (pool->base != NULL) {
@@ -2521,7 +2863,7 @@ uint32_t mem_pool_allocated (mem_pool_t *pool)
 
 // Computes how much memory of the pool is used to store
 // on_destroy_callback_info_t structutres.
-uint32_t mem_pool_callback_info (mem_pool_t *pool)
+uint64_t mem_pool_callback_info (mem_pool_t *pool)
 {
     uint64_t callback_info_size = 0;
     if (pool->base != NULL) {
@@ -2544,16 +2886,16 @@ uint32_t mem_pool_callback_info (mem_pool_t *pool)
 // mem_pool_callback_info().
 void mem_pool_print (mem_pool_t *pool)
 {
-    uint32_t allocated = mem_pool_allocated(pool);
-    printf ("Allocated: %u bytes\n", allocated);
+    uint64_t allocated = mem_pool_allocated(pool);
+    printf ("Allocated: %lu bytes\n", allocated);
 
-    uint32_t available = pool->size-pool->used;
-    printf ("Available: %u bytes (%.2f%%)\n", available, ((double)available*100)/allocated);
+    uint64_t available = pool->size-pool->used;
+    printf ("Available: %lu bytes (%.2f%%)\n", available, ((double)available*100)/allocated);
 
-    printf ("Data: %u bytes (%.2f%%)\n", pool->total_data, ((double)pool->total_data*100)/allocated);
+    printf ("Data: %lu bytes (%.2f%%)\n", pool->total_data, ((double)pool->total_data*100)/allocated);
 
-    uint32_t callback_info_size = mem_pool_callback_info (pool);
-    printf ("Callback Info: %u bytes (%.2f%%)\n", callback_info_size, ((double)callback_info_size*100)/allocated);
+    uint64_t callback_info_size = mem_pool_callback_info (pool);
+    printf ("Callback Info: %lu bytes (%.2f%%)\n", callback_info_size, ((double)callback_info_size*100)/allocated);
 
     uint64_t info_size = pool->num_bins*sizeof(bin_info_t);
     printf ("Info: %lu bytes (%.2f%%)\n", info_size, ((double)info_size*100)/allocated);
@@ -2576,8 +2918,8 @@ void mem_pool_print (mem_pool_t *pool)
 typedef struct {
     mem_pool_t *pool;
     void* base;
-    uint32_t used;
-    uint32_t total_data;
+    uint64_t used;
+    uint64_t total_data;
 } mem_pool_marker_t;
 
 mem_pool_marker_t mem_pool_begin_temporary_memory (mem_pool_t *pool)
@@ -2622,9 +2964,9 @@ void mem_pool_end_temporary_memory (mem_pool_marker_t mrkr)
         // Free necessary bins
         curr_info = (bin_info_t*)((uint8_t*)mrkr.pool->base + mrkr.pool->size);
         while (curr_info->base != mrkr.base) {
-            void *to_free = curr_info->base;
-            curr_info = curr_info->prev_bin_info;
-            free (to_free);
+            bin_info_t *prev_info = curr_info->prev_bin_info;
+            mem_pool_bin_free (curr_info);
+            curr_info = prev_info;
             mrkr.pool->num_bins--;
         }
         mrkr.pool->size = curr_info->size;
@@ -2654,6 +2996,119 @@ ON_DESTROY_CALLBACK(pool_chain_destroy)
 
 #define mem_pool_add_child(pool,child_pool) mem_pool_push_cb(pool, pool_chain_destroy, child_pool)
 
+///////////////////////
+//
+//  LOCK FREE QUEUE
+//
+// Bounded multi producer multi consumer queue of pointers, used to hand off
+// buffers between threads without locking. This is Dmitry Vyukov's bounded
+// MPMC queue. Each cell has a sequence number that tells producers and
+// consumers if the cell is ready for them, so there is no ABA problem.
+//
+// Sequence numbers are stored relative to the cell index, so a zeroed queue
+// is a valid empty queue and can be statically initialized.
+#define LF_QUEUE_CAPACITY 64 // Must be a power of 2
+
+struct lf_queue_cell_t {
+    volatile uint64_t sequence;
+    void *data;
+};
+
+struct lf_queue_t {
+    volatile uint64_t enqueue_pos;
+    struct lf_queue_cell_t cells[LF_QUEUE_CAPACITY];
+    volatile uint64_t dequeue_pos;
+};
+
+// Returns false if the queue is full.
+bool lf_queue_push (struct lf_queue_t *queue, void *data)
+{
+    struct lf_queue_cell_t *cell;
+    uint64_t pos = queue->enqueue_pos;
+    while (true) {
+        uint64_t idx = pos & (LF_QUEUE_CAPACITY - 1);
+        cell = &queue->cells[idx];
+        int64_t dif = (int64_t)(cell->sequence + idx) - (int64_t)pos;
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap (&queue->enqueue_pos, pos, pos + 1)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return false;
+        }
+
+        pos = queue->enqueue_pos;
+    }
+
+    cell->data = data;
+    __sync_synchronize ();
+    cell->sequence = pos + 1 - (pos & (LF_QUEUE_CAPACITY - 1));
+    return true;
+}
+
+// Returns NULL if the queue is empty.
+void* lf_queue_pop (struct lf_queue_t *queue)
+{
+    struct lf_queue_cell_t *cell;
+    uint64_t pos = queue->dequeue_pos;
+    while (true) {
+        uint64_t idx = pos & (LF_QUEUE_CAPACITY - 1);
+        cell = &queue->cells[idx];
+        int64_t dif = (int64_t)(cell->sequence + idx) - (int64_t)(pos + 1);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap (&queue->dequeue_pos, pos, pos + 1)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        }
+
+        pos = queue->dequeue_pos;
+    }
+
+    void *data = cell->data;
+    __sync_synchronize ();
+    cell->sequence = pos + LF_QUEUE_CAPACITY - (pos & (LF_QUEUE_CAPACITY - 1));
+    return data;
+}
+
+// Keeps freed buffers of a fixed size so they can be reused, by any thread,
+// instead of being allocated again. Code that processes files one after the
+// other can use the same read buffer for all of them, and each thread ends up
+// reusing its own buffers.
+//
+// At most LF_QUEUE_CAPACITY buffers are kept, more are freed.
+struct buff_recycler_t {
+    uint64_t buff_size;
+    struct lf_queue_t free_buffs;
+};
+
+#define BUFF_RECYCLER_INIT(size) {.buff_size = (size)}
+
+void* buff_recycler_get (struct buff_recycler_t *recycler)
+{
+    void *buff = lf_queue_pop (&recycler->free_buffs);
+    if (buff == NULL) {
+        buff = malloc (recycler->buff_size);
+    }
+    return buff;
+}
+
+void buff_recycler_put (struct buff_recycler_t *recycler, void *buff)
+{
+    if (buff != NULL && !lf_queue_push (&recycler->free_buffs, buff)) {
+        free (buff);
+    }
+}
+
+void buff_recycler_destroy (struct buff_recycler_t *recycler)
+{
+    void *buff;
+    while ((buff = lf_queue_pop (&recycler->free_buffs)) != NULL) {
+        free (buff);
+    }
+}
+
 // pom == pool or malloc
 #define pom_push_struct(pool, type) pom_push_size(pool, sizeof(type))
 #define pom_push_array(pool, n, type) pom_push_size(pool, (n)*sizeof(type))
@@ -2661,7 +3116,7 @@ ON_DESTROY_CALLBACK(pool_chain_destroy)
 
 #define pom_strdup(pool,str) pom_strndup(pool,str,((str)!=NULL?strlen(str):0))
 static inline
-char* pom_strndup (mem_pool_t *pool, const char *str, uint32_t str_len)
+char* pom_strndup (mem_pool_t *pool, const char *str, uint64_t str_len)
 {
     char *res = (char*)pom_push_size (pool, str_len+1);
     memcpy (res, str, str_len);
@@ -2670,7 +3125,7 @@ char* pom_strndup (mem_pool_t *pool, const char *str, uint32_t str_len)
 }
 
 static inline
-void* pom_dup (mem_pool_t *pool, void *data, uint32_t size)
+void* pom_dup (mem_pool_t *pool, void *data, uint64_t size)
 {
     void *res = pom_push_size (pool, size);
     memcpy (res, data, size);
@@ -3013,20 +3468,24 @@ char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
 
         int file = open (path, O_RDONLY);
         if (file != -1) {
-            int bytes_read = 0;
-            do {
-                int status = read (file, loaded_data+bytes_read, st.st_size-bytes_read);
+            uint64_t bytes_read = 0;
+            while (bytes_read < st.st_size) {
+                ssize_t status = read (file, loaded_data+bytes_read, st.st_size-bytes_read);
                 if (status == -1) {
                     success = false;
                     printf ("Error reading %s: %s\n", path, strerror(errno));
                     break;
+
+                } else if (status == 0) {
+                    // The file got shorter since we called stat().
+                    break;
                 }
                 bytes_read += status;
-            } while (bytes_read != st.st_size);
-            loaded_data[st.st_size] = '\0';
+            }
+            loaded_data[bytes_read] = '\0';
 
             if (len != NULL) {
-                *len = st.st_size;
+                *len = bytes_read;
             }
 
             close (file);
@@ -3816,7 +4275,11 @@ for (; varname != NULL; varname = varname->next)
 // NOTE: IS_A_LT_B as defined, will sort the linked list in ascending order.
 // NOTE: The last node of the linked list is expected to have NEXT_FIELD field
 // set to NULL.
-// NOTE: It uses a pointer array of size n, and calls merge sort on that array.
+// NOTE: It allocates a pointer array of size n, and calls merge sort on that
+// array. If the allocation fails the list is insertion sorted in place.
+//
+// templ_sort_parallel_ll also defines FUNCNAME ## _parallel(head, n,
+// num_threads), which sorts the pointer array with templ_sort_parallel().
 
 // We say a and b are pointers, for arrays it's well defined. When talking about
 // linked lists we could mean a pointer to a node, or a pointer to an element of
@@ -3837,7 +4300,39 @@ for (; varname != NULL; varname = varname->next)
 // NOTE: The generated sorting function returns the last node of the linked list
 // so the user can update it if needed.
 #define _linked_list_sort_implementation(FUNCNAME,TYPE,NEXT_FIELD)  \
-TYPE* FUNCNAME ## _user_data (TYPE **head, int n, void *user_data)  \
+/* Fallback used when the pointer array can't be allocated. Nodes
+ * are inserted after the ones that go before them, so it's stable
+ * if the array sort is.
+ */                                                                 \
+static inline                                                       \
+TYPE* FUNCNAME ## _insertion_ll (TYPE **head, void *user_data)      \
+{                                                                   \
+    TYPE *sorted = NULL;                                            \
+    TYPE *node = *head;                                             \
+    while (node != NULL) {                                          \
+        TYPE *next = node->NEXT_FIELD;                              \
+        TYPE **pos = &sorted;                                       \
+        while (*pos != NULL &&                                      \
+               FUNCNAME ## _arr_take_left (pos, &node, user_data)) {\
+            pos = &(*pos)->NEXT_FIELD;                              \
+        }                                                           \
+        node->NEXT_FIELD = *pos;                                    \
+        *pos = node;                                                \
+        node = next;                                                \
+    }                                                               \
+                                                                    \
+    *head = sorted;                                                 \
+    TYPE *last = sorted;                                            \
+    while (last != NULL && last->NEXT_FIELD != NULL) {              \
+        last = last->NEXT_FIELD;                                    \
+    }                                                               \
+    return last;                                                    \
+}                                                                   \
+                                                                    \
+static                                                              \
+TYPE* FUNCNAME ## _threads_user_data (TYPE **head, int n,           \
+                                      int num_threads,              \
+                                      void *user_data)              \
 {                                                                   \
     if (head == NULL || n == 0) {                                   \
         return NULL;                                                \
@@ -3852,17 +4347,28 @@ TYPE* FUNCNAME ## _user_data (TYPE **head, int n, void *user_data)  \
         }                                                           \
     }                                                               \
                                                                     \
-    TYPE *node = *head;                                             \
-    TYPE *arr[n];                                                   \
+    TYPE **arr = malloc (n*sizeof(TYPE*));                          \
+    if (arr == NULL) {                                              \
+        return FUNCNAME ## _insertion_ll (head, user_data);         \
+    }                                                               \
                                                                     \
+    /* Nodes past n are dropped, like they would be if the list
+     * ended there.
+     */                                                             \
     int j = 0;                                                      \
-    while (node != NULL) {                                          \
+    TYPE *node = *head;                                             \
+    while (j < n && node != NULL) {                                 \
         arr[j] = node;                                              \
         j++;                                                        \
         node = node->NEXT_FIELD;                                    \
+    }                                                               \
+    n = j;                                                          \
+    if (n == 0) {                                                   \
+        free (arr);                                                 \
+        return NULL;                                                \
     }                                                               \
                                                                     \
-    FUNCNAME ## _arr_user_data (arr, n, user_data);                 \
+    FUNCNAME ## _arr_sort_threads (arr, n, num_threads, user_data); \
                                                                     \
     *head = arr[0];                                                 \
     for (j=0; j<n - 1; j++) {                                       \
@@ -3870,17 +4376,34 @@ TYPE* FUNCNAME ## _user_data (TYPE **head, int n, void *user_data)  \
     }                                                               \
     arr[j]->NEXT_FIELD = NULL;                                      \
                                                                     \
-    return arr[n-1];                                                \
+    TYPE *last = arr[n-1];                                          \
+    free (arr);                                                     \
+    return last;                                                    \
+}                                                                   \
+                                                                    \
+TYPE* FUNCNAME ## _user_data (TYPE **head, int n, void *user_data)  \
+{                                                                   \
+    return FUNCNAME ## _threads_user_data (head, n, 1, user_data);  \
 }                                                                   \
                                                                     \
 TYPE* FUNCNAME(TYPE **head, int n) {                                \
     return FUNCNAME ## _user_data (head,n,NULL);                    \
 }
 
+// Sorts the pointer array, non parallel sorts ignore num_threads.
+#define _linked_list_serial_arr_sort(FUNCNAME,TYPE)                 \
+static inline                                                       \
+void FUNCNAME ## _arr_sort_threads (TYPE **arr, int n,              \
+                                    int num_threads, void *user_data)\
+{                                                                   \
+    FUNCNAME ## _arr_user_data (arr, n, user_data);                 \
+}
+
 // Linked list sorting
 #define templ_sort_ll_next_field(FUNCNAME,TYPE,NEXT_FIELD,IS_A_LT_B)\
 templ_sort(FUNCNAME ## _arr, TYPE*,                                 \
            _linked_list_A_B_dereference_injector(IS_A_LT_B,TYPE))   \
+_linked_list_serial_arr_sort(FUNCNAME,TYPE)                         \
 _linked_list_sort_implementation(FUNCNAME,TYPE,NEXT_FIELD)
 
 #define templ_sort_ll(FUNCNAME,TYPE,IS_A_LT_B) \
@@ -3890,11 +4413,33 @@ _linked_list_sort_implementation(FUNCNAME,TYPE,NEXT_FIELD)
 #define templ_sort_stable_ll_next_field(FUNCNAME,TYPE,NEXT_FIELD,CMP_A_TO_B)\
 templ_sort_stable(FUNCNAME ## _arr, TYPE*,                                  \
            _linked_list_A_B_dereference_injector(CMP_A_TO_B,TYPE))          \
+_linked_list_serial_arr_sort(FUNCNAME,TYPE)                                 \
 _linked_list_sort_implementation(FUNCNAME,TYPE,NEXT_FIELD)
 
 #define templ_sort_stable_ll(FUNCNAME,TYPE,CMP_A_TO_B) \
     templ_sort_stable_ll_next_field(FUNCNAME,TYPE,next,CMP_A_TO_B)
 
+#ifdef _PTHREAD_H
+// Parallel linked list sorting
+#define templ_sort_parallel_ll_next_field(FUNCNAME,TYPE,NEXT_FIELD,IS_A_LT_B)\
+templ_sort_parallel(FUNCNAME ## _arr, TYPE*,                                 \
+           _linked_list_A_B_dereference_injector(IS_A_LT_B,TYPE))            \
+static inline                                                                \
+void FUNCNAME ## _arr_sort_threads (TYPE **arr, int n,                       \
+                                    int num_threads, void *user_data)        \
+{                                                                            \
+    FUNCNAME ## _arr_parallel_user_data (arr, n, num_threads, user_data);    \
+}                                                                            \
+_linked_list_sort_implementation(FUNCNAME,TYPE,NEXT_FIELD)                   \
+                                                                             \
+TYPE* FUNCNAME ## _parallel (TYPE **head, int n, int num_threads) {          \
+    return FUNCNAME ## _threads_user_data (head, n, num_threads, NULL);      \
+}
+
+#define templ_sort_parallel_ll(FUNCNAME,TYPE,IS_A_LT_B) \
+    templ_sort_parallel_ll_next_field(FUNCNAME,TYPE,next,IS_A_LT_B)
+#endif /*_PTHREAD_H*/
+
 ///////////////////
 //
 //  DYNAMIC ARRAY
@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// ISO Base Media File Format (ISO/IEC 14496-12) parsing, as used by HEIF
+// images (ISO/IEC 23008-12) like the .HEIC files created by phones. This isn't
+// a decoder, it only walks the box structure to find the primary image, its
+// dimensions, its Exif metadata and where its coded data is stored.
+//
+// Boxes are read with the same jpg_reader_t readers used for JPEG files. All
+// values in ISO-BMFF are big endian, which is the reader's default.
+
+#define HEIF_4CC(a,b,c,d) ((uint32_t)(a)<<24 | (uint32_t)(b)<<16 | (uint32_t)(c)<<8 | (uint32_t)(d))
+
+#define HEIF_BOX_ftyp HEIF_4CC('f','t','y','p')
+#define HEIF_BOX_meta HEIF_4CC('m','e','t','a')
+#define HEIF_BOX_hdlr HEIF_4CC('h','d','l','r')
+#define HEIF_BOX_pitm HEIF_4CC('p','i','t','m')
+#define HEIF_BOX_iinf HEIF_4CC('i','i','n','f')
+#define HEIF_BOX_infe HEIF_4CC('i','n','f','e')
+#define HEIF_BOX_iloc HEIF_4CC('i','l','o','c')
+#define HEIF_BOX_iref HEIF_4CC('i','r','e','f')
+#define HEIF_BOX_idat HEIF_4CC('i','d','a','t')
+#define HEIF_BOX_iprp HEIF_4CC('i','p','r','p')
+#define HEIF_BOX_ipco HEIF_4CC('i','p','c','o')
+#define HEIF_BOX_ipma HEIF_4CC('i','p','m','a')
+#define HEIF_BOX_ispe HEIF_4CC('i','s','p','e')
+#define HEIF_BOX_irot HEIF_4CC('i','r','o','t')
+#define HEIF_BOX_uuid HEIF_4CC('u','u','i','d')
+
+#define HEIF_ITEM_grid HEIF_4CC('g','r','i','d')
+#define HEIF_ITEM_Exif HEIF_4CC('E','x','i','f')
+
+#define HEIF_REF_dimg HEIF_4CC('d','i','m','g')
+
+// NOTE: Returns a pointer to the passed buffer.
+char* heif_4cc_str (uint32_t type, char buffer[5])
+{
+    for (int i=0; i<4; i++) {
+        unsigned char c = (type >> (24 - 8*i)) & 0xFF;
+        buffer[i] = isprint(c) ? c : '?';
+    }
+    buffer[4] = '\0';
+    return buffer;
+}
+
+struct heif_box_t {
+    uint32_t type;
+
+    // File offsets of the box header, the box payload and the byte after the
+    // box.
+    uint64_t start;
+    uint64_t data;
+    uint64_t end;
+};
+
+// Reads the header of the box at the reader's position, which must end before
+// parent_end.
+bool heif_read_box (struct jpg_reader_t *rdr, uint64_t parent_end, struct heif_box_t *box)
+{
+    *box = ZERO_INIT (struct heif_box_t);
+    box->start = rdr->offset;
+
+    uint64_t size = jpg_reader_read_value_u32 (rdr);
+    box->type = jpg_reader_read_value_u32 (rdr);
+    if (size == 1) {
+        size = jpg_reader_read_value_u64 (rdr);
+    } else if (size == 0) {
+        // Box extends to the end of its container.
+        size = parent_end - box->start;
+    }
+
+    if (box->type == HEIF_BOX_uuid) {
+        jpg_advance_bytes (rdr, 16);
+    }
+
+    box->data = rdr->offset;
+    box->end = box->start + size;
+
+    if (!rdr->error && (box->end < box->data || box->end > parent_end)) {
+        char type[5];
+        jpg_error (rdr, "Invalid size %lu for box '%s' at %lu.", size, heif_4cc_str(box->type, type), box->start);
+    }
+
+    return !rdr->error;
+}
+
+// Reads the version and flags of a FullBox.
+static inline
+uint8_t heif_read_full_box_header (struct jpg_reader_t *rdr, uint32_t *flags)
+{
+    uint32_t version_flags = jpg_reader_read_value_u32 (rdr);
+    if (flags != NULL) {
+        *flags = version_flags & 0xFFFFFF;
+    }
+
+    return version_flags >> 24;
+}
+
+struct heif_extent_t {
+    // File offset, already resolved for items stored in the idat box.
+    uint64_t offset;
+    uint64_t length;
+
+    struct heif_extent_t *next;
+};
+
+struct heif_item_t {
+    uint32_t id;
+    uint32_t type;
+
+    // 0 means file offsets, 1 means offsets into the idat box. Item offsets (2)
+    // aren't supported.
+    uint8_t construction_method;
+    uint64_t base_offset;
+    struct heif_extent_t *extents;
+    struct heif_extent_t *extents_end;
+
+    // Items this one is derived from, like the tiles of a grid.
+    uint32_t *dimg;
+    uint16_t dimg_len;
+
+    uint32_t width;
+    uint32_t height;
+
+    // Counter clockwise, in degrees.
+    uint16_t rotation;
+
+    struct heif_item_t *next;
+};
+
+struct heif_property_t {
+    uint32_t type;
+
+    uint32_t width;
+    uint32_t height;
+    uint16_t rotation;
+
+    struct heif_property_t *next;
+};
+
+struct heif_info_t {
+    uint32_t major_brand;
+
+    struct heif_item_t *items;
+    struct heif_item_t *primary;
+
+    // Offset of the idat box's payload, or 0 if there is none.
+    uint64_t idat_offset;
+    uint64_t idat_len;
+
+    // Location of the TIFF header of the Exif item.
+    bool has_exif;
+    uint64_t exif_offset;
+    uint64_t exif_len;
+};
+
+struct heif_item_t* heif_get_item (mem_pool_t *pool, struct heif_info_t *info, uint32_t id)
+{
+    struct heif_item_t *item = info->items;
+    while (item != NULL && item->id != id) {
+        item = item->next;
+    }
+
+    if (item == NULL) {
+        LINKED_LIST_PUSH_NEW (pool, struct heif_item_t, info->items, new_item);
+        new_item->id = id;
+        item = new_item;
+    }
+
+    return item;
+}
+
+void heif_read_iinf (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_info_t *info, struct heif_box_t *iinf)
+{
+    uint8_t version = heif_read_full_box_header (rdr, NULL);
+    jpg_advance_bytes (rdr, version == 0 ? 2 : 4); // entry_count
+
+    struct heif_box_t box;
+    while (!rdr->error && rdr->offset < iinf->end && heif_read_box (rdr, iinf->end, &box)) {
+        if (box.type == HEIF_BOX_infe) {
+            uint8_t infe_version = heif_read_full_box_header (rdr, NULL);
+
+            // Versions 0 and 1 predate HEIF and have no item type.
+            if (infe_version >= 2) {
+                uint32_t id = infe_version == 2 ? jpg_reader_read_value_u16 (rdr) : jpg_reader_read_value_u32 (rdr);
+                jpg_advance_bytes (rdr, 2); // item_protection_index
+                uint32_t type = jpg_reader_read_value_u32 (rdr);
+
+                if (!rdr->error) {
+                    heif_get_item (pool, info, id)->type = type;
+                }
+            }
+        }
+
+        jpg_jump_to (rdr, box.end);
+    }
+}
+
+void heif_read_iloc (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_info_t *info, struct heif_box_t *iloc)
+{
+    uint8_t version = heif_read_full_box_header (rdr, NULL);
+    if (version > 2) {
+        jpg_error (rdr, "Unsupported iloc box version %u.", version);
+        return;
+    }
+
+    uint8_t sizes = jpg_reader_read_value_u8 (rdr);
+    uint8_t offset_size = sizes >> 4;
+    uint8_t length_size = sizes & 0xF;
+
+    sizes = jpg_reader_read_value_u8 (rdr);
+    uint8_t base_offset_size = sizes >> 4;
+    uint8_t index_size = version >= 1 ? sizes & 0xF : 0;
+
+    if (offset_size > 8 || length_size > 8 || base_offset_size > 8 || index_size > 8) {
+        jpg_error (rdr, "Invalid field sizes in iloc box.");
+        return;
+    }
+
+    uint32_t item_count = version < 2 ? jpg_reader_read_value_u16 (rdr) : jpg_reader_read_value_u32 (rdr);
+    for (uint32_t i=0; !rdr->error && rdr->offset < iloc->end && i < item_count; i++) {
+        uint32_t id = version < 2 ? jpg_reader_read_value_u16 (rdr) : jpg_reader_read_value_u32 (rdr);
+        struct heif_item_t *item = heif_get_item (pool, info, id);
+
+        if (version >= 1) {
+            item->construction_method = jpg_reader_read_value_u16 (rdr) & 0xF;
+        }
+
+        jpg_advance_bytes (rdr, 2); // data_reference_index
+        item->base_offset = jpg_reader_read_value (rdr, base_offset_size);
+
+        uint16_t extent_count = jpg_reader_read_value_u16 (rdr);
+        for (uint16_t j=0; !rdr->error && j < extent_count; j++) {
+            jpg_advance_bytes (rdr, index_size); // extent_index
+
+            LINKED_LIST_APPEND_NEW (pool, struct heif_extent_t, item->extents, extent);
+            extent->offset = jpg_reader_read_value (rdr, offset_size);
+            extent->length = jpg_reader_read_value (rdr, length_size);
+        }
+    }
+}
+
+void heif_read_iref (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_info_t *info, struct heif_box_t *iref)
+{
+    uint8_t version = heif_read_full_box_header (rdr, NULL);
+    int id_size = version == 0 ? 2 : 4;
+
+    struct heif_box_t box;
+    while (!rdr->error && rdr->offset < iref->end && heif_read_box (rdr, iref->end, &box)) {
+        if (box.type == HEIF_REF_dimg) {
+            struct heif_item_t *item = heif_get_item (pool, info, jpg_reader_read_value (rdr, id_size));
+            uint16_t reference_count = jpg_reader_read_value_u16 (rdr);
+            if (!rdr->error && box.data + id_size + 2 + (uint64_t)reference_count*id_size <= box.end) {
+                item->dimg = mem_pool_push_array (pool, reference_count, uint32_t);
+                item->dimg_len = reference_count;
+                for (int i=0; i<reference_count; i++) {
+                    item->dimg[i] = jpg_reader_read_value (rdr, id_size);
+                }
+            }
+        }
+
+        jpg_jump_to (rdr, box.end);
+    }
+}
+
+// Properties are referenced by their 1 based index inside ipco, so they are
+// kept in order.
+struct heif_property_t* heif_read_ipco (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_box_t *ipco)
+{
+    LINKED_LIST_DECLARE (struct heif_property_t, properties);
+    properties = NULL;
+    properties_end = NULL;
+
+    struct heif_box_t box;
+    while (!rdr->error && rdr->offset < ipco->end && heif_read_box (rdr, ipco->end, &box)) {
+        LINKED_LIST_APPEND_NEW (pool, struct heif_property_t, properties, property);
+        property->type = box.type;
+
+        if (box.type == HEIF_BOX_ispe) {
+            heif_read_full_box_header (rdr, NULL);
+            property->width = jpg_reader_read_value_u32 (rdr);
+            property->height = jpg_reader_read_value_u32 (rdr);
+
+        } else if (box.type == HEIF_BOX_irot) {
+            property->rotation = (jpg_reader_read_value_u8 (rdr) & 0x3)*90;
+        }
+
+        jpg_jump_to (rdr, box.end);
+    }
+
+    return properties;
+}
+
+void heif_read_ipma (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_info_t *info,
+                     struct heif_property_t *properties, struct heif_box_t *ipma)
+{
+    uint32_t flags;
+    uint8_t version = heif_read_full_box_header (rdr, &flags);
+
+    uint32_t entry_count = jpg_reader_read_value_u32 (rdr);
+    for (uint32_t i=0; !rdr->error && rdr->offset < ipma->end && i < entry_count; i++) {
+        uint32_t id = version < 1 ? jpg_reader_read_value_u16 (rdr) : jpg_reader_read_value_u32 (rdr);
+        struct heif_item_t *item = heif_get_item (pool, info, id);
+
+        uint8_t association_count = jpg_reader_read_value_u8 (rdr);
+        for (int j=0; !rdr->error && j<association_count; j++) {
+            // The high bit marks the property as essential.
+            uint16_t property_index = (flags & 1) ?
+                jpg_reader_read_value_u16 (rdr) & 0x7FFF : jpg_reader_read_value_u8 (rdr) & 0x7F;
+
+            struct heif_property_t *property = properties;
+            for (int k=1; property != NULL && k<property_index; k++) {
+                property = property->next;
+            }
+
+            if (property_index == 0 || property == NULL) continue;
+
+            if (property->type == HEIF_BOX_ispe) {
+                item->width = property->width;
+                item->height = property->height;
+            } else if (property->type == HEIF_BOX_irot) {
+                item->rotation = property->rotation;
+            }
+        }
+    }
+}
+
+void heif_read_meta (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_info_t *info, struct heif_box_t *meta)
+{
+    heif_read_full_box_header (rdr, NULL);
+
+    uint32_t primary_id = 0;
+    struct heif_box_t box;
+    while (!rdr->error && rdr->offset < meta->end && heif_read_box (rdr, meta->end, &box)) {
+        if (box.type == HEIF_BOX_pitm) {
+            uint8_t version = heif_read_full_box_header (rdr, NULL);
+            primary_id = version == 0 ? jpg_reader_read_value_u16 (rdr) : jpg_reader_read_value_u32 (rdr);
+
+        } else if (box.type == HEIF_BOX_iinf) {
+            heif_read_iinf (rdr, pool, info, &box);
+
+        } else if (box.type == HEIF_BOX_iloc) {
+            heif_read_iloc (rdr, pool, info, &box);
+
+        } else if (box.type == HEIF_BOX_iref) {
+            heif_read_iref (rdr, pool, info, &box);
+
+        } else if (box.type == HEIF_BOX_idat) {
+            info->idat_offset = box.data;
+            info->idat_len = box.end - box.data;
+
+        } else if (box.type == HEIF_BOX_iprp) {
+            struct heif_property_t *properties = NULL;
+            struct heif_box_t iprp_child;
+            while (!rdr->error && rdr->offset < box.end && heif_read_box (rdr, box.end, &iprp_child)) {
+                if (iprp_child.type == HEIF_BOX_ipco) {
+                    properties = heif_read_ipco (rdr, pool, &iprp_child);
+                } else if (iprp_child.type == HEIF_BOX_ipma) {
+                    heif_read_ipma (rdr, pool, info, properties, &iprp_child);
+                }
+
+                jpg_jump_to (rdr, iprp_child.end);
+            }
+        }
+
+        jpg_jump_to (rdr, box.end);
+    }
+
+    if (!rdr->error && primary_id != 0) {
+        info->primary = heif_get_item (pool, info, primary_id);
+    }
+}
+
+// Resolves the offsets of all extents to file offsets. Returns false if the
+// item's data can't be located inside the file.
+bool heif_item_resolve_extents (struct jpg_reader_t *rdr, struct heif_info_t *info, struct heif_item_t *item)
+{
+    bool success = true;
+
+    uint64_t data_start = 0;
+    uint64_t data_end = rdr->file_size;
+    if (item->construction_method == 1) {
+        data_start = info->idat_offset;
+        data_end = info->idat_offset + info->idat_len;
+    } else if (item->construction_method != 0) {
+        success = false;
+    }
+
+    LINKED_LIST_FOR (struct heif_extent_t*, extent, item->extents) {
+        if (!success) break;
+
+        uint64_t offset = data_start + item->base_offset + extent->offset;
+        if (extent->length == 0) {
+            // A length of 0 means the rest of the data.
+            extent->length = data_end - MIN(offset, data_end);
+        }
+        extent->offset = offset;
+
+        success = offset >= data_start && offset + extent->length <= data_end;
+    }
+
+    return success;
+}
+
+// Reads the boxes needed to find the primary item. Its coded data is either
+// its own extents or, for grid images, the extents of its tiles.
+bool heif_read_info (struct jpg_reader_t *rdr, mem_pool_t *pool, struct heif_info_t *info)
+{
+    *info = ZERO_INIT (struct heif_info_t);
+
+    struct heif_box_t box;
+    if (heif_read_box (rdr, rdr->file_size, &box) && box.type != HEIF_BOX_ftyp) {
+        jpg_error (rdr, "Expected ftyp box, this isn't an ISO base media file.");
+    }
+    info->major_brand = jpg_reader_read_value_u32 (rdr);
+    jpg_jump_to (rdr, box.end);
+
+    while (!rdr->error && rdr->offset < rdr->file_size && heif_read_box (rdr, rdr->file_size, &box)) {
+        if (box.type == HEIF_BOX_meta) {
+            heif_read_meta (rdr, pool, info, &box);
+        }
+
+        jpg_jump_to (rdr, box.end);
+    }
+
+    if (!rdr->error && info->primary == NULL) {
+        jpg_error (rdr, "No primary item found.");
+    }
+
+    LINKED_LIST_FOR (struct heif_item_t*, item, info->items) {
+        if (rdr->error) break;
+
+        bool resolved = heif_item_resolve_extents (rdr, info, item);
+        if (!resolved && item == info->primary) {
+            jpg_error (rdr, "Can't locate data of primary item %u.", item->id);
+        }
+
+        // Exif items start with the offset to the TIFF header, which is
+        // usually after an "Exif\0\0" identifier.
+        if (resolved && item->type == HEIF_ITEM_Exif && !info->has_exif && item->extents != NULL &&
+            item->extents->length >= 4) {
+            struct heif_extent_t *extent = item->extents;
+            jpg_jump_to (rdr, extent->offset);
+            uint64_t tiff_header_offset = jpg_reader_read_value_u32 (rdr);
+            if (!rdr->error && 4 + tiff_header_offset < extent->length) {
+                info->has_exif = true;
+                info->exif_offset = extent->offset + 4 + tiff_header_offset;
+                info->exif_len = extent->length - 4 - tiff_header_offset;
+            }
+        }
+    }
+
+    if (!rdr->error && info->primary->type == HEIF_ITEM_grid) {
+        for (int i=0; i<info->primary->dimg_len; i++) {
+            struct heif_item_t *tile = heif_get_item (pool, info, info->primary->dimg[i]);
+            if (tile->extents == NULL) {
+                jpg_error (rdr, "Can't locate data of tile %u.", tile->id);
+                break;
+            }
+        }
+    }
+
+    return !rdr->error;
+}
+
+// The coded data of the primary image is either its own data or, for grid
+// images, the data of each tile in decoding order.
+uint32_t heif_coded_data_item_count (struct heif_info_t *info)
+{
+    return info->primary->type == HEIF_ITEM_grid ? info->primary->dimg_len : 1;
+}
+
+struct heif_item_t* heif_coded_data_item (mem_pool_t *pool, struct heif_info_t *info, uint32_t idx)
+{
+    struct heif_item_t *item = info->primary;
+    if (item->type == HEIF_ITEM_grid) {
+        item = heif_get_item (pool, info, item->dimg[idx]);
+    }
+
+    return item;
+}
+
+uint64_t heif_item_data_length (struct heif_item_t *item)
+{
+    uint64_t length = 0;
+    LINKED_LIST_FOR (struct heif_extent_t*, extent, item->extents) {
+        length += extent->length;
+    }
+    return length;
+}
+
+// Consumes length bytes from the reader adding them to the hash state.
+void heif_absorb (struct jpg_reader_t *rdr, meow_state *state, uint64_t length)
+{
+    while (length > 0 && jpg_reader_ensure (rdr, 1)) {
+        uint64_t available = MIN (length, (uint64_t)(rdr->end - rdr->pos));
+        MeowAbsorb (state, available, rdr->pos);
+        jpg_reader_consume (rdr, available);
+        length -= available;
+    }
+}
+
+// Same as jpg_fingerprint() but for HEIF files. The image hash covers only the
+// coded data of the primary image, so it doesn't change when metadata is
+// edited, or when the file's boxes are rearranged.
+//
+// Unlike for JPEG the coded data isn't contiguous, so the file hash is
+// computed in a separate sequential pass.
+bool heif_fingerprint (char *path, struct jpg_fingerprint_t *fingerprint, string_t *error_msg)
+{
+    trace_count (TRACE_COUNTER_FILES_FINGERPRINTED, 1);
+
+    *fingerprint = ZERO_INIT (struct jpg_fingerprint_t);
+
+    mem_pool_t pool = {0};
+    struct jpg_reader_t _rdr = {0};
+    struct jpg_reader_t *rdr = &_rdr;
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
+
+    struct heif_info_t info;
+    if (heif_read_info (rdr, &pool, &info)) {
+        meow_state state;
+        MeowBegin (&state, MeowDefaultSeed);
+        for (uint32_t i=0; !rdr->error && i<heif_coded_data_item_count (&info); i++) {
+            struct heif_item_t *item = heif_coded_data_item (&pool, &info, i);
+
+            // Derived items like 'iden', or items without an iloc entry,
+            // have no data of their own. Hashing zero bytes would group all
+            // of these files together.
+            if (heif_item_data_length (item) == 0) {
+                jpg_error (rdr, "Item %u has no coded data.", item->id);
+                break;
+            }
+
+            LINKED_LIST_FOR (struct heif_extent_t*, extent, item->extents) {
+                jpg_jump_to (rdr, extent->offset);
+                heif_absorb (rdr, &state, extent->length);
+            }
+        }
+        fingerprint->image_hash = MeowU64From (MeowEnd (&state, NULL), 0);
+
+        MeowBegin (&state, MeowDefaultSeed);
+        jpg_jump_to (rdr, 0);
+        heif_absorb (rdr, &state, rdr->file_size);
+        fingerprint->file_hash = MeowU64From (MeowEnd (&state, NULL), 0);
+    }
+
+    bool success = !rdr->error;
+    if (!success && error_msg != NULL) {
+        str_set (error_msg, str_data(&rdr->error_msg));
+    }
+
+    jpg_reader_destroy (rdr);
+    mem_pool_destroy (&pool);
+    return success;
+}
+
+bool heif_read_exif_fields (char *path, mem_pool_t *pool, struct exif_fields_t *fields, string_t *error_msg)
+{
+    trace_count (TRACE_COUNTER_FILES_EXIF_READ, 1);
+
+    *fields = ZERO_INIT (struct exif_fields_t);
+
+    mem_pool_t pool_l = {0};
+    struct jpg_reader_t _rdr = {0};
+    struct jpg_reader_t *rdr = &_rdr;
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
+
+    struct heif_info_t info;
+    if (heif_read_info (rdr, &pool_l, &info) && info.has_exif) {
+        jpg_jump_to (rdr, info.exif_offset);
+
+        struct tiff_view_t tiff;
+        if (jpg_reader_ensure (rdr, info.exif_len) && tiff_view_init (&tiff, rdr->pos, info.exif_len)) {
+            exif_fields_read_tiff (&tiff, pool, fields);
+        }
+    }
+
+    bool success = !rdr->error;
+    if (!success && error_msg != NULL) {
+        str_set (error_msg, str_data(&rdr->error_msg));
+    }
+
+    jpg_reader_destroy (rdr);
+    mem_pool_destroy (&pool_l);
+    return success;
+}
+
+void print_heif_info (char *path)
+{
+    mem_pool_t pool = {0};
+    struct jpg_reader_t _rdr = {0};
+    struct jpg_reader_t *rdr = &_rdr;
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
+
+    struct heif_info_t info;
+    if (heif_read_info (rdr, &pool, &info)) {
+        char type[5];
+        struct heif_item_t *primary = info.primary;
+
+        printf ("Brand: %s\n", heif_4cc_str (info.major_brand, type));
+        printf ("Primary item: %u (%s)\n", primary->id, heif_4cc_str (primary->type, type));
+        printf ("Size: %ux%u\n", primary->width, primary->height);
+        printf ("Rotation: %u\n", primary->rotation);
+        if (primary->type == HEIF_ITEM_grid) {
+            printf ("Tiles: %u\n", primary->dimg_len);
+        }
+
+        uint64_t extent_count = 0;
+        uint64_t coded_data_len = 0;
+        for (uint32_t i=0; i<heif_coded_data_item_count (&info); i++) {
+            struct heif_item_t *item = heif_coded_data_item (&pool, &info, i);
+            LINKED_LIST_FOR (struct heif_extent_t*, extent, item->extents) {
+                extent_count++;
+                coded_data_len += extent->length;
+            }
+        }
+        printf ("Coded data: %lu bytes in %lu extents\n", coded_data_len, extent_count);
+
+        if (info.has_exif) {
+            printf ("Exif: %lu bytes @%lu\n", info.exif_len, info.exif_offset);
+        } else {
+            printf ("Exif: none\n");
+        }
+    }
+
+    struct exif_fields_t fields;
+    if (!rdr->error && info.has_exif && heif_read_exif_fields (path, &pool, &fields, NULL)) {
+        printf (" Make: %s\n", fields.make != NULL ? fields.make : "-");
+        printf (" Model: %s\n", fields.model != NULL ? fields.model : "-");
+        printf (" Date: %s\n", fields.date_time != NULL ? fields.date_time : "-");
+        printf (" Orientation: %u\n", fields.orientation);
+    }
+
+    if (rdr->error) {
+        printf (ECMA_RED("error:") " %s\n", str_data(&rdr->error_msg));
+    }
+
+    jpg_reader_destroy (rdr);
+    mem_pool_destroy (&pool);
+}
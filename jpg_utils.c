@@ -95,24 +95,44 @@ typedef JPG_READER_API_ADVANCE_BYTES(jpg_reader_api_advance_bytes_t);
     void name(struct jpg_reader_t *rdr, uint64_t offset)
 typedef JPG_READER_API_JUMP_TO(jpg_reader_api_jump_to_t);
 
-BINARY_TREE_NEW(int_to_str, int, char*, a-b);
+// Makes the next bytes_needed bytes available between rdr->pos and rdr->end
+// without consuming them. Sets an error and returns false if it can't.
+#define JPG_READER_API_ENSURE(name) \
+    bool name(struct jpg_reader_t *rdr, uint64_t bytes_needed)
+typedef JPG_READER_API_ENSURE(jpg_reader_api_ensure_t);
+
+enum jpg_reader_mode_t {
+    JPG_READER_CHUNKED,
+    JPG_READER_MEMORY,
+    JPG_READER_MMAP
+};
+
 struct jpg_reader_t {
     mem_pool_t pool;
 
+    enum jpg_reader_mode_t mode;
+
     uint8_t *data;
+
+    // Bytes in [pos, end) are the ones starting at offset that are already in
+    // memory, so reads that fit there don't need to call into the backend. If
+    // nothing is available both are NULL. When an error happens end is set to
+    // pos, so everything goes through the backend, which checks the error.
     uint8_t *pos;
+    uint8_t *end;
 
     int file;
-    string_t buff;
+    uint8_t *window;
+    uint64_t window_start;
+    uint64_t window_len;
+    uint64_t window_size;
+    uint64_t window_capacity;
 
     uint64_t file_size;
     uint64_t offset;
 
     enum jpg_reader_endianess_t endianess;
 
-
-    struct int_to_str_tree_t marker_names;
-
     uint64_t exif_ifd_offset;
     uint64_t gps_ifd_offset;
     uint64_t interoperability_ifd_offset;
@@ -124,19 +144,25 @@ struct jpg_reader_t {
     jpg_reader_api_read_bytes_t *read_bytes;
     jpg_reader_api_advance_bytes_t *advance_bytes;
     jpg_reader_api_jump_to_t *jump_to;
+    jpg_reader_api_ensure_t *ensure;
 };
 
+void jpg_chunked_reader_window_free (struct jpg_reader_t *rdr);
+
 void jpg_reader_destroy (struct jpg_reader_t *rdr)
 {
     str_free (&rdr->error_msg);
     str_free (&rdr->warning_msg);
-    str_free (&rdr->buff);
-    int_to_str_tree_destroy (&rdr->marker_names);
+    jpg_chunked_reader_window_free (rdr);
 
-    if (rdr->file != 0) {
+    if (rdr->file > 0) {
         close (rdr->file);
     }
 
+    if (rdr->mode == JPG_READER_MMAP && rdr->data != NULL) {
+        munmap (rdr->data, rdr->file_size);
+    }
+
     mem_pool_destroy (&rdr->pool);
 }
 
@@ -215,6 +241,14 @@ enum marker_t {
                                 (marker & 0xFFF0) == JPG_MARKER_SOF0)
 #define JPG_MARKER_RST(marker) ((marker & 0xFFF0) == JPG_MARKER_RST0 && (marker & 0x000F) <= 7)
 
+// All markers other than ERR start with 0xFF, so they are indexed by their
+// second byte.
+#define JPG_MARKER_ROW(SYMBOL,VALUE) [(VALUE) & 0xFF] = #SYMBOL,
+char *g_jpg_marker_names[256] = {
+    JPG_MARKER_TABLE
+};
+#undef JPG_MARKER_ROW
+
 //////////////////////////////
 // TIFF constants
 
@@ -472,6 +506,126 @@ enum exif_tag_t {
 };
 #undef EXIF_TAG_ROW
 
+// Tags in the MakerNote written by iOS devices. None of this is documented,
+// names are the ones used by exiftool.
+//
+// AccelerationVector as viewed from the front of the phone:
+//   V[0] (X+ is toward the left side)
+//   V[1] (Y+ is toward the bottom)
+//   V[2] (Z+ points into the face of the phone)
+//
+// ImageUniqueID is different for each captured photo and survives exporting
+// and re-downloading, ContentIdentifier is shared by the still and the video
+// of a Live Photo.
+#define APPLE_MAKERNOTE_TAG_TABLE \
+    APPLE_TAG_ROW(MakerNoteVersion,        0x01) \
+    APPLE_TAG_ROW(AEMatrix,                0x02) \
+    APPLE_TAG_ROW(RunTime,                 0x03) \
+    APPLE_TAG_ROW(AEStable,                0x04) \
+    APPLE_TAG_ROW(AETarget,                0x05) \
+    APPLE_TAG_ROW(AEAverage,               0x06) \
+    APPLE_TAG_ROW(AFStable,                0x07) \
+    APPLE_TAG_ROW(AccelerationVector,      0x08) \
+    APPLE_TAG_ROW(HDRImageType,            0x0A) \
+    APPLE_TAG_ROW(BurstUUID,               0x0B) \
+    APPLE_TAG_ROW(FocusDistanceRange,      0x0C) \
+    APPLE_TAG_ROW(OISMode,                 0x0F) \
+    APPLE_TAG_ROW(ContentIdentifier,       0x11) \
+    APPLE_TAG_ROW(ImageCaptureType,        0x14) \
+    APPLE_TAG_ROW(ImageUniqueID,           0x15) \
+    APPLE_TAG_ROW(LivePhotoVideoIndex,     0x17) \
+    APPLE_TAG_ROW(QualityHint,             0x1A) \
+    APPLE_TAG_ROW(LuminanceNoiseAmplitude, 0x1D) \
+
+#define APPLE_TAG_ROW(SYMBOL,VALUE) APPLE_TAG_ ## SYMBOL = VALUE,
+enum apple_makernote_tag_t {
+    APPLE_MAKERNOTE_TAG_TABLE
+};
+#undef APPLE_TAG_ROW
+
+//////////////////////////////
+// Tag names
+//
+// Tag values are sparse, so names are stored in tables indexed by the tag
+// modulo the table size. Sizes were chosen so that no two tags of a table map
+// to the same slot, which makes this a perfect hash. If a tag added to one of
+// the tables collides with another one, the duplicate initializer becomes a
+// compilation error, then the table size has to be changed.
+//
+// :split_exif_and_gps_tags
+// Each IFD has its own table, so we only lookup the corresponding tags in each
+// IFD. This will then mark as unknown a GPS IFD tag that shows up in the Exif
+// IFD, and vice versa.
+
+struct tag_name_t {
+    uint16_t tag;
+    char *name;
+};
+
+#define TIFF_TAG_NAMES_SIZE 74
+#define EXIF_IFD_TAG_NAMES_SIZE 311
+#define GPS_IFD_TAG_NAMES_SIZE 32
+#define APPLE_MAKERNOTE_TAG_NAMES_SIZE 32
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+
+#define TIFF_TAG_ROW(SYMBOL,VALUE,TYPE,COUNT) [(VALUE) % TIFF_TAG_NAMES_SIZE] = {VALUE, #SYMBOL},
+struct tag_name_t g_tiff_tag_names[TIFF_TAG_NAMES_SIZE] = {
+    TIFF_TAG_TABLE
+};
+#undef TIFF_TAG_ROW
+
+#define EXIF_TAG_ROW(SYMBOL,VALUE,TYPE,COUNT) [(VALUE) % EXIF_IFD_TAG_NAMES_SIZE] = {VALUE, #SYMBOL},
+struct tag_name_t g_exif_ifd_tag_names[EXIF_IFD_TAG_NAMES_SIZE] = {
+    EXIF_IFD_TAG_TABLE
+};
+#undef EXIF_TAG_ROW
+
+#define EXIF_TAG_ROW(SYMBOL,VALUE,TYPE,COUNT) [(VALUE) % GPS_IFD_TAG_NAMES_SIZE] = {VALUE, #SYMBOL},
+struct tag_name_t g_gps_ifd_tag_names[GPS_IFD_TAG_NAMES_SIZE] = {
+    EXIF_GPS_TAG_TABLE
+};
+#undef EXIF_TAG_ROW
+
+#define APPLE_TAG_ROW(SYMBOL,VALUE) [(VALUE) % APPLE_MAKERNOTE_TAG_NAMES_SIZE] = {VALUE, #SYMBOL},
+struct tag_name_t g_apple_makernote_tag_names[APPLE_MAKERNOTE_TAG_NAMES_SIZE] = {
+    APPLE_MAKERNOTE_TAG_TABLE
+};
+#undef APPLE_TAG_ROW
+
+#pragma GCC diagnostic pop
+
+#define TIFF_TAG_NAME_LOOKUP(name) char* name(uint16_t tag)
+typedef TIFF_TAG_NAME_LOOKUP(tiff_tag_name_lookup_t);
+
+static inline
+char* tag_name_lookup (struct tag_name_t *names, uint32_t names_size, uint16_t tag)
+{
+    struct tag_name_t *entry = &names[tag % names_size];
+    return entry->tag == tag ? entry->name : NULL;
+}
+
+TIFF_TAG_NAME_LOOKUP(tiff_tag_name)
+{
+    return tag_name_lookup (g_tiff_tag_names, TIFF_TAG_NAMES_SIZE, tag);
+}
+
+TIFF_TAG_NAME_LOOKUP(exif_ifd_tag_name)
+{
+    return tag_name_lookup (g_exif_ifd_tag_names, EXIF_IFD_TAG_NAMES_SIZE, tag);
+}
+
+TIFF_TAG_NAME_LOOKUP(gps_ifd_tag_name)
+{
+    return tag_name_lookup (g_gps_ifd_tag_names, GPS_IFD_TAG_NAMES_SIZE, tag);
+}
+
+TIFF_TAG_NAME_LOOKUP(apple_makernote_tag_name)
+{
+    return tag_name_lookup (g_apple_makernote_tag_names, APPLE_MAKERNOTE_TAG_NAMES_SIZE, tag);
+}
+
 GCC_PRINTF_FORMAT(2, 3)
 void jpg_error (struct jpg_reader_t *rdr, const char *format, ...)
 {
@@ -479,6 +633,7 @@ void jpg_error (struct jpg_reader_t *rdr, const char *format, ...)
         return;
     }
     rdr->error = true;
+    rdr->end = rdr->pos;
 
     PRINTF_INIT (format, size, args);
     // Here size includes NULL byte and str_maybe_grow() adds 1 to passed size
@@ -526,14 +681,111 @@ void print_jpg_messages (struct jpg_reader_t *rdr)
 }
 
 ////////////////////////////////
-// -----------
-// File reader
-// -----------
+// --------------
+// Chunked reader
+// --------------
 //
-// A jpg reader that reads directly form the file system. It will be faster if
-// we need to quickly process a lot of files of which we are reading a small
-// part, like its metadata.
-JPG_READER_API_READ_BYTES(jpg_file_reader_read_bytes)
+// A jpg reader that keeps a window of the file in memory and serves reads from
+// it, refilling it with pread() when a read falls outside. Advancing and
+// jumping only move the offset, so parsing metadata usually costs a single
+// read of the first window.
+//
+// Every time the window is refilled right where the previous one ended we
+// assume the caller is walking the whole file and double its size, up to
+// JPG_READER_WINDOW_MAX_SIZE. Callers that know they will read everything
+// should use the memory or mmap readers instead.
+//
+// Pointers returned by read_bytes are only valid until the next read.
+//
+// Most files only ever need the initial window, these are recycled so reading
+// metadata of many files doesn't allocate a new one for each of them.
+#define JPG_READER_WINDOW_MIN_SIZE kilobyte(64)
+#define JPG_READER_WINDOW_MAX_SIZE megabyte(4)
+
+static struct buff_recycler_t g_jpg_reader_windows = BUFF_RECYCLER_INIT(JPG_READER_WINDOW_MIN_SIZE);
+
+void jpg_chunked_reader_window_free (struct jpg_reader_t *rdr)
+{
+    if (rdr->window_capacity == JPG_READER_WINDOW_MIN_SIZE) {
+        buff_recycler_put (&g_jpg_reader_windows, rdr->window);
+    } else {
+        free (rdr->window);
+    }
+
+    rdr->window = NULL;
+    rdr->window_capacity = 0;
+}
+
+void jpg_chunked_reader_set_pos (struct jpg_reader_t *rdr)
+{
+    if (rdr->offset >= rdr->window_start &&
+        rdr->offset <= rdr->window_start + rdr->window_len) {
+        rdr->pos = rdr->window + (rdr->offset - rdr->window_start);
+        rdr->end = rdr->window + rdr->window_len;
+    } else {
+        rdr->pos = NULL;
+        rdr->end = NULL;
+    }
+}
+
+bool jpg_chunked_reader_refill (struct jpg_reader_t *rdr, uint64_t bytes_to_read)
+{
+    uint64_t new_size = rdr->window_size;
+    if (rdr->window != NULL && rdr->offset == rdr->window_start + rdr->window_len) {
+        new_size = MIN (2*new_size, JPG_READER_WINDOW_MAX_SIZE);
+    }
+
+    while (new_size < bytes_to_read) {
+        new_size *= 2;
+    }
+
+    if (rdr->window == NULL || new_size > rdr->window_capacity) {
+        jpg_chunked_reader_window_free (rdr);
+        if (new_size == JPG_READER_WINDOW_MIN_SIZE) {
+            rdr->window = buff_recycler_get (&g_jpg_reader_windows);
+        } else {
+            rdr->window = malloc (new_size);
+        }
+        rdr->window_capacity = new_size;
+    }
+    rdr->window_size = new_size;
+
+    uint64_t to_read = MIN (rdr->window_size, rdr->file_size - rdr->offset);
+    uint64_t bytes_read = 0;
+    while (bytes_read < to_read) {
+        ssize_t status = pread (rdr->file, rdr->window + bytes_read,
+                                to_read - bytes_read, rdr->offset + bytes_read);
+        trace_count (TRACE_COUNTER_READ, 1);
+        if (status == -1) {
+            if (errno != EINTR) {
+                jpg_error (rdr, "Failed call to pread(): %s", strerror(errno));
+                break;
+            }
+
+        } else if (status == 0) {
+            jpg_error (rdr, "File read error.");
+            break;
+
+        } else {
+            bytes_read += status;
+        }
+    }
+
+    rdr->window_start = rdr->offset;
+    rdr->window_len = bytes_read;
+    trace_count (TRACE_COUNTER_BYTES_READ, bytes_read);
+
+    // jpg_error() disabled the inline fast paths by setting end to pos,
+    // setting the position again would enable them.
+    if (rdr->error) {
+        return false;
+    }
+
+    jpg_chunked_reader_set_pos (rdr);
+    return true;
+}
+
+JPG_READER_API_READ_BYTES(jpg_chunked_reader_read_bytes)
 {
     if (rdr->error == true) {
         return NULL;
@@ -544,18 +796,19 @@ JPG_READER_API_READ_BYTES(jpg_file_reader_read_bytes)
         return NULL;
     }
 
-    uint8_t *data = NULL;
-    if (file_read_bytes_str (rdr->file, bytes_to_read, &rdr->buff)) {
-        data = bin_data(&rdr->buff);
-        rdr->offset += bytes_to_read;
-    } else {
-        jpg_error (rdr, "File read error.");
+    if (rdr->pos == NULL || rdr->offset + bytes_to_read > rdr->window_start + rdr->window_len) {
+        if (!jpg_chunked_reader_refill (rdr, bytes_to_read)) {
+            return NULL;
+        }
     }
 
+    uint8_t *data = rdr->pos;
+    rdr->pos += bytes_to_read;
+    rdr->offset += bytes_to_read;
     return data;
 }
 
-JPG_READER_API_ADVANCE_BYTES(jpg_file_reader_advance_bytes)
+JPG_READER_API_ADVANCE_BYTES(jpg_chunked_reader_advance_bytes)
 {
     if (rdr->error == true) {
         return;
@@ -566,14 +819,11 @@ JPG_READER_API_ADVANCE_BYTES(jpg_file_reader_advance_bytes)
         return;
     }
 
-    if (lseek (rdr->file, length, SEEK_CUR) != -1) {
-        rdr->offset += length;
-    } else {
-        jpg_error (rdr, "Failed call to lseek(): %s", strerror(errno));
-    }
+    rdr->offset += length;
+    jpg_chunked_reader_set_pos (rdr);
 }
 
-JPG_READER_API_JUMP_TO(jpg_file_reader_jump_to)
+JPG_READER_API_JUMP_TO(jpg_chunked_reader_jump_to)
 {
     if (rdr->error == true) {
         return;
@@ -584,11 +834,26 @@ JPG_READER_API_JUMP_TO(jpg_file_reader_jump_to)
         return;
     }
 
-    if (lseek (rdr->file, offset, SEEK_SET) != -1) {
-        rdr->offset = offset;
-    } else {
-        jpg_error (rdr, "Failed call to lseek(): %s", strerror(errno));
+    rdr->offset = offset;
+    jpg_chunked_reader_set_pos (rdr);
+}
+
+JPG_READER_API_ENSURE(jpg_chunked_reader_ensure)
+{
+    if (rdr->error == true) {
+        return false;
+    }
+
+    if (rdr->offset + bytes_needed > rdr->file_size) {
+        jpg_error (rdr, "Trying to read past EOF");
+        return false;
+    }
+
+    if (rdr->pos == NULL || rdr->offset + bytes_needed > rdr->window_start + rdr->window_len) {
+        return jpg_chunked_reader_refill (rdr, bytes_needed);
     }
+
+    return true;
 }
 
 // -------------
@@ -645,60 +910,175 @@ JPG_READER_API_JUMP_TO(jpg_memory_reader_jump_to)
     rdr->offset = offset;
 }
 
+JPG_READER_API_ENSURE(jpg_memory_reader_ensure)
+{
+    if (rdr->error == true) {
+        return false;
+    }
+
+    if (rdr->offset + bytes_needed > rdr->file_size) {
+        jpg_error (rdr, "Trying to read past EOF");
+        return false;
+    }
+
+    return true;
+}
+
+// ------------------------
+// Memory mapped reader
+// ------------------------
+//
+// Maps the file instead of copying it into the pool, then uses the same calls
+// as the memory reader. Only pages that are actually touched get read from
+// disk, so this is good both for header-only parsing and for full structure
+// dumps. We hint the kernel to read ahead sequentially, and to prefetch the
+// beginning of the file, where markers and metadata live.
+#define JPG_READER_MMAP_WILLNEED_SIZE kilobyte(64)
+
 ////////////////////////////////
 
-bool jpg_reader_init (struct jpg_reader_t *rdr, char *path, bool from_file)
+bool jpg_reader_init (struct jpg_reader_t *rdr, char *path, enum jpg_reader_mode_t mode)
 {
     bool success = true;
 
-    if (from_file) {
+    rdr->mode = mode;
+    if (mode == JPG_READER_CHUNKED) {
+        rdr->file = open (path, O_RDONLY);
+        trace_count (TRACE_COUNTER_OPEN, 1);
+        if (rdr->file == -1) {
+            success = false;
+            printf ("Error opening %s: %s\n", path, strerror(errno));
+        }
+
         struct stat st;
-        if (stat(path, &st) != 0) {
+        if (success) trace_count (TRACE_COUNTER_STAT, 1);
+        if (success && fstat(rdr->file, &st) != 0) {
             success = false;
             printf ("Could not stat %s: %s\n", path, strerror(errno));
         }
 
-        rdr->file_size = st.st_size;
-
         if (success) {
-            rdr->file = open (path, O_RDONLY);
-            if (rdr->file == -1) {
-                success = false;
-                printf ("Error opening %s: %s\n", path, strerror(errno));
-            }
+            rdr->file_size = st.st_size;
         }
 
-        rdr->read_bytes = jpg_file_reader_read_bytes;
-        rdr->advance_bytes = jpg_file_reader_advance_bytes;
-        rdr->jump_to = jpg_file_reader_jump_to;
+        rdr->window_size = JPG_READER_WINDOW_MIN_SIZE;
 
-    } else {
+        rdr->read_bytes = jpg_chunked_reader_read_bytes;
+        rdr->advance_bytes = jpg_chunked_reader_advance_bytes;
+        rdr->jump_to = jpg_chunked_reader_jump_to;
+        rdr->ensure = jpg_chunked_reader_ensure;
+
+    } else if (mode == JPG_READER_MEMORY) {
         rdr->data = (uint8_t*)full_file_read (&rdr->pool, path, &rdr->file_size);
         rdr->pos = rdr->data;
+        rdr->end = rdr->data != NULL ? rdr->data + rdr->file_size : NULL;
+        success = rdr->data != NULL;
+        if (success) {
+            trace_count (TRACE_COUNTER_OPEN, 1);
+            trace_count (TRACE_COUNTER_READ, 1);
+            trace_count (TRACE_COUNTER_BYTES_READ, rdr->file_size);
+        }
 
         rdr->read_bytes = jpg_memory_reader_read_bytes;
         rdr->advance_bytes = jpg_memory_reader_advance_bytes;
         rdr->jump_to = jpg_memory_reader_jump_to;
-    }
+        rdr->ensure = jpg_memory_reader_ensure;
 
-    if (success) {
-#define JPG_MARKER_ROW(SYMBOL,VALUE) \
-        int_to_str_tree_insert (&rdr->marker_names, VALUE, #SYMBOL);
-        JPG_MARKER_TABLE
-#undef JPG_MARKER_ROW
+    } else { // mode == JPG_READER_MMAP
+        int file = open (path, O_RDONLY);
+        trace_count (TRACE_COUNTER_OPEN, 1);
+        if (file == -1) {
+            success = false;
+            printf ("Error opening %s: %s\n", path, strerror(errno));
+        }
+
+        struct stat st;
+        if (success) trace_count (TRACE_COUNTER_STAT, 1);
+        if (success && fstat(file, &st) != 0) {
+            success = false;
+            printf ("Could not stat %s: %s\n", path, strerror(errno));
+        }
+
+        // Zero length mappings aren't allowed. An empty file is left with a
+        // NULL data pointer, all reads will then fail as reads past EOF.
+        if (success && st.st_size > 0) {
+            void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            trace_count (TRACE_COUNTER_MMAP, 1);
+            if (map != MAP_FAILED) {
+                rdr->data = map;
+                rdr->pos = rdr->data;
+                rdr->file_size = st.st_size;
+                rdr->end = rdr->data + rdr->file_size;
+
+                madvise (map, st.st_size, MADV_SEQUENTIAL);
+                madvise (map, MIN(st.st_size, JPG_READER_MMAP_WILLNEED_SIZE), MADV_WILLNEED);
+
+            } else {
+                success = false;
+                printf ("Error mapping %s: %s\n", path, strerror(errno));
+            }
+        }
+
+        // The mapping stays valid after closing the file descriptor.
+        if (file != -1) {
+            close (file);
+        }
+
+        rdr->read_bytes = jpg_memory_reader_read_bytes;
+        rdr->advance_bytes = jpg_memory_reader_advance_bytes;
+        rdr->jump_to = jpg_memory_reader_jump_to;
+        rdr->ensure = jpg_memory_reader_ensure;
     }
 
     rdr->error = !success;
     return success;
 }
 
+// These are the calls parsers should use. Whenever the requested bytes are
+// already in memory they are just a pointer bump, only the slow path goes
+// through the backend's function pointer.
+//
+// @performance
+// Calling through the function pointer for each byte made scanning entropy
+// coded data ~4x slower.
+static inline
+JPG_READER_API_ENSURE(jpg_reader_ensure)
+{
+    if ((uint64_t)(rdr->end - rdr->pos) >= bytes_needed) {
+        return true;
+    }
+
+    return rdr->ensure(rdr, bytes_needed);
+}
+
+// Only call this after jpg_reader_ensure() succeeded for at least length bytes.
+static inline
+void jpg_reader_consume (struct jpg_reader_t *rdr, uint64_t length)
+{
+    rdr->pos += length;
+    rdr->offset += length;
+}
+
+static inline
 JPG_READER_API_READ_BYTES(jpg_read_bytes)
 {
+    if ((uint64_t)(rdr->end - rdr->pos) >= bytes_to_read) {
+        uint8_t *data = rdr->pos;
+        jpg_reader_consume (rdr, bytes_to_read);
+        return data;
+    }
+
     return rdr->read_bytes(rdr, bytes_to_read);
 }
 
+static inline
 JPG_READER_API_ADVANCE_BYTES(jpg_advance_bytes)
 {
+    if ((uint64_t)(rdr->end - rdr->pos) >= length) {
+        jpg_reader_consume (rdr, length);
+        return;
+    }
+
     rdr->advance_bytes(rdr, length);
 }
 
@@ -709,9 +1089,16 @@ JPG_READER_API_JUMP_TO(jpg_jump_to)
 
 // NOTE: This returns constant strings, you shouldn't try writing to or freeing
 // them.
-char* marker_name (struct jpg_reader_t *rdr, enum marker_t marker)
+char* marker_name (enum marker_t marker)
 {
-    return int_to_str_get (&rdr->marker_names, marker);
+    char *name = NULL;
+    if (marker == JPG_MARKER_ERR) {
+        name = g_jpg_marker_names[0];
+    } else if ((marker & 0xFF00) == 0xFF00 && (marker & 0xFF) != 0) {
+        name = g_jpg_marker_names[marker & 0xFF];
+    }
+
+    return name;
 }
 
 // TODO: Make sure endianness is correct. Either make this function work for
@@ -720,8 +1107,10 @@ char* marker_name (struct jpg_reader_t *rdr, enum marker_t marker)
 enum marker_t jpg_read_marker (struct jpg_reader_t *rdr)
 {
     enum marker_t marker = JPG_MARKER_ERR;
-    uint8_t *data = jpg_read_bytes (rdr, 2);
-    if (!rdr->error) {
+    if (jpg_reader_ensure (rdr, 2)) {
+        uint8_t *data = rdr->pos;
+        jpg_reader_consume (rdr, 2);
+
         if (data[0] == 0xFF &&
             ((data[1] & 0xF0) == 0xC0 || (data[1] & 0xF0) == 0xD0 || (data[1] & 0xF0) == 0xE0 ||
             data[1] == (0xFF & JPG_MARKER_COM) || data[1] == (0xFF & JPG_MARKER_TEM))) {
@@ -742,8 +1131,8 @@ void jpg_expect_marker (struct jpg_reader_t *rdr, enum marker_t expected_marker)
     if (!rdr->error) {
         if (read_marker != expected_marker) {
             jpg_error (rdr, "Expected marker '%s' got: %s",
-                       marker_name(rdr, expected_marker),
-                       marker_name(rdr, read_marker));
+                       marker_name(expected_marker),
+                       marker_name(read_marker));
         }
     }
 }
@@ -808,25 +1197,53 @@ DEFINE_BYTE_ARRAY_TO_VALUE_ARRAY(byte_array_to_value_array_u64, 64);
 DEFINE_BYTE_ARRAY_TO_VALUE_ARRAY(byte_array_to_value_array_u32, 32);
 DEFINE_BYTE_ARRAY_TO_VALUE_ARRAY(byte_array_to_value_array_u16, 16);
 
+static inline
 uint64_t jpg_reader_read_value (struct jpg_reader_t *rdr, int value_size)
 {
     assert (value_size <= 8);
 
     uint64_t value = 0;
-    uint8_t *data = jpg_read_bytes (rdr, value_size);
-    if (!rdr->error) {
-        value = byte_array_to_value_u64 (data, value_size, rdr->endianess);
+    if (jpg_reader_ensure (rdr, value_size)) {
+        value = byte_array_to_value_u64 (rdr->pos, value_size, rdr->endianess);
+        jpg_reader_consume (rdr, value_size);
     }
 
     return value;
 }
 
+// Peek functions return the value at the current offset without consuming it,
+// or 0 if it's past EOF.
+#define DEFINE_PEEK_VALUE(FUNC_NAME,BIT_COUNT) \
+static inline                                                                                        \
+uint ## BIT_COUNT ## _t FUNC_NAME(struct jpg_reader_t *rdr)                                          \
+{                                                                                                    \
+    uint ## BIT_COUNT ## _t value = 0;                                                               \
+    if (jpg_reader_ensure (rdr, BIT_COUNT/8)) {                                                      \
+        value = byte_array_to_value_u ## BIT_COUNT(rdr->pos, BIT_COUNT/8, rdr->endianess);           \
+    }                                                                                                \
+    return value;                                                                                    \
+}
+
+DEFINE_PEEK_VALUE(jpg_reader_peek_u64, 64);
+DEFINE_PEEK_VALUE(jpg_reader_peek_u32, 32);
+DEFINE_PEEK_VALUE(jpg_reader_peek_u16, 16);
+
+static inline
+uint8_t jpg_reader_peek_u8(struct jpg_reader_t *rdr)
+{
+    return jpg_reader_ensure (rdr, 1) ? *rdr->pos : 0;
+}
+
 #define DEFINE_READ_VALUE(FUNC_NAME,BIT_COUNT) \
 static inline                                                                                        \
-uint16_t FUNC_NAME(struct jpg_reader_t *rdr)                                                         \
+uint ## BIT_COUNT ## _t FUNC_NAME(struct jpg_reader_t *rdr)                                          \
 {                                                                                                    \
-    uint8_t *data = jpg_file_reader_read_bytes(rdr, BIT_COUNT/8);                                    \
-    return data != NULL ? byte_array_to_value_u ## BIT_COUNT(data, BIT_COUNT/8, rdr->endianess) : 0; \
+    uint ## BIT_COUNT ## _t value = 0;                                                               \
+    if (jpg_reader_ensure (rdr, BIT_COUNT/8)) {                                                      \
+        value = byte_array_to_value_u ## BIT_COUNT(rdr->pos, BIT_COUNT/8, rdr->endianess);           \
+        jpg_reader_consume (rdr, BIT_COUNT/8);                                                       \
+    }                                                                                                \
+    return value;                                                                                    \
 }
 
 DEFINE_READ_VALUE(jpg_reader_read_value_u64, 64);
@@ -836,8 +1253,12 @@ DEFINE_READ_VALUE(jpg_reader_read_value_u16, 16);
 static inline
 uint8_t jpg_reader_read_value_u8(struct jpg_reader_t *rdr)
 {
-    uint8_t *data = jpg_file_reader_read_bytes(rdr, 1);
-    return data != NULL ? *data : 0;
+    uint8_t value = 0;
+    if (jpg_reader_ensure (rdr, 1)) {
+        value = *rdr->pos;
+        jpg_reader_consume (rdr, 1);
+    }
+    return value;
 }
 
 // NOTE: Be careful not to call this after stand alone markers SOI, EOI and TEM.
@@ -866,6 +1287,146 @@ bool is_scan_start (enum marker_t marker)
         marker == JPG_MARKER_SOS;
 }
 
+//////////////////////////////
+// Entropy coded segment scanning
+//
+// Inside entropy coded data a 0xFF byte can only be followed by 0x00 (a
+// stuffed 0xFF data byte), by another 0xFF (fill bytes, which may precede any
+// marker), by RSTn or by a real marker that ends the segment. These functions
+// look for 0xFF bytes 32 at a time and only classify the ones they find,
+// instead of looking at every byte of the image data.
+
+// Sets done if the 0xFF byte at ff ends the scan for a marker, either because
+// it starts one or because it's the last byte and can't be classified.
+static inline
+uint8_t* jpg_classify_ff_byte (uint8_t *ff, uint8_t *end, bool *done)
+{
+    *done = false;
+    if (ff + 1 >= end) {
+        *done = true;
+        return NULL;
+    }
+
+    if (ff[1] != 0x00 && ff[1] != 0xFF) {
+        *done = true;
+        return ff;
+    }
+
+    return NULL;
+}
+
+// Returns a pointer to the 0xFF that starts the first marker in [p, end) that
+// isn't stuffing or a fill byte, RSTn markers included. Returns NULL if there
+// is none, which includes the case where the last byte is 0xFF and can't be
+// classified.
+uint8_t* jpg_scan_for_marker (uint8_t *p, uint8_t *end)
+{
+    bool done;
+    uint8_t *marker;
+
+#if defined(__AVX2__)
+    __m256i ff_256 = _mm256_set1_epi8 ((char)0xFF);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256 ((__m256i*)p);
+        uint32_t mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (chunk, ff_256));
+        while (mask != 0) {
+            marker = jpg_classify_ff_byte (p + __builtin_ctz(mask), end, &done);
+            if (done) return marker;
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+
+#elif defined(__SSE2__)
+    __m128i ff_128 = _mm_set1_epi8 ((char)0xFF);
+    while (end - p >= 32) {
+        __m128i chunk_lo = _mm_loadu_si128 ((__m128i*)p);
+        __m128i chunk_hi = _mm_loadu_si128 ((__m128i*)(p + 16));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk_lo, ff_128)) |
+                        (uint32_t)_mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk_hi, ff_128)) << 16;
+        while (mask != 0) {
+            marker = jpg_classify_ff_byte (p + __builtin_ctz(mask), end, &done);
+            if (done) return marker;
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == 0xFF) {
+            marker = jpg_classify_ff_byte (p, end, &done);
+            if (done) return marker;
+        }
+    }
+
+    return NULL;
+}
+
+// Consumes entropy coded data up to and including the marker that ends it,
+// which is returned. This may be an RSTn marker.
+enum marker_t jpg_read_ecs_end_marker (struct jpg_reader_t *rdr)
+{
+    enum marker_t marker = JPG_MARKER_ERR;
+    while (jpg_reader_ensure (rdr, 2)) {
+        uint8_t *found = jpg_scan_for_marker (rdr->pos, rdr->end);
+        if (found != NULL) {
+            marker = 0xFF00 | found[1];
+            jpg_reader_consume (rdr, found + 2 - rdr->pos);
+            break;
+        }
+
+        // Keep the last byte, it may be the first half of a marker.
+        jpg_reader_consume (rdr, rdr->end - rdr->pos - 1);
+    }
+
+    return marker;
+}
+
+struct jpg_scan_index_t {
+    // File offsets where each entropy coded segment starts. There will be
+    // more than one only if the scan has restart markers.
+    DYNAMIC_ARRAY_DEFINE (uint64_t, ecs_offsets);
+
+    // Number of RSTn markers that weren't the next one in the modulo 8
+    // sequence.
+    uint64_t rst_errors;
+
+    // Marker that ended the scan.
+    enum marker_t end_marker;
+};
+
+// Reads a scan's entropy coded data, starting right after the SOS marker
+// segment, recording where each segment between restart markers starts. The
+// reader is left after the marker that ends the scan. The index is freed when
+// the passed pool is destroyed.
+struct jpg_scan_index_t* jpg_index_scan (struct jpg_reader_t *rdr, mem_pool_t *pool)
+{
+    struct jpg_scan_index_t *idx = mem_pool_push_struct (pool, struct jpg_scan_index_t);
+    *idx = ZERO_INIT (struct jpg_scan_index_t);
+    DYNAMIC_ARRAY_INIT (pool, idx->ecs_offsets, 0);
+
+    uint64_t rst_check = 0;
+    enum marker_t marker = JPG_MARKER_ERR;
+    while (!rdr->error) {
+        DYNAMIC_ARRAY_APPEND (idx->ecs_offsets, rdr->offset);
+        marker = jpg_read_ecs_end_marker (rdr);
+
+        if (JPG_MARKER_RST(marker)) {
+            if ((marker ^ JPG_MARKER_RST0) != rst_check) {
+                idx->rst_errors++;
+            }
+        } else {
+            break;
+        }
+
+        rst_check = (rst_check+1) % 8;
+    }
+
+    idx->end_marker = marker;
+    return idx;
+}
+
 void print_jpeg_structure (char *path)
 {
     bool success = true;
@@ -874,7 +1435,7 @@ void print_jpeg_structure (char *path)
 
     struct jpg_reader_t _rdr = {0};
     struct jpg_reader_t *rdr = &_rdr;
-    jpg_reader_init (rdr, path, false);
+    jpg_reader_init (rdr, path, JPG_READER_MMAP);
 
     if (success) {
         jpg_expect_marker (rdr, JPG_MARKER_SOI);
@@ -896,7 +1457,7 @@ void print_jpeg_structure (char *path)
                     first = false;
                 }
 
-                printf (" %s\n", marker_name(rdr, marker));
+                printf (" %s\n", marker_name(marker));
                 int marker_segment_length = jpg_read_marker_segment_length (rdr);
                 jpg_advance_bytes (rdr, marker_segment_length - 2);
 
@@ -906,11 +1467,11 @@ void print_jpeg_structure (char *path)
 
         // Frame header
         if (JPG_MARKER_SOF(marker)) {
-            printf ("%s\n", marker_name(rdr, marker));
+            printf ("%s\n", marker_name(marker));
             int marker_segment_length = jpg_read_marker_segment_length (rdr);
             jpg_advance_bytes (rdr, marker_segment_length - 2);
         } else {
-            jpg_error (rdr, "Expected SOF marker, got '%s'", marker_name(rdr, marker));
+            jpg_error (rdr, "Expected SOF marker, got '%s'", marker_name(marker));
         } 
 
         // Read Scans
@@ -931,7 +1492,7 @@ void print_jpeg_structure (char *path)
                         first = false;
                     }
 
-                    printf ("  %s\n", marker_name(rdr, marker));
+                    printf ("  %s\n", marker_name(marker));
                     int marker_segment_length = jpg_read_marker_segment_length (rdr);
                     jpg_advance_bytes (rdr, marker_segment_length - 2);
 
@@ -940,52 +1501,19 @@ void print_jpeg_structure (char *path)
             }
 
             if (marker == JPG_MARKER_SOS) {
-                printf (" %s\n", marker_name(rdr, marker));
+                printf (" %s\n", marker_name(marker));
                 int marker_segment_length = jpg_read_marker_segment_length (rdr);
                 jpg_advance_bytes (rdr, marker_segment_length - 2);
             } else {
-                jpg_error (rdr, "Expected SOS marker, got '%s'", marker_name(rdr, marker));
+                jpg_error (rdr, "Expected SOS marker, got '%s'", marker_name(marker));
             } 
 
-            uint64_t ecs_count = 0;
-            uint64_t rst_check = 0;
-            uint64_t rst_errors_found = 0;
-            while (!rdr->error) {
-                // Process ECS block
-                uint64_t buffer = 0x0;
-                while (!rdr->error &&
-                       ((buffer & 0xFF00) != 0xFF00 || (buffer & 0xFF) == 0x0))
-                {
-                    // @performance
-                    // Avoiding the function pointer call makes
-                    // processing ~4x faster.
-                    //
-                    // Equivalent to:
-                    // data = jpg_read_bytes (rdr, 1);
-                    uint8_t *data = rdr->pos;
-                    rdr->pos++;
-
-                    buffer <<= 8;
-                    buffer |= *data;
-                }
-                ecs_count++;
-
-                // Handle RST marker or end ECS segment processing.
-                marker = 0xFFFF & buffer;
-                if (JPG_MARKER_RST(marker)) {
-                    if ((marker ^ JPG_MARKER_RST0) != rst_check) {
-                        rst_errors_found++;
-                    }
-                } else {
-                    break;
-                }
+            struct jpg_scan_index_t *scan_index = jpg_index_scan (rdr, &rdr->pool);
+            marker = scan_index->end_marker;
 
-                rst_check = (rst_check+1) % 8;
-            }
-
-            printf (" ECS (%lu)", ecs_count);
-            if (rst_errors_found > 0) {
-                printf ("- errors %lu\n", rst_errors_found);
+            printf (" ECS (%d)", scan_index->ecs_offsets_len);
+            if (scan_index->rst_errors > 0) {
+                printf ("- errors %lu\n", scan_index->rst_errors);
             } else {
                 printf ("\n");
             }
@@ -999,7 +1527,7 @@ void print_jpeg_structure (char *path)
         }
 
         if (marker != JPG_MARKER_EOI) {
-            jpg_error (rdr, "Expected marker EOI got: %s", marker_name(rdr, marker));
+            jpg_error (rdr, "Expected marker EOI got: %s", marker_name(marker));
         } 
 
 
@@ -1063,12 +1591,9 @@ struct jpg_decoder_t {
 
 void jpg_next_bit (struct jpg_reader_t *rdr, struct jpg_decoder_t *jpg)
 {
-    // TODO: I think we can read 64 bits to make things faster, or read much
-    // more into memory through the reader?. Maybe make the reader load by
-    // chunks, and make the chunk size be a value that can be set dynamically. I
-    // like this idea... because then the reader API doesn't need the file and
-    // memory versions of calls, and we can switch from one to the other one
-    // during a read!!!
+    // TODO: I think we can read 64 bits at a time to make things faster. Now
+    // that the chunked reader exists, the window is large enough that we could
+    // fill a bit buffer directly from it.
     if (jpg->bit_cnt == 0) {
         jpg->byte = jpg_reader_read_value_u8 (rdr);
         jpg->bit_cnt = 8;
@@ -1249,7 +1774,7 @@ void cat_jpeg_structure (string_t *str, char *fname)
 
     struct jpg_reader_t _rdr = {0};
     struct jpg_reader_t *rdr = &_rdr;
-    jpg_reader_init (rdr, fname, true);
+    jpg_reader_init (rdr, fname, JPG_READER_MMAP);
 
     // Begin reading JPEG file.
     jpg_expect_marker (rdr, JPG_MARKER_SOI);
@@ -1319,7 +1844,7 @@ void cat_jpeg_structure (string_t *str, char *fname)
             } else {
                 int marker_segment_length = jpg_read_marker_segment_length (rdr);
                 jpg_advance_bytes (rdr, marker_segment_length - 2);
-                catr_cat (catr, "%s\n", marker_name (rdr, marker));
+                catr_cat (catr, "%s\n", marker_name (marker));
             }
 
             marker = jpg_read_marker (rdr);
@@ -1338,7 +1863,7 @@ void cat_jpeg_structure (string_t *str, char *fname)
         //
         //  1303 SOF0
         //    24 SOF2 (Most of these seem to come from WhatsApp)
-        catr_cat (catr, "%s\n", marker_name (rdr, marker));
+        catr_cat (catr, "%s\n", marker_name (marker));
         catr_push_indent (catr);
 
         int lf = jpg_read_marker_segment_length (rdr);
@@ -1390,12 +1915,12 @@ void cat_jpeg_structure (string_t *str, char *fname)
         catr_pop_indent (catr);
 
         if (marker_end != rdr->offset) {
-            jpg_warn (rdr, "Padded marker '%s'.", marker_name(rdr, marker));
+            jpg_warn (rdr, "Padded marker '%s'.", marker_name(marker));
             jpg_jump_to (rdr, marker_end);
         }
 
     } else {
-        jpg_error (rdr, "Expected SOF marker, got '%s'", marker_name(rdr, marker));
+        jpg_error (rdr, "Expected SOF marker, got '%s'", marker_name(marker));
     }
 
     // Currently we only expect one scan because we don't support progressive DCT.
@@ -1596,7 +2121,7 @@ void cat_jpeg_structure (string_t *str, char *fname)
                 }
 
             } else {
-                catr_cat (catr, "%s\n", marker_name (rdr, marker));
+                catr_cat (catr, "%s\n", marker_name (marker));
                 int marker_segment_length = jpg_read_marker_segment_length (rdr);
                 jpg_advance_bytes (rdr, marker_segment_length - 2);
             }
@@ -1651,14 +2176,14 @@ void cat_jpeg_structure (string_t *str, char *fname)
         catr_cat (catr, "Al: %u\n", al);
 
         if (marker_end != rdr->offset) {
-            jpg_warn (rdr, "Padded marker '%s'.", marker_name(rdr, marker));
+            jpg_warn (rdr, "Padded marker '%s'.", marker_name(marker));
             jpg_jump_to (rdr, marker_end);
         }
 
         catr_pop_indent (catr);
 
     } else {
-        jpg_error (rdr, "Expected SOS marker, got '%s'", marker_name(rdr, marker));
+        jpg_error (rdr, "Expected SOS marker, got '%s'", marker_name(marker));
     }
 
     // Decode the scan's image data stream.
@@ -1675,7 +2200,7 @@ void cat_jpeg_structure (string_t *str, char *fname)
             memset (old_dc, 0, ns*sizeof(int16_t));
 
             int16_t diff[ns][hi_max][vi_max];
-            memset (old_dc, 0, ns*hi_max*vi_max*sizeof(int16_t));
+            memset (diff, 0, ns*hi_max*vi_max*sizeof(int16_t));
 
             uint64_t x_blocks_len = x/(8*hi_max);
             uint64_t y_blocks_len = y/(8*vi_max);
@@ -1835,6 +2360,8 @@ void cat_jpeg_structure (string_t *str, char *fname)
 
     str_cat_jpg_messages (str, rdr);
     jpg_reader_destroy (rdr);
+    mem_pool_destroy (pool);
+    mem_pool_destroy (&catr->pool);
 }
 
 // NOTE: This supports passing -1 as bytes_to_read to mean 'read all image
@@ -1938,55 +2465,73 @@ struct tiff_ifd_t* tiff_read_ifd (struct jpg_reader_t *rdr, mem_pool_t *pool,
     struct tiff_ifd_t *ifd = mem_pool_push_struct (pool, struct tiff_ifd_t);
     *ifd = ZERO_INIT (struct tiff_ifd_t);
 
+    *next_ifd_offset = 0;
     ifd->ifd_offset = rdr->offset - tiff_data_start;
     ifd->entries_len = jpg_reader_read_value (rdr, 2);
-    ifd->entries = mem_pool_push_array (pool, ifd->entries_len, struct tiff_entry_t);
-
-    int directory_entry_count = 0;
-    while (!rdr->error && directory_entry_count < ifd->entries_len) {
-        struct tiff_entry_t *entry = &ifd->entries[directory_entry_count];
-        *entry = ZERO_INIT (struct tiff_entry_t);
 
-        directory_entry_count++;
-
-        entry->tag = jpg_reader_read_value (rdr, 2);
-        entry->type = jpg_reader_read_value (rdr, 2);
-        entry->count = jpg_reader_read_value (rdr, 4);
+    // Make the whole directory available at once so entries can be parsed
+    // directly from memory. Values that don't fit in the entry are read
+    // afterwards, reading them may move the reader's window.
+    uint64_t directory_size = 12*ifd->entries_len + 4/*next IFD offset*/;
+    if (jpg_reader_ensure (rdr, directory_size)) {
+        ifd->entries = mem_pool_push_array (pool, ifd->entries_len, struct tiff_entry_t);
+
+        uint8_t *directory = rdr->pos;
+        uint64_t directory_offset = rdr->offset;
+        for (int i=0; i < ifd->entries_len; i++) {
+            struct tiff_entry_t *entry = &ifd->entries[i];
+            *entry = ZERO_INIT (struct tiff_entry_t);
+
+            uint8_t *entry_data = directory + 12*i;
+            entry->tag = byte_array_to_value_u16 (entry_data, 2, rdr->endianess);
+            entry->type = byte_array_to_value_u16 (entry_data + 2, 2, rdr->endianess);
+            entry->count = byte_array_to_value_u32 (entry_data + 4, 4, rdr->endianess);
+
+            // Types outside the table are handled as unknown, we can't compute
+            // their size.
+            if (entry->type >= ARRAY_SIZE(tiff_type_sizes)) {
+                entry->type = TIFF_TYPE_NONE;
+            }
 
-        if (!rdr->error) {
             if (entry->type != TIFF_TYPE_NONE) {
                 uint64_t byte_count = tiff_type_sizes[entry->type]*entry->count;
                 if (byte_count <= 4) {
                     entry->is_value_in_offset = true;
-                    entry->value_offset = rdr->offset - tiff_data_start;
-
-                    uint8_t *value_data = jpg_read_bytes (rdr, 4);
-                    entry->value = tiff_read_value_data (pool, value_data, byte_count,
+                    entry->value_offset = directory_offset + 12*i + 8 - tiff_data_start;
+                    entry->value = tiff_read_value_data (pool, entry_data + 8, byte_count,
                                                          rdr->endianess, entry->type);
 
                 } else {
-                    entry->value_offset = jpg_reader_read_value (rdr, 4);
-
-                    uint64_t current_offset = rdr->offset;
-                    jpg_jump_to (rdr, tiff_data_start + entry->value_offset);
-
-                    uint8_t *value_data = jpg_read_bytes (rdr, byte_count);
-                    entry->value = tiff_read_value_data (pool, value_data, byte_count,
-                                                         rdr->endianess, entry->type);
-
-                    jpg_jump_to (rdr, current_offset);
+                    entry->value_offset = byte_array_to_value_u32 (entry_data + 8, 4, rdr->endianess);
                 }
 
             } else {
                 // The value has an unknown type, we won't be able to read it.
                 // We read the offset anyway, because we need to keep reading
                 // the rest of the entries.
-                entry->value_offset = jpg_reader_read_value (rdr, 4);
+                entry->value_offset = byte_array_to_value_u32 (entry_data + 8, 4, rdr->endianess);
             }
         }
-    }
 
-    *next_ifd_offset = jpg_reader_read_value (rdr, 4);
+        *next_ifd_offset = byte_array_to_value_u32 (directory + 12*ifd->entries_len, 4, rdr->endianess);
+        jpg_reader_consume (rdr, directory_size);
+
+        uint64_t directory_end = rdr->offset;
+        for (int i=0; !rdr->error && i < ifd->entries_len; i++) {
+            struct tiff_entry_t *entry = &ifd->entries[i];
+            if (entry->type != TIFF_TYPE_NONE && !entry->is_value_in_offset) {
+                uint64_t byte_count = tiff_type_sizes[entry->type]*entry->count;
+
+                jpg_jump_to (rdr, tiff_data_start + entry->value_offset);
+                uint8_t *value_data = jpg_read_bytes (rdr, byte_count);
+                if (!rdr->error) {
+                    entry->value = tiff_read_value_data (pool, value_data, byte_count,
+                                                         rdr->endianess, entry->type);
+                }
+            }
+        }
+        jpg_jump_to (rdr, directory_end);
+    }
 
     if (rdr->error) {
         mem_pool_end_temporary_memory (mrkr);
@@ -2040,19 +2585,6 @@ struct tiff_ifd_t* read_tiff_6 (struct jpg_reader_t *rdr, mem_pool_t *pool,
     return tiff_data;
 }
 
-struct tiff_tag_definitions_t {
-    struct int_to_str_tree_t tiff_tag_names;
-
-    // TODO: Still not sure if it's a good idea to split these. Did it so we
-    // only lookup the corresponding tags in each IFD. This will then mark as
-    // unknown a GPS IFD tag that shows up in the Exif IFD, and vice versa.
-    // :split_exif_and_gps_tags
-    struct int_to_str_tree_t exif_ifd_tag_names;
-    struct int_to_str_tree_t gps_ifd_tag_names;
-};
-
-struct tiff_tag_definitions_t g_tiff_tag_names = {0};
-
 void str_cat_tiff_entry_value (string_t *str, void *value, enum tiff_type_t type, uint32_t count)
 {
     if (type != TIFF_TYPE_NONE) {
@@ -2124,7 +2656,7 @@ void str_cat_tiff_entry_value (string_t *str, void *value, enum tiff_type_t type
 }
 
 void str_cat_tiff_ifd (string_t *str, struct tiff_ifd_t *curr_ifd,
-                       bool print_hex_values, bool print_offsets, struct int_to_str_tree_t *local_tag_names)
+                       bool print_hex_values, bool print_offsets, tiff_tag_name_lookup_t *local_tag_name)
 {
     for (int directory_entry_idx = 0; directory_entry_idx < curr_ifd->entries_len; directory_entry_idx++) {
         struct tiff_entry_t *entry = &curr_ifd->entries[directory_entry_idx];
@@ -2132,12 +2664,12 @@ void str_cat_tiff_ifd (string_t *str, struct tiff_ifd_t *curr_ifd,
         str_cat_c (str, "  "); // Indentation
 
         char* tag_name = NULL;
-        if (local_tag_names != NULL) {
-            tag_name = int_to_str_get (local_tag_names, entry->tag);
+        if (local_tag_name != NULL) {
+            tag_name = local_tag_name (entry->tag);
         }
 
         if (tag_name == NULL) {
-            tag_name = int_to_str_get (&g_tiff_tag_names.tiff_tag_names, entry->tag);
+            tag_name = tiff_tag_name (entry->tag);
         }
 
         if (tag_name != NULL) {
@@ -2192,7 +2724,7 @@ void str_cat_tiff_ifd_offset (string_t *str, bool print_offsets, uint32_t offset
 }
 
 void str_cat_tiff (string_t *str, struct tiff_ifd_t *tiff,
-                   enum jpg_reader_endianess_t *endianess, struct int_to_str_tree_t *local_tag_names,
+                   enum jpg_reader_endianess_t *endianess, tiff_tag_name_lookup_t *local_tag_name,
                    bool print_hex_values, bool print_offsets)
 {
     str_cat_c (str, "TIFF data:\n");
@@ -2210,39 +2742,15 @@ void str_cat_tiff (string_t *str, struct tiff_ifd_t *tiff,
     while (curr_ifd != NULL) {
         str_cat_printf (str, " IFD %d", ifd_count);
         str_cat_tiff_ifd_offset (str, print_offsets, curr_ifd->ifd_offset);
-        str_cat_tiff_ifd (str, curr_ifd, print_hex_values, print_offsets, local_tag_names);
+        str_cat_tiff_ifd (str, curr_ifd, print_hex_values, print_offsets, local_tag_name);
 
         ifd_count++;
         curr_ifd = curr_ifd->next;
     }
 }
 
-void tiff_data_init ()
-{
-    if (g_tiff_tag_names.tiff_tag_names.num_nodes == 0) {
-#define TIFF_TAG_ROW(SYMBOL,VALUE,TYPE,COUNT) \
-        int_to_str_tree_insert (&g_tiff_tag_names.tiff_tag_names, VALUE, #SYMBOL);
-        TIFF_TAG_TABLE
-#undef TIFF_TAG_ROW
-
-        // :split_exif_and_gps_tags
-#define EXIF_TAG_ROW(SYMBOL,VALUE,TYPE,COUNT) \
-        int_to_str_tree_insert (&g_tiff_tag_names.exif_ifd_tag_names, VALUE, #SYMBOL);
-        EXIF_IFD_TAG_TABLE
-#undef EXIF_TAG_ROW
-
-        // :split_exif_and_gps_tags
-#define EXIF_TAG_ROW(SYMBOL,VALUE,TYPE,COUNT) \
-        int_to_str_tree_insert (&g_tiff_tag_names.gps_ifd_tag_names, VALUE, #SYMBOL);
-        EXIF_GPS_TAG_TABLE
-#undef EXIF_TAG_ROW
-    }
-}
-
 void print_tiff_6 (struct jpg_reader_t *rdr)
 {
-    tiff_data_init ();
-
     mem_pool_t pool = {0};
     string_t out = {0};
 
@@ -2270,7 +2778,7 @@ struct tiff_ifd_t* str_cat_tiff_ifd_at_offset (
     char *name, uint32_t tiff_data_start,
     bool print_offsets, uint32_t offset,
     bool print_hex_values,
-    struct int_to_str_tree_t *local_tag_names)
+    tiff_tag_name_lookup_t *local_tag_name)
 {
     str_cat_c (str, name);
     str_cat_tiff_ifd_offset (str, print_offsets, offset);
@@ -2279,7 +2787,7 @@ struct tiff_ifd_t* str_cat_tiff_ifd_at_offset (
     uint64_t current_offset = rdr->offset;
     jpg_jump_to (rdr, tiff_data_start + offset);
     struct tiff_ifd_t *ifd = tiff_read_ifd (rdr, pool, tiff_data_start, &next_ifd_offset);
-    str_cat_tiff_ifd (str, ifd, print_hex_values, print_offsets, local_tag_names);
+    str_cat_tiff_ifd (str, ifd, print_hex_values, print_offsets, local_tag_name);
     jpg_jump_to (rdr, current_offset);
 
     return ifd;
@@ -2287,8 +2795,6 @@ struct tiff_ifd_t* str_cat_tiff_ifd_at_offset (
 
 void print_exif_as_tiff_data_with_ir (struct jpg_reader_t *rdr)
 {
-    tiff_data_init ();
-
     mem_pool_t pool = {0};
     string_t out = {0};
 
@@ -2343,7 +2849,7 @@ void print_exif_as_tiff_data_with_ir (struct jpg_reader_t *rdr)
         if (exif_ifd_offset != 0) {
             struct tiff_ifd_t *exif_ifd =
                 str_cat_tiff_ifd_at_offset (&out, rdr, &pool, " Exif IFD", tiff_data_start,
-                                            print_offsets, exif_ifd_offset, print_hex_values, &g_tiff_tag_names.exif_ifd_tag_names);
+                                            print_offsets, exif_ifd_offset, print_hex_values, exif_ifd_tag_name);
 
             // Lookup the MakerNote tag
             for (uint32_t entry_idx = 0; entry_idx < exif_ifd->entries_len; entry_idx++) {
@@ -2356,7 +2862,7 @@ void print_exif_as_tiff_data_with_ir (struct jpg_reader_t *rdr)
 
         if (gps_ifd_offset != 0) {
             str_cat_tiff_ifd_at_offset (&out, rdr, &pool, " GPS IFD", tiff_data_start,
-                                        print_offsets, gps_ifd_offset, print_hex_values, &g_tiff_tag_names.gps_ifd_tag_names);
+                                        print_offsets, gps_ifd_offset, print_hex_values, gps_ifd_tag_name);
         }
 
         if (interoperability_ifd_offset != 0) {
@@ -2388,7 +2894,7 @@ void print_exif_as_tiff_data_with_ir (struct jpg_reader_t *rdr)
             if (strcmp (name, "Apple iOS") == 0) {
                 uint16_t version = jpg_reader_read_value (rdr, 2);
                 if (!rdr->error && version == 1) {
-                    uint8_t *byte_order = jpg_file_reader_read_bytes (rdr, 2);
+                    uint8_t *byte_order = jpg_read_bytes (rdr, 2);
                     if (!rdr->error) {
                         if (memcmp (byte_order, "II", 2) == 0) {
                             rdr->endianess = BYTE_READER_LITTLE_ENDIAN;
@@ -2402,17 +2908,37 @@ void print_exif_as_tiff_data_with_ir (struct jpg_reader_t *rdr)
 
                     uint64_t next_ifd_offset;
                     struct tiff_ifd_t *ifd = tiff_read_ifd (rdr, &pool, tiff_data_start + maker_note->value_offset, &next_ifd_offset);
-                    str_cat_tiff_ifd (&out, ifd, print_hex_values, print_offsets, NULL);
-
-                    // TODO: Get a bplist reader and parse the values of tags 0x2
-                    // and 0x3.
-                    // TODO: Tag 0x8 is acceleration vector according to the internet
-                    // As viewed from the front of the phone:
-                    // V[0] (X+ is toward the left side)
-                    // V[1] (Y+ is toward the bottom)
-                    // V[2] (Z+ points into the face of the phone)
-                    // TODO: Tag 0x1A looks like an ID of some kind. Photo ID?,
-                    // Device ID?.
+                    str_cat_tiff_ifd (&out, ifd, print_hex_values, print_offsets, apple_makernote_tag_name);
+
+                    // Some values are binary property lists (AEMatrix, RunTime).
+                    bool has_bplist = false;
+                    for (uint32_t entry_idx = 0; !rdr->error && entry_idx < ifd->entries_len; entry_idx++) {
+                        struct tiff_entry_t *entry = &ifd->entries[entry_idx];
+                        if (entry->type == TIFF_TYPE_UNDEFINED && is_bplist (entry->value, entry->count)) {
+                            has_bplist = true;
+                            string_t error_msg = {0};
+                            struct bplist_value_t *plist = bplist_decode (&pool, entry->value, entry->count, &error_msg);
+
+                            char *tag_name = apple_makernote_tag_name (entry->tag);
+                            if (tag_name != NULL) {
+                                str_cat_printf (&out, "   %s (bplist) = ", tag_name);
+                            } else {
+                                str_cat_printf (&out, "   0x%X (bplist) = ", entry->tag);
+                            }
+
+                            if (plist != NULL) {
+                                str_cat_bplist_value (&out, plist);
+                                str_cat_c (&out, "\n");
+                            } else {
+                                str_cat_printf (&out, ECMA_RED("error:") " %s\n", str_data(&error_msg));
+                            }
+                            str_free (&error_msg);
+                        }
+                    }
+
+                    if (has_bplist) {
+                        str_cat_c (&out, "\n");
+                    }
 
                 } else {
                     // TODO: Is this really the version?
@@ -2420,7 +2946,7 @@ void print_exif_as_tiff_data_with_ir (struct jpg_reader_t *rdr)
                 }
 
             } else if (strcmp (name, "Nikon") == 0) {
-                uint8_t *magic = jpg_file_reader_read_bytes (rdr, 4);
+                uint8_t *magic = jpg_read_bytes (rdr, 4);
                 if (memcmp (magic, "\x02\x11\0\0", 4) == 0) {
                     enum jpg_reader_endianess_t endianess = BYTE_READER_BIG_ENDIAN;
                     struct tiff_ifd_t *tiff = read_tiff_6 (rdr, &pool, &endianess);
@@ -2478,7 +3004,7 @@ void print_tiff_value_data (struct jpg_reader_t *rdr,
 // of the next IFD
 uint64_t print_tiff_ifd (struct jpg_reader_t *rdr,
                          uint64_t tiff_data_start, bool print_hex_values, bool print_offsets,
-                         struct int_to_str_tree_t *local_tag_names)
+                         tiff_tag_name_lookup_t *local_tag_name)
 {
     assert (rdr != NULL);
 
@@ -2489,9 +3015,9 @@ uint64_t print_tiff_ifd (struct jpg_reader_t *rdr,
         printf ("  "); // Indentation
 
         uint64_t tag = jpg_reader_read_value (rdr, 2);
-        char* tag_name = int_to_str_get (&g_tiff_tag_names.tiff_tag_names, tag);
-        if (tag_name == NULL && local_tag_names != NULL) {
-            tag_name = int_to_str_get (local_tag_names, tag);
+        char* tag_name = tiff_tag_name (tag);
+        if (tag_name == NULL && local_tag_name != NULL) {
+            tag_name = local_tag_name (tag);
         }
 
         if (tag_name != NULL) {
@@ -2578,8 +3104,6 @@ uint64_t print_tiff_ifd (struct jpg_reader_t *rdr,
 
 void print_exif_as_tiff_data_no_ir (struct jpg_reader_t *rdr)
 {
-    tiff_data_init ();
-
     uint64_t tiff_data_start = rdr->offset;
     enum jpg_reader_endianess_t original_endianess = rdr->endianess;
 
@@ -2628,7 +3152,7 @@ void print_exif_as_tiff_data_no_ir (struct jpg_reader_t *rdr)
         }
         uint64_t current_offset = rdr->offset;
         jpg_jump_to (rdr, tiff_data_start + rdr->exif_ifd_offset);
-        print_tiff_ifd (rdr, tiff_data_start, print_hex_values, print_offsets, &g_tiff_tag_names.exif_ifd_tag_names);
+        print_tiff_ifd (rdr, tiff_data_start, print_hex_values, print_offsets, exif_ifd_tag_name);
         jpg_jump_to (rdr, current_offset);
     }
 
@@ -2641,7 +3165,7 @@ void print_exif_as_tiff_data_no_ir (struct jpg_reader_t *rdr)
         }
         uint64_t current_offset = rdr->offset;
         jpg_jump_to (rdr, tiff_data_start + rdr->gps_ifd_offset);
-        print_tiff_ifd (rdr, tiff_data_start, print_hex_values, print_offsets, &g_tiff_tag_names.gps_ifd_tag_names);
+        print_tiff_ifd (rdr, tiff_data_start, print_hex_values, print_offsets, gps_ifd_tag_name);
         jpg_jump_to (rdr, current_offset);
     }
 
@@ -2686,7 +3210,7 @@ void print_exif (char *path)
 
     struct jpg_reader_t _rdr = {0};
     struct jpg_reader_t *rdr = &_rdr;
-    jpg_reader_init (rdr, path, true);
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
 
     if (success) {
         jpg_expect_marker (rdr, JPG_MARKER_SOI);
@@ -2755,3 +3279,754 @@ void print_exif (char *path)
         jpg_reader_destroy (rdr);
     }
 }
+
+//////////////////////////////
+// Lazy TIFF views
+//
+// For callers that only want a few tags, tiff_read_ifd() does too much work,
+// it reads and converts every value of every entry. These views instead work
+// over TIFF data that is already in memory, entries and values are decoded
+// from it only when asked for, and nothing is allocated. Every offset is
+// checked against the size of the TIFF data, accessors return false instead
+// of reading outside of it.
+
+struct tiff_view_t {
+    uint8_t *data;
+    uint64_t data_len;
+    enum jpg_reader_endianess_t endianess;
+
+    uint32_t ifd0_offset;
+};
+
+struct tiff_ifd_view_t {
+    struct tiff_view_t *tiff;
+
+    uint8_t *entries;
+    uint16_t entries_len;
+};
+
+struct tiff_entry_view_t {
+    uint16_t tag;
+    enum tiff_type_t type;
+    uint32_t count;
+
+    // Points into the TIFF data, either into the entry itself or to the out
+    // of line value.
+    uint8_t *value;
+};
+
+static inline
+uint16_t tiff_view_u16 (struct tiff_view_t *tiff, uint8_t *bytes)
+{
+    return byte_array_to_value_u16 (bytes, 2, tiff->endianess);
+}
+
+static inline
+uint32_t tiff_view_u32 (struct tiff_view_t *tiff, uint8_t *bytes)
+{
+    return byte_array_to_value_u32 (bytes, 4, tiff->endianess);
+}
+
+bool tiff_view_init (struct tiff_view_t *tiff, uint8_t *data, uint64_t data_len)
+{
+    *tiff = ZERO_INIT (struct tiff_view_t);
+    tiff->data = data;
+    tiff->data_len = data_len;
+
+    if (data_len < 8) {
+        return false;
+    }
+
+    if (memcmp (data, "II", 2) == 0) {
+        tiff->endianess = BYTE_READER_LITTLE_ENDIAN;
+    } else if (memcmp (data, "MM", 2) == 0) {
+        tiff->endianess = BYTE_READER_BIG_ENDIAN;
+    } else {
+        return false;
+    }
+
+    if (tiff_view_u16 (tiff, data + 2) != 42) {
+        return false;
+    }
+
+    tiff->ifd0_offset = tiff_view_u32 (tiff, data + 4);
+    return true;
+}
+
+bool tiff_view_ifd (struct tiff_view_t *tiff, uint64_t offset, struct tiff_ifd_view_t *ifd)
+{
+    *ifd = ZERO_INIT (struct tiff_ifd_view_t);
+    if (offset == 0 || offset + 2 > tiff->data_len) {
+        return false;
+    }
+
+    uint16_t entries_len = tiff_view_u16 (tiff, tiff->data + offset);
+    if (offset + 2 + 12*entries_len + 4/*next IFD offset*/ > tiff->data_len) {
+        return false;
+    }
+
+    ifd->tiff = tiff;
+    ifd->entries = tiff->data + offset + 2;
+    ifd->entries_len = entries_len;
+    return true;
+}
+
+uint32_t tiff_ifd_view_next_offset (struct tiff_ifd_view_t *ifd)
+{
+    return tiff_view_u32 (ifd->tiff, ifd->entries + 12*ifd->entries_len);
+}
+
+bool tiff_ifd_view_entry (struct tiff_ifd_view_t *ifd, int idx, struct tiff_entry_view_t *entry)
+{
+    struct tiff_view_t *tiff = ifd->tiff;
+    uint8_t *entry_data = ifd->entries + 12*idx;
+
+    *entry = ZERO_INIT (struct tiff_entry_view_t);
+    entry->tag = tiff_view_u16 (tiff, entry_data);
+    entry->type = tiff_view_u16 (tiff, entry_data + 2);
+    entry->count = tiff_view_u32 (tiff, entry_data + 4);
+
+    if (entry->type == TIFF_TYPE_NONE || entry->type >= ARRAY_SIZE(tiff_type_sizes)) {
+        entry->type = TIFF_TYPE_NONE;
+        return false;
+    }
+
+    uint64_t byte_count = (uint64_t)tiff_type_sizes[entry->type]*entry->count;
+    if (byte_count <= 4) {
+        entry->value = entry_data + 8;
+
+    } else {
+        uint64_t value_offset = tiff_view_u32 (tiff, entry_data + 8);
+        if (value_offset + byte_count > tiff->data_len) {
+            return false;
+        }
+        entry->value = tiff->data + value_offset;
+    }
+
+    return true;
+}
+
+bool tiff_ifd_view_find (struct tiff_ifd_view_t *ifd, uint16_t tag, struct tiff_entry_view_t *entry)
+{
+    for (int i=0; i<ifd->entries_len; i++) {
+        uint16_t entry_tag = tiff_view_u16 (ifd->tiff, ifd->entries + 12*i);
+        if (entry_tag == tag) {
+            return tiff_ifd_view_entry (ifd, i, entry);
+        }
+    }
+
+    return false;
+}
+
+// Reads element idx of a BYTE, SHORT or LONG value.
+bool tiff_entry_view_uint (struct tiff_view_t *tiff, struct tiff_entry_view_t *entry, uint32_t idx, uint32_t *value)
+{
+    if (idx >= entry->count) {
+        return false;
+    }
+
+    bool success = true;
+    if (entry->type == TIFF_TYPE_BYTE) {
+        *value = entry->value[idx];
+    } else if (entry->type == TIFF_TYPE_SHORT) {
+        *value = tiff_view_u16 (tiff, entry->value + 2*idx);
+    } else if (entry->type == TIFF_TYPE_LONG) {
+        *value = tiff_view_u32 (tiff, entry->value + 4*idx);
+    } else {
+        success = false;
+    }
+
+    return success;
+}
+
+bool tiff_entry_view_rational (struct tiff_view_t *tiff, struct tiff_entry_view_t *entry, uint32_t idx,
+                               struct tiff_type_RATIONAL_t *value)
+{
+    if (entry->type != TIFF_TYPE_RATIONAL || idx >= entry->count) {
+        return false;
+    }
+
+    value->num = tiff_view_u32 (tiff, entry->value + 8*idx);
+    value->den = tiff_view_u32 (tiff, entry->value + 8*idx + 4);
+    return true;
+}
+
+// Returns a pointer to the string inside the TIFF data, which may not be NULL
+// terminated. Its length is returned in len.
+char* tiff_entry_view_ascii (struct tiff_entry_view_t *entry, uint32_t *len)
+{
+    if (entry->type != TIFF_TYPE_ASCII) {
+        return NULL;
+    }
+
+    *len = strnlen ((char*)entry->value, entry->count);
+    return (char*)entry->value;
+}
+
+// Follows a tag that points to another IFD, like TIFF_TAG_ExifIFD.
+bool tiff_ifd_view_sub_ifd (struct tiff_ifd_view_t *ifd, uint16_t tag, struct tiff_ifd_view_t *sub_ifd)
+{
+    struct tiff_entry_view_t entry;
+    uint32_t offset;
+    return tiff_ifd_view_find (ifd, tag, &entry) &&
+        entry.count == 1 &&
+        tiff_entry_view_uint (ifd->tiff, &entry, 0, &offset) &&
+        tiff_view_ifd (ifd->tiff, offset, sub_ifd);
+}
+
+// Makes the rest of a marker segment available in memory and returns a view
+// of the TIFF data in it. The reader must be right after the "Exif\0\0"
+// identifier of an APP1 segment, and isn't advanced.
+bool jpg_reader_tiff_view (struct jpg_reader_t *rdr, uint64_t marker_end, struct tiff_view_t *tiff)
+{
+    bool success = false;
+    if (marker_end > rdr->offset) {
+        uint64_t tiff_data_len = marker_end - rdr->offset;
+        if (jpg_reader_ensure (rdr, tiff_data_len)) {
+            success = tiff_view_init (tiff, rdr->pos, tiff_data_len);
+        }
+    }
+
+    return success;
+}
+
+//////////////////////////////
+// Header probing
+//
+// Reads only the marker segments before the first SOS, this is enough to know
+// the image dimensions and layout without touching image data. With the
+// chunked reader this is usually a single read per file.
+
+struct jpg_probe_component_t {
+    uint8_t ci;
+    uint8_t hi;
+    uint8_t vi;
+    uint8_t tqi;
+};
+
+struct jpg_probe_t {
+    enum marker_t sof;
+    uint8_t precision;
+    uint16_t width;
+    uint16_t height;
+
+    uint8_t nf;
+    struct jpg_probe_component_t components[4];
+
+    // Zero if there was no DRI marker segment.
+    uint16_t restart_interval;
+
+    // Hash of each quantization table's values in zig-zag order, a bit of
+    // dqt_mask is set for each Tq that was defined. Images that were encoded
+    // by the same software at the same quality usually share these.
+    uint8_t dqt_mask;
+    uint64_t dqt_hash[4];
+
+    bool is_jfif;
+    bool is_exif;
+
+    // Exif orientation tag in IFD0. Zero if it was not present.
+    uint16_t orientation;
+};
+
+void jpg_probe_exif (struct tiff_view_t *tiff, struct jpg_probe_t *probe)
+{
+    struct tiff_ifd_view_t ifd0;
+    struct tiff_entry_view_t orientation;
+    uint32_t value;
+    if (tiff_view_ifd (tiff, tiff->ifd0_offset, &ifd0) &&
+        tiff_ifd_view_find (&ifd0, TIFF_TAG_Orientation, &orientation) &&
+        tiff_entry_view_uint (tiff, &orientation, 0, &value)) {
+        probe->orientation = value;
+    }
+}
+
+// Problems with the Exif data don't make the probe fail, they are returned in
+// warning_msg and the orientation is left as zero.
+bool jpg_probe (char *path, struct jpg_probe_t *probe, string_t *error_msg, string_t *warning_msg)
+{
+    trace_count (TRACE_COUNTER_FILES_PROBED, 1);
+
+    *probe = ZERO_INIT (struct jpg_probe_t);
+
+    struct jpg_reader_t _rdr = {0};
+    struct jpg_reader_t *rdr = &_rdr;
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
+
+    jpg_expect_marker (rdr, JPG_MARKER_SOI);
+
+    enum marker_t marker = jpg_read_marker (rdr);
+    while (!rdr->error && marker != JPG_MARKER_SOS) {
+        if (marker == JPG_MARKER_EOI) {
+            jpg_error (rdr, "Found EOI before any scan.");
+            break;
+        }
+
+        uint16_t marker_segment_length = jpg_read_marker_segment_length (rdr);
+        if (!rdr->error && marker_segment_length < 2) {
+            jpg_error (rdr, "Invalid marker segment length %u.", marker_segment_length);
+            break;
+        }
+        uint64_t marker_end = rdr->offset - 2/*bytes of read segment length*/ + marker_segment_length;
+
+        if (marker == JPG_MARKER_APP0 && !probe->is_jfif) {
+            uint8_t *identifier = jpg_read_bytes (rdr, MIN(5, marker_segment_length - 2));
+            probe->is_jfif = !rdr->error && marker_segment_length >= 7 && memcmp (identifier, "JFIF\0", 5) == 0;
+
+        } else if (marker == JPG_MARKER_APP1 && !probe->is_exif) {
+            uint8_t *identifier = jpg_read_bytes (rdr, MIN(6, marker_segment_length - 2));
+            struct tiff_view_t tiff;
+            if (!rdr->error && marker_segment_length >= 8 && memcmp (identifier, "Exif\0\0", 6) == 0) {
+                probe->is_exif = true;
+                if (marker_end > rdr->file_size) {
+                    jpg_warn (rdr, "Exif segment extends past the end of the file.");
+
+                } else if (jpg_reader_tiff_view (rdr, marker_end, &tiff)) {
+                    jpg_probe_exif (&tiff, probe);
+
+                } else if (!rdr->error) {
+                    jpg_warn (rdr, "Invalid Exif data, orientation is unknown.");
+                }
+            }
+
+        } else if (marker == JPG_MARKER_DQT) {
+            while (!rdr->error && rdr->offset < marker_end) {
+                uint8_t pq_tq = jpg_reader_read_value_u8 (rdr);
+                uint8_t pq = pq_tq >> 4;
+                uint8_t tq = pq_tq & 0xF;
+                if (pq > 1 || tq > 3) {
+                    jpg_error (rdr, "Invalid DQT table, Pq: %d Tq: %d.", pq, tq);
+                    break;
+                }
+
+                uint16_t q[64];
+                for (int k=0; k<64; k++) {
+                    q[k] = pq == 0 ? jpg_reader_read_value_u8 (rdr) : jpg_reader_read_value_u16 (rdr);
+                }
+
+                probe->dqt_mask |= 1 << tq;
+                probe->dqt_hash[tq] = hash_64 (q, sizeof(q));
+            }
+
+        } else if (marker == JPG_MARKER_DRI) {
+            probe->restart_interval = jpg_reader_read_value_u16 (rdr);
+
+        } else if (JPG_MARKER_SOF(marker)) {
+            probe->sof = marker;
+            probe->precision = jpg_reader_read_value_u8 (rdr);
+            probe->height = jpg_reader_read_value_u16 (rdr);
+            probe->width = jpg_reader_read_value_u16 (rdr);
+            probe->nf = jpg_reader_read_value_u8 (rdr);
+
+            for (int i=0; i<probe->nf; i++) {
+                uint8_t ci = jpg_reader_read_value_u8 (rdr);
+                uint8_t hi_vi = jpg_reader_read_value_u8 (rdr);
+                uint8_t tqi = jpg_reader_read_value_u8 (rdr);
+
+                if (i < ARRAY_SIZE(probe->components)) {
+                    struct jpg_probe_component_t *component = &probe->components[i];
+                    component->ci = ci;
+                    component->hi = hi_vi >> 4;
+                    component->vi = hi_vi & 0xF;
+                    component->tqi = tqi;
+                }
+            }
+        }
+
+        // :resync_to_marker
+        jpg_jump_to (rdr, marker_end);
+        marker = jpg_read_marker (rdr);
+    }
+
+    if (!rdr->error && probe->sof == 0) {
+        jpg_error (rdr, "No frame header found before the first scan.");
+    }
+
+    bool success = !rdr->error;
+    if (!success && error_msg != NULL) {
+        str_set (error_msg, str_data(&rdr->error_msg));
+    }
+
+    if (warning_msg != NULL) {
+        str_set (warning_msg, str_data(&rdr->warning_msg));
+    }
+
+    jpg_reader_destroy (rdr);
+    return success;
+}
+
+// Prints a tab separated line with the probe's results, the columns are:
+//
+//   path, width, height, frame type, sampling factors of each component,
+//   restart interval, orientation, quantization table fingerprints.
+void print_jpg_probe (char *path, struct jpg_probe_t *probe)
+{
+    string_t str = {0};
+    str_cat_printf (&str, "%s\t%u\t%u\tSOF%u\t", path, probe->width, probe->height,
+                    probe->sof & 0xF);
+
+    for (int i=0; i<MIN(probe->nf, ARRAY_SIZE(probe->components)); i++) {
+        struct jpg_probe_component_t *component = &probe->components[i];
+        str_cat_printf (&str, "%ux%u", component->hi, component->vi);
+        if (i < probe->nf - 1) str_cat_c (&str, ",");
+    }
+
+    str_cat_printf (&str, "\t%u\t%u\t", probe->restart_interval, probe->orientation);
+
+    bool first = true;
+    for (int tq=0; tq<4; tq++) {
+        if (probe->dqt_mask & (1 << tq)) {
+            if (!first) str_cat_c (&str, ",");
+            str_cat_printf (&str, "%016lx", probe->dqt_hash[tq]);
+            first = false;
+        }
+    }
+
+    printf ("%s\n", str_data(&str));
+    str_free (&str);
+}
+
+//////////////////////////////
+// Exif field extraction
+//
+// Extracts a fixed set of commonly queried Exif fields, without printing
+// anything. This is used to batch process files, all memory is allocated from
+// the passed pool so it must not be shared between threads.
+
+struct exif_fields_t {
+    bool is_exif;
+
+    // NULL if not present.
+    char *make;
+    char *model;
+
+    // Taken from DateTimeOriginal, falls back to IFD0's DateTime. Format is
+    // "YYYY:MM:DD HH:MM:SS", NULL if not present.
+    char *date_time;
+
+    // Zero if not present.
+    uint16_t orientation;
+
+    bool has_gps;
+    double latitude;
+    double longitude;
+
+    // From the MakerNote of iOS devices, NULL if not present.
+    char *apple_image_unique_id;
+    char *apple_content_identifier;
+};
+
+char* exif_entry_string (mem_pool_t *pool, struct tiff_entry_view_t *entry)
+{
+    uint32_t len;
+    char *str = tiff_entry_view_ascii (entry, &len);
+    return str != NULL ? pom_strndup (pool, str, len) : NULL;
+}
+
+// Converts the 3 rationals for degrees, minutes and seconds used by GPS
+// coordinates into decimal degrees.
+bool exif_gps_coordinate (struct tiff_ifd_view_t *gps_ifd, uint16_t tag, double *coordinate)
+{
+    struct tiff_entry_view_t entry;
+    if (!tiff_ifd_view_find (gps_ifd, tag, &entry) || entry.count != 3) {
+        return false;
+    }
+
+    double value = 0;
+    double scale = 1;
+    for (int i=0; i<3; i++) {
+        struct tiff_type_RATIONAL_t r;
+        if (!tiff_entry_view_rational (gps_ifd->tiff, &entry, i, &r) || r.den == 0) {
+            return false;
+        }
+        value += ((double)r.num/r.den)/scale;
+        scale *= 60;
+    }
+
+    *coordinate = value;
+    return true;
+}
+
+bool exif_gps_ref_is (struct tiff_ifd_view_t *gps_ifd, uint16_t tag, char c)
+{
+    struct tiff_entry_view_t entry;
+    uint32_t len;
+    char *ref;
+    return tiff_ifd_view_find (gps_ifd, tag, &entry) &&
+        (ref = tiff_entry_view_ascii (&entry, &len)) != NULL && len > 0 && ref[0] == c;
+}
+
+// MakerNotes written by iOS devices start with "Apple iOS\0", a 2 byte version
+// and a byte order mark, followed by an IFD at offset 14. Offsets inside of it
+// are relative to the start of the MakerNote, so it's viewed as its own TIFF
+// data.
+bool apple_makernote_view (struct tiff_entry_view_t *maker_note, struct tiff_view_t *mn_tiff, struct tiff_ifd_view_t *mn_ifd)
+{
+    if (maker_note->type != TIFF_TYPE_UNDEFINED || maker_note->count < 14 ||
+        memcmp (maker_note->value, "Apple iOS\0", 10) != 0) {
+        return false;
+    }
+
+    *mn_tiff = ZERO_INIT (struct tiff_view_t);
+    mn_tiff->data = maker_note->value;
+    mn_tiff->data_len = maker_note->count;
+
+    if (memcmp (maker_note->value + 12, "MM", 2) == 0) {
+        mn_tiff->endianess = BYTE_READER_BIG_ENDIAN;
+    } else if (memcmp (maker_note->value + 12, "II", 2) == 0) {
+        mn_tiff->endianess = BYTE_READER_LITTLE_ENDIAN;
+    } else {
+        return false;
+    }
+
+    mn_tiff->ifd0_offset = 14;
+    return tiff_view_u16 (mn_tiff, maker_note->value + 10) == 1 &&
+        tiff_view_ifd (mn_tiff, mn_tiff->ifd0_offset, mn_ifd);
+}
+
+void exif_fields_read_tiff (struct tiff_view_t *tiff, mem_pool_t *pool, struct exif_fields_t *fields)
+{
+    struct tiff_ifd_view_t ifd0;
+    if (!tiff_view_ifd (tiff, tiff->ifd0_offset, &ifd0)) {
+        return;
+    }
+
+    fields->is_exif = true;
+
+    struct tiff_entry_view_t entry;
+    if (tiff_ifd_view_find (&ifd0, TIFF_TAG_Make, &entry)) {
+        fields->make = exif_entry_string (pool, &entry);
+    }
+
+    if (tiff_ifd_view_find (&ifd0, TIFF_TAG_Model, &entry)) {
+        fields->model = exif_entry_string (pool, &entry);
+    }
+
+    struct tiff_ifd_view_t exif_ifd;
+    bool has_exif_ifd = tiff_ifd_view_sub_ifd (&ifd0, TIFF_TAG_ExifIFD, &exif_ifd);
+    if (has_exif_ifd && tiff_ifd_view_find (&exif_ifd, EXIF_TAG_DateTimeOriginal, &entry)) {
+        fields->date_time = exif_entry_string (pool, &entry);
+
+    } else if (tiff_ifd_view_find (&ifd0, TIFF_TAG_DateTime, &entry)) {
+        fields->date_time = exif_entry_string (pool, &entry);
+    }
+
+    struct tiff_view_t mn_tiff;
+    struct tiff_ifd_view_t mn_ifd;
+    if (has_exif_ifd && tiff_ifd_view_find (&exif_ifd, EXIF_TAG_MakerNote, &entry) &&
+        apple_makernote_view (&entry, &mn_tiff, &mn_ifd)) {
+        if (tiff_ifd_view_find (&mn_ifd, APPLE_TAG_ImageUniqueID, &entry)) {
+            fields->apple_image_unique_id = exif_entry_string (pool, &entry);
+        }
+
+        if (tiff_ifd_view_find (&mn_ifd, APPLE_TAG_ContentIdentifier, &entry)) {
+            fields->apple_content_identifier = exif_entry_string (pool, &entry);
+        }
+    }
+
+    uint32_t orientation;
+    if (tiff_ifd_view_find (&ifd0, TIFF_TAG_Orientation, &entry) &&
+        tiff_entry_view_uint (tiff, &entry, 0, &orientation)) {
+        fields->orientation = orientation;
+    }
+
+    struct tiff_ifd_view_t gps_ifd;
+    if (tiff_ifd_view_sub_ifd (&ifd0, TIFF_TAG_GPSIFD, &gps_ifd)) {
+        fields->has_gps =
+            exif_gps_coordinate (&gps_ifd, EXIF_TAG_GPSLatitude, &fields->latitude) &&
+            exif_gps_coordinate (&gps_ifd, EXIF_TAG_GPSLongitude, &fields->longitude);
+
+        if (exif_gps_ref_is (&gps_ifd, EXIF_TAG_GPSLatitudeRef, 'S')) {
+            fields->latitude = -fields->latitude;
+        }
+
+        if (exif_gps_ref_is (&gps_ifd, EXIF_TAG_GPSLongitudeRef, 'W')) {
+            fields->longitude = -fields->longitude;
+        }
+    }
+}
+
+bool jpg_read_exif_fields (char *path, mem_pool_t *pool, struct exif_fields_t *fields, string_t *error_msg)
+{
+    trace_count (TRACE_COUNTER_FILES_EXIF_READ, 1);
+
+    *fields = ZERO_INIT (struct exif_fields_t);
+
+    struct jpg_reader_t _rdr = {0};
+    struct jpg_reader_t *rdr = &_rdr;
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
+
+    jpg_expect_marker (rdr, JPG_MARKER_SOI);
+
+    // Exif data should be in an APP1 segment right after SOI, but like
+    // print_exif() we accept it anywhere before the first scan.
+    enum marker_t marker = jpg_read_marker (rdr);
+    while (!rdr->error && is_tables_misc_marker (marker)) {
+        uint16_t marker_segment_length = jpg_read_marker_segment_length (rdr);
+        uint64_t marker_end = rdr->offset - 2/*bytes of read segment length*/ + marker_segment_length;
+
+        if (marker == JPG_MARKER_APP1 && marker_segment_length >= 8) {
+            uint8_t *identifier = jpg_read_bytes (rdr, 6);
+            if (!rdr->error && memcmp (identifier, "Exif\0\0", 6) == 0) {
+                struct tiff_view_t tiff;
+                if (jpg_reader_tiff_view (rdr, marker_end, &tiff)) {
+                    exif_fields_read_tiff (&tiff, pool, fields);
+                }
+                break;
+            }
+        }
+
+        // :resync_to_marker
+        jpg_jump_to (rdr, marker_end);
+        marker = jpg_read_marker (rdr);
+    }
+
+    bool success = !rdr->error;
+    if (!success && error_msg != NULL) {
+        str_set (error_msg, str_data(&rdr->error_msg));
+    }
+
+    jpg_reader_destroy (rdr);
+    return success;
+}
+
+//////////////////////////////
+// Image stream fingerprint
+//
+// A common kind of duplicate is the same JPEG with rewritten metadata, like a
+// fixed date or stripped GPS data. Its frame headers, tables and entropy coded
+// data are byte identical, so hashing everything except APPn and COM segments
+// detects it without decoding anything. The hash of the full file is computed
+// in the same pass, so both come from reading each byte once.
+
+struct jpg_fingerprint_t {
+    // Same value as hash_64() over the full file.
+    uint64_t file_hash;
+
+    // Hash of all marker segments and entropy coded data from SOI to EOI,
+    // except APPn and COM segments.
+    uint64_t image_hash;
+};
+
+struct jpg_fingerprint_ctx_t {
+    meow_state file_state;
+    meow_state image_state;
+};
+
+// Consumes length bytes from the reader adding them to the file hash, and to
+// the image hash if is_image is true.
+void jpg_fingerprint_absorb (struct jpg_reader_t *rdr, struct jpg_fingerprint_ctx_t *ctx,
+                             uint64_t length, bool is_image)
+{
+    while (length > 0 && jpg_reader_ensure (rdr, 1)) {
+        uint64_t available = MIN (length, (uint64_t)(rdr->end - rdr->pos));
+        MeowAbsorb (&ctx->file_state, available, rdr->pos);
+        if (is_image) {
+            MeowAbsorb (&ctx->image_state, available, rdr->pos);
+        }
+
+        jpg_reader_consume (rdr, available);
+        length -= available;
+    }
+}
+
+// Absorbs entropy coded data into both hashes, RSTn markers included. The
+// reader is left at the marker that ends the scan.
+void jpg_fingerprint_absorb_ecs (struct jpg_reader_t *rdr, struct jpg_fingerprint_ctx_t *ctx)
+{
+    while (jpg_reader_ensure (rdr, 2)) {
+        uint8_t *found = jpg_scan_for_marker (rdr->pos, rdr->end);
+        if (found != NULL) {
+            enum marker_t marker = 0xFF00 | found[1];
+            if (JPG_MARKER_RST(marker)) {
+                jpg_fingerprint_absorb (rdr, ctx, found + 2 - rdr->pos, true);
+            } else {
+                jpg_fingerprint_absorb (rdr, ctx, found - rdr->pos, true);
+                break;
+            }
+
+        } else {
+            // Keep the last byte, it may be the first half of a marker.
+            jpg_fingerprint_absorb (rdr, ctx, rdr->end - rdr->pos - 1, true);
+        }
+    }
+}
+
+bool jpg_fingerprint (char *path, struct jpg_fingerprint_t *fingerprint, string_t *error_msg)
+{
+    trace_count (TRACE_COUNTER_FILES_FINGERPRINTED, 1);
+
+    *fingerprint = ZERO_INIT (struct jpg_fingerprint_t);
+
+    struct jpg_reader_t _rdr = {0};
+    struct jpg_reader_t *rdr = &_rdr;
+    jpg_reader_init (rdr, path, JPG_READER_CHUNKED);
+
+    struct jpg_fingerprint_ctx_t ctx;
+    MeowBegin (&ctx.file_state, MeowDefaultSeed);
+    MeowBegin (&ctx.image_state, MeowDefaultSeed);
+
+    bool is_first = true;
+    enum marker_t marker = JPG_MARKER_ERR;
+    while (!rdr->error && marker != JPG_MARKER_EOI && jpg_reader_ensure (rdr, 2)) {
+        if (rdr->pos[0] != 0xFF) {
+            jpg_error (rdr, "Expected marker, got 0x%X.", rdr->pos[0]);
+            break;
+        }
+
+        // Fill bytes may precede any marker.
+        if (rdr->pos[1] == 0xFF) {
+            jpg_fingerprint_absorb (rdr, &ctx, 1, false);
+            continue;
+        }
+
+        marker = 0xFF00 | rdr->pos[1];
+        if (is_first && marker != JPG_MARKER_SOI) {
+            jpg_error (rdr, "Expected SOI marker, got '%s'.", marker_name(marker));
+            break;
+        }
+        is_first = false;
+
+        if (marker == JPG_MARKER_SOI || marker == JPG_MARKER_EOI || marker == JPG_MARKER_TEM) {
+            jpg_fingerprint_absorb (rdr, &ctx, 2, true);
+
+        } else if (jpg_reader_ensure (rdr, 4)) {
+            uint16_t marker_segment_length = byte_array_to_value_u16 (rdr->pos + 2, 2, BYTE_READER_BIG_ENDIAN);
+            if (marker_segment_length < 2) {
+                jpg_error (rdr, "Invalid segment length %u for marker '%s'.", marker_segment_length, marker_name(marker));
+                break;
+            }
+
+            bool is_image = !JPG_MARKER_APP(marker) && marker != JPG_MARKER_COM;
+            jpg_fingerprint_absorb (rdr, &ctx, 2 + marker_segment_length, is_image);
+
+            if (marker == JPG_MARKER_SOS) {
+                jpg_fingerprint_absorb_ecs (rdr, &ctx);
+            }
+        }
+    }
+
+    if (!rdr->error && marker != JPG_MARKER_EOI) {
+        jpg_error (rdr, "Reached end of file before EOI.");
+    }
+
+    // Data after EOI is only part of the file hash.
+    if (!rdr->error) {
+        jpg_fingerprint_absorb (rdr, &ctx, rdr->file_size - rdr->offset, false);
+    }
+
+    bool success = !rdr->error;
+    if (success) {
+        meow_u128 file_hash = MeowEnd (&ctx.file_state, NULL);
+        fingerprint->file_hash = MeowU64From (file_hash, 0);
+
+        meow_u128 image_hash = MeowEnd (&ctx.image_state, NULL);
+        fingerprint->image_hash = MeowU64From (image_hash, 0);
+
+    } else if (error_msg != NULL) {
+        str_set (error_msg, str_data(&rdr->error_msg));
+    }
+
+    jpg_reader_destroy (rdr);
+    return success;
+}
@@ -24,7 +24,12 @@ def default ():
     call_user_function(target)
 
 def scrapbook ():
-    ex(f'gcc {C_FLAGS} -o bin/scrapbook scrapbook.c -mavx -maes -lm')
+    ex(f'gcc {C_FLAGS} -o bin/scrapbook scrapbook.c -mavx -maes -lm -pthread')
+
+# Benchmark of the duplicate detection pipeline over a generated library, use
+# it with --mode release. See bench.c for its options.
+def bench ():
+    ex(f'gcc {C_FLAGS} -o bin/bench bench.c -mavx -maes -lm -pthread')
 
 class XdgViewer (ImageShow.UnixViewer):
     def get_command_ex(self, file, **options):
@@ -166,9 +171,12 @@ def perform_outline_crop ():
         print (f'{output_path}')
 
 def get_image_size(path):
-    jpg_x = ex(f"exiv2 pr '{path}' | awk -F: '/Image size/ {{print $2}}' | cut -dx -f1 | tr -d ' '", ret_stdout=True, echo=False)
-    jpg_y = ex(f"exiv2 pr '{path}' | awk -F: '/Image size/ {{print $2}}' | cut -dx -f2 | tr -d ' '", ret_stdout=True, echo=False)
+    # Columns of --probe's output are path, width, height, ...
+    probe = ex(f"./bin/scrapbook --probe '{path}'", ret_stdout=True, echo=False).split('\t')
+    if len(probe) < 3:
+        return ('', '')
 
+    jpg_x, jpg_y = probe[1], probe[2]
     return (jpg_x, jpg_y)
 
 
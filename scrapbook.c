@@ -1,6 +1,10 @@
 /*
  * Copyright (C) 2020 Santiago León O.
  */
+// These need to be defined before any system header is included.
+#define _GNU_SOURCE // Used to enable strcasestr()
+#define _XOPEN_SOURCE 700 // Required for strptime()
+
 #ifdef __GNUC__
 #define NOT_USED __attribute__ ((unused))
 #else
@@ -12,15 +16,40 @@
 // We don't use this but it causes a compiler warning.
 static void MeowExpandSeed(meow_umm InputLen, void *Input, meow_u8 *SeedResult) NOT_USED;
 
-#define _GNU_SOURCE // Used to enable strcasestr()
-#define _XOPEN_SOURCE 700 // Required for strptime()
+#include <pthread.h> // Before common.h, it enables templ_sort_parallel()
 #include "common.h"
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <immintrin.h>
+#include <time.h>
 #include "concatenator.c"
 #include "binary_tree.c"
 #include "scanner.c"
 #include "cli_parser.c"
+#include "trace.c"
+
+uint64_t hash_64 (void *ptr, size_t size)
+{
+    meow_u128 hash = MeowHash(MeowDefaultSeed, size, ptr);
+    return MeowU64From(hash, 0);
+}
+
+// Same value as hash_64(), but safe for buffers that aren't padded.
+// MeowHash() reads whole 16 byte blocks past the end of the input, the
+// streaming API copies the tail of the input into its own buffer instead.
+uint64_t hash_64_unpadded (void *ptr, size_t size)
+{
+    meow_state state;
+    MeowBegin (&state, MeowDefaultSeed);
+    MeowAbsorb (&state, size, ptr);
+    return MeowU64From (MeowEnd (&state, NULL), 0);
+}
 
+#include "bplist.c"
 #include "jpg_utils.c"
+#include "heif_utils.c"
+#include "cdc.c"
 
 // TODO: Move these into common.h? they seem quite useful.
 void cli_progress_bar (float val, float total)
@@ -52,17 +81,96 @@ void cli_progress_bar (float val, float total)
     }
 }
 
-// TODO: Make these prinf-like
 // :make_print_like
-void cli_status (char *message, float val)
+void cli_status_end ()
+{
+    fprintf (stderr, "\r\e[KComplete.\n");
+}
+
+// Progress of a stage that processes files. Counters are updated atomically so
+// worker threads can feed it, but the status line is only redrawn every
+// PROGRESS_REFRESH_NS, by whichever thread notices the time has passed. This
+// keeps us from making a write() call for every file on fast scans.
+//
+// If total_files is known the status line includes an ETA.
+#define PROGRESS_REFRESH_NS 100000000LL
+
+struct progress_t {
+    char *message;
+    uint64_t total_files;
+    uint64_t start_ns;
+
+    volatile uint64_t files;
+    volatile uint64_t bytes;
+    volatile uint64_t next_draw_ns;
+};
+
+// The coarse clock is read from the vDSO without a syscall, its resolution of
+// a few milliseconds is enough for throttling.
+uint64_t progress_time_ns ()
 {
-    fprintf (stderr, "\r%s%.2f", message, val);
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
 }
 
-// :make_print_like
-void cli_status_end ()
+void progress_begin (struct progress_t *progress, char *message, uint64_t total_files)
 {
-    fprintf (stderr, "\r\e[KComplete.\n");
+    *progress = ZERO_INIT (struct progress_t);
+    progress->message = message;
+    progress->total_files = total_files;
+    progress->start_ns = progress_time_ns ();
+    progress->next_draw_ns = progress->start_ns;
+}
+
+void progress_draw (struct progress_t *progress, uint64_t now_ns)
+{
+    uint64_t files = progress->files;
+    uint64_t bytes = progress->bytes;
+    double elapsed = MAX (now_ns - progress->start_ns, 1)/1e9;
+
+    char line[256];
+    int len = snprintf (line, sizeof(line), "\r\e[K%s%lu", progress->message, files);
+    if (progress->total_files > 0) {
+        len += snprintf (line + len, sizeof(line) - len, "/%lu", progress->total_files);
+    }
+
+    if (now_ns > progress->start_ns) {
+        len += snprintf (line + len, sizeof(line) - len, " (%.0f files/s", files/elapsed);
+        if (bytes > 0) {
+            len += snprintf (line + len, sizeof(line) - len, ", %.1f MiB/s", bytes/elapsed/megabyte(1));
+        }
+
+        if (progress->total_files > files && files > 0) {
+            uint64_t eta = (progress->total_files - files)*elapsed/files;
+            len += snprintf (line + len, sizeof(line) - len, ", ETA %lu:%02lu", eta/60, eta%60);
+        }
+        snprintf (line + len, sizeof(line) - len, ")");
+    }
+
+    fputs (line, stderr);
+}
+
+void progress_add (struct progress_t *progress, uint64_t files, uint64_t bytes)
+{
+    __sync_fetch_and_add (&progress->files, files);
+    if (bytes > 0) {
+        __sync_fetch_and_add (&progress->bytes, bytes);
+    }
+
+    uint64_t next_draw_ns = progress->next_draw_ns;
+    uint64_t now_ns = progress_time_ns ();
+    if (now_ns >= next_draw_ns &&
+        __sync_bool_compare_and_swap (&progress->next_draw_ns, next_draw_ns, now_ns + PROGRESS_REFRESH_NS)) {
+        progress_draw (progress, now_ns);
+    }
+}
+
+// Leaves the final values in the status line.
+void progress_end (struct progress_t *progress)
+{
+    progress_draw (progress, progress_time_ns ());
+    fprintf (stderr, "\n");
 }
 
 enum file_header_status_t {
@@ -77,9 +185,24 @@ struct file_header_t {
     size_t size;
     char *data;
 
+    // Set for files that will be removed, points to the copy that's kept.
+    struct file_header_t *duplicate_of;
+
+    // Computed by file_relevance_key() before sorting duplicates.
+    uint64_t relevance_key;
+
     struct file_header_t *next;
 };
 
+uint64_t file_list_len (struct file_header_t *files)
+{
+    uint64_t len = 0;
+    LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+        len++;
+    }
+    return len;
+}
+
 void file_name_compute_relevance_characteristics (char *fname, bool *has_copy_parenthesis, uint64_t *space_cnt)
 {
     assert (has_copy_parenthesis != NULL && space_cnt != NULL);
@@ -127,51 +250,35 @@ void path_compute_relevance_characteristics (char *basename, uint64_t *depth)
     }
 }
 
-// This compares the relevance of the filename. It's used when we have identical
-// duplicates, to decide which name should be the one that isn't removed.
-// Compares two filenames and returns true if p1 is more relevant than p2 (i.e.
-// p1 should be kept and p2 removed).
+// The relevance of a file name is used when we have identical duplicates, to
+// decide which name should be the one that isn't removed. It's packed into an
+// integer key where smaller keys are more relevant, so it's computed once per
+// file instead of splitting and scanning both paths on each comparison of the
+// sort. From most to least significant bit the key contains:
 //
-// For now we only try to remove files with (n) in their name. Then we preffer
-// names without spaces.
-bool duplicate_file_name_cmp (struct file_header_t *p1, struct file_header_t *p2, char *prefer_removal_if_substr)
-{
-    // If a substring is passed to match and prefer which one to remove, early
-    // return because we don't need to allocate and it should be the common
-    // case.
-    if (prefer_removal_if_substr != NULL) {
-        bool match1 = strstr(str_data(&p1->path), prefer_removal_if_substr) != NULL;
-        bool match2 = strstr(str_data(&p2->path), prefer_removal_if_substr) != NULL;
-
-        if (match1 == true && match2 == false) {
-            return false;
+//   - 1 bit set if the path contains prefer_removal_if_substr.
+//   - 1 bit set if the file name has a copy parenthesis like "IMG (1).jpg".
+//   - 1 bit set if the extension isn't HEIC.
+//   - RELEVANCE_KEY_SPACE_BITS for the number of spaces in the file name.
+//   - RELEVANCE_KEY_DEPTH_BITS for the depth of the path.
+//
+// Counts saturate when they don't fit in their field.
+#define RELEVANCE_KEY_SPACE_BITS 16
+#define RELEVANCE_KEY_DEPTH_BITS 45
 
-        } else if (match1 == false && match2 == true) {
-            return true;
-        }
-    }
+#define RELEVANCE_KEY_FIELD(value,bits) MIN((uint64_t)(value), (1ULL<<(bits)) - 1)
 
-    mem_pool_t pool_l = {0};
+uint64_t file_relevance_key (char *path, char *prefer_removal_if_substr)
+{
+    bool has_removal_substr = prefer_removal_if_substr != NULL &&
+        strstr(path, prefer_removal_if_substr) != NULL;
+
+    char *fname = strrchr (path, '/');
+    fname = fname == NULL ? path : fname + 1;
 
-    char *basename1 = NULL;
-    char *fname1 = NULL;
-    path_split (&pool_l, str_data(&p1->path), &basename1, &fname1);
-    bool has_copy_parenthesis_1;
-    uint64_t space_cnt_1;
-    file_name_compute_relevance_characteristics (fname1, &has_copy_parenthesis_1, &space_cnt_1);
-
-    char *basename2 = NULL;
-    char *fname2 = NULL;
-    path_split (&pool_l, str_data(&p2->path), &basename2, &fname2);
-    bool has_copy_parenthesis_2;
-    uint64_t space_cnt_2;
-    file_name_compute_relevance_characteristics (fname2, &has_copy_parenthesis_2, &space_cnt_2);
-
-    bool is_p1_lt_p2;
-    if (has_copy_parenthesis_1 == true && has_copy_parenthesis_2 == false) {
-        is_p1_lt_p2 = false;
-    } else if (has_copy_parenthesis_1 == false && has_copy_parenthesis_2 == true) {
-        is_p1_lt_p2 = true;
+    bool has_copy_parenthesis;
+    uint64_t space_cnt;
+    file_name_compute_relevance_characteristics (fname, &has_copy_parenthesis, &space_cnt);
 
     // I've seen file duplicates with .HEIC and .heif extensions, I don't know
     // what creates these .heif copies but they seem to be the odd ones because
@@ -186,25 +293,26 @@ bool duplicate_file_name_cmp (struct file_header_t *p1, struct file_header_t *p2
     //
     // TODO: Is there a similar preference between .jpeg and .jpg?... maybe we
     // should just prefer the most common extension?.
-    } else if (strcasecmp(get_extension(fname1), "HEIC") == 0) {
-        is_p1_lt_p2 = true;
-    } else if (strcasecmp(get_extension(fname2), "HEIC") == 0) {
-        is_p1_lt_p2 = false;
-
-    } else if (space_cnt_1 < space_cnt_2) {
-        is_p1_lt_p2 = true;
-    } else {
-        uint64_t depth_1, depth_2;
-        path_compute_relevance_characteristics (basename1, &depth_1);
-        path_compute_relevance_characteristics (basename2, &depth_2);
-
-        is_p1_lt_p2 = depth_1 < depth_2;
-    }
-
-    mem_pool_destroy (&pool_l);
-    return is_p1_lt_p2;
+    char *extension = get_extension (fname);
+    bool is_heic = extension != NULL && strcasecmp (extension, "HEIC") == 0;
+
+    // The separator before the file name is counted too, that's the same for
+    // all paths so it doesn't change the order.
+    uint64_t depth;
+    path_compute_relevance_characteristics (path, &depth);
+
+    uint64_t key = has_removal_substr;
+    key = (key << 1) | has_copy_parenthesis;
+    key = (key << 1) | !is_heic;
+    key = (key << RELEVANCE_KEY_SPACE_BITS) | RELEVANCE_KEY_FIELD(space_cnt, RELEVANCE_KEY_SPACE_BITS);
+    key = (key << RELEVANCE_KEY_DEPTH_BITS) | RELEVANCE_KEY_FIELD(depth, RELEVANCE_KEY_DEPTH_BITS);
+    return key;
 }
-templ_sort_ll (duplicate_relevance_sort, struct file_header_t, duplicate_file_name_cmp(a, b, user_data));
+// Files with the same key are sorted by path, so the copy that's kept doesn't
+// depend on the order in which files were found.
+templ_sort_ll (duplicate_relevance_sort, struct file_header_t,
+               a->relevance_key < b->relevance_key ||
+               (a->relevance_key == b->relevance_key && strcmp (str_data(&a->path), str_data(&b->path)) < 0));
 
 bool full_file_compare (struct file_header_t *p1, struct file_header_t *p2)
 {
@@ -215,62 +323,127 @@ bool full_file_compare (struct file_header_t *p1, struct file_header_t *p2)
         return memcmp (p1->data, p2->data, p1->size) < 0;
     }
 }
-templ_sort_ll (file_equality_sort, struct file_header_t, full_file_compare(a, b));
+templ_sort_parallel_ll (file_equality_sort, struct file_header_t, full_file_compare(a, b));
+
+// Buckets whose loaded files add up to this many bytes are sorted by
+// file_equality_sort_parallel(). Each comparison is a memcmp() of whole files,
+// so for these, spreading comparisons over the cores pays off.
+#define FILE_EQUALITY_PARALLEL_MIN_BYTES megabyte(64)
 
 struct file_bucket_t {
     uint32_t count;
     struct file_header_t *strings;
 
+    // Hash shared by the files in the bucket, 0 for buckets that aren't
+    // grouped by hash, like file name duplicates.
+    uint64_t hash;
+
     struct file_bucket_t *next;
 };
 
-BINARY_TREE_NEW(uint64_to_str_list, uint64_t, struct file_bucket_t*,  a <= b ? (a == b ? 0 : -1) : 1);
+templ_radix_sort (uint64_radix_sort, uint64_t, *a);
 BINARY_TREE_NEW(str_to_str_list, char*, struct file_bucket_t*, strcmp(a,b));
 
+struct file_hash_t {
+    uint64_t hash;
+    char *path;
+};
+templ_radix_sort (file_hash_sort, struct file_hash_t, a->hash);
+
 struct scrapbook_t {
     mem_pool_t pool;
 
-    struct uint64_to_str_list_tree_t hash_to_path;
+    // Hashes of files are only appended here while files are read. They are
+    // grouped at the end by file_hash_duplicates(), with a single sort.
+    mem_pool_t buckets_pool;
+    DYNAMIC_ARRAY_DEFINE (struct file_hash_t, file_hashes);
 
     uint64_t total_size; 
     uint64_t processed_files;
+
+    // Size of the partial read of find_file_duplicates(), 0 to adapt it to
+    // each file type.
+    uint64_t partial_read_size;
+
+    struct progress_t progress;
 };
 
 void push_file_hash (struct scrapbook_t *app, uint64_t hash, char *path)
 {
-    struct file_bucket_t *bucket = uint64_to_str_list_get (&app->hash_to_path, hash);
-    if (bucket == NULL) {
-        bucket = mem_pool_push_struct (&app->hash_to_path.pool, struct file_bucket_t);
-        *bucket = ZERO_INIT (struct file_bucket_t);
-        uint64_to_str_list_tree_insert (&app->hash_to_path, hash, bucket);
+    if (app->file_hashes == NULL) {
+        DYNAMIC_ARRAY_INIT (&app->buckets_pool, app->file_hashes, 0);
     }
 
-    // TODO: This de-duplication feels wrong here because push_file_hash() is
-    // called once per file, so this ends up being O(n^2). Don't we have the
-    // guarantee that the collected list of files has unique paths?, if we do
-    // then we should remove this and just insert at the end unconditionally.
-    bool found = false;
-    struct file_header_t *curr_str = bucket->strings;
-    while (curr_str != NULL) {
-        if (strcmp(path, str_data(&curr_str->path)) == 0) {
-            found = true;
-            break;
+    struct file_hash_t file_hash = {.hash = hash, .path = pom_strdup (&app->buckets_pool, path)};
+    DYNAMIC_ARRAY_APPEND (app->file_hashes, file_hash);
+    trace_count (TRACE_COUNTER_FILES_HASHED, 1);
+}
+
+// Groups files pushed with push_file_hash() by sorting them by hash and
+// scanning runs of equal hashes. Returns the buckets that have more than one
+// file, the number of files in them is stored in num_files if it's not NULL.
+struct file_bucket_t* file_hash_duplicates (struct scrapbook_t *app, uint64_t *num_files)
+{
+    TRACE_SCOPE ("group_hashes");
+
+    struct trace_scope_t sort_scope = trace_scope_begin ("sort_hashes");
+    file_hash_sort (app->file_hashes, app->file_hashes_len);
+    trace_scope_end (&sort_scope);
+
+    struct file_bucket_t *duplicates = NULL;
+    uint64_t duplicates_len = 0;
+    int run_start = 0;
+    while (run_start < app->file_hashes_len) {
+        int run_end = run_start + 1;
+        while (run_end < app->file_hashes_len &&
+               app->file_hashes[run_end].hash == app->file_hashes[run_start].hash) {
+            run_end++;
         }
 
-        curr_str = curr_str->next;
-    }
+        if (run_end - run_start > 1) {
+            struct file_bucket_t *bucket = mem_pool_push_struct (&app->buckets_pool, struct file_bucket_t);
+            *bucket = ZERO_INIT (struct file_bucket_t);
+            bucket->hash = app->file_hashes[run_start].hash;
+
+            for (int i=run_start; i<run_end; i++) {
+                char *path = app->file_hashes[i].path;
+
+                // TODO: This de-duplication is O(n^2) on the size of the
+                // bucket. Don't we have the guarantee that the collected list
+                // of files has unique paths?, if we do then we should remove
+                // this.
+                bool found = false;
+                LINKED_LIST_FOR (struct file_header_t*, curr_str, bucket->strings) {
+                    if (strcmp(path, str_data(&curr_str->path)) == 0) {
+                        found = true;
+                        break;
+                    }
+                }
+
+                if (!found) {
+                    LINKED_LIST_PUSH_NEW (&app->buckets_pool, struct file_header_t, bucket->strings, str);
+                    str_set_pooled (&app->buckets_pool, &str->path, path);
+                    bucket->count++;
+                }
+            }
+
+            if (bucket->count > 1) {
+                duplicates_len += bucket->count;
+                LINKED_LIST_PUSH (duplicates, bucket);
+
+                trace_count (TRACE_COUNTER_BUCKETS, 1);
+                trace_count (TRACE_COUNTER_BUCKET_FILES, bucket->count);
+                trace_count_max (TRACE_COUNTER_MAX_BUCKET_SIZE, bucket->count);
+            }
+        }
 
-    if (!found) {
-        LINKED_LIST_PUSH_NEW (&app->hash_to_path.pool, struct file_header_t, bucket->strings, str);
-        str_set (&str->path, path);
-        bucket->count++;
+        run_start = run_end;
     }
-}
 
-uint64_t hash_64 (void *ptr, size_t size)
-{
-    meow_u128 hash = MeowHash(MeowDefaultSeed, size, ptr);
-    return MeowU64From(hash, 0);
+    if (num_files != NULL) {
+        *num_files = duplicates_len;
+    }
+    return duplicates;
 }
 
 char* partial_file_read (mem_pool_t *pool, const char *path, uint64_t max_size, uint64_t *size_read)
@@ -284,26 +457,34 @@ char* partial_file_read (mem_pool_t *pool, const char *path, uint64_t max_size,
 
     char *loaded_data = NULL;
     struct stat st;
+    trace_count (TRACE_COUNTER_STAT, 1);
     if (stat(path, &st) == 0) {
         uint64_t size_to_read = MIN(st.st_size, max_size);
         loaded_data = (char*)pom_push_size (pool, size_to_read + 1);
 
         int file = open (path, O_RDONLY);
+        trace_count (TRACE_COUNTER_OPEN, 1);
         if (file != -1) {
-            int bytes_read = 0;
-            do {
-                int status = read (file, loaded_data+bytes_read, size_to_read-bytes_read);
+            uint64_t bytes_read = 0;
+            while (bytes_read < size_to_read) {
+                ssize_t status = read (file, loaded_data+bytes_read, size_to_read-bytes_read);
+                trace_count (TRACE_COUNTER_READ, 1);
                 if (status == -1) {
                     success = false;
                     printf ("Error reading %s: %s\n", path, strerror(errno));
                     break;
+
+                } else if (status == 0) {
+                    // The file got shorter since we called stat().
+                    break;
                 }
                 bytes_read += status;
-            } while (bytes_read != size_to_read);
-            loaded_data[size_to_read] = '\0';
+            }
+            loaded_data[bytes_read] = '\0';
+            trace_count (TRACE_COUNTER_BYTES_READ, bytes_read);
 
             if (size_read != NULL) {
-                *size_read = size_to_read;
+                *size_read = bytes_read;
             }
 
             close (file);
@@ -334,23 +515,30 @@ char* partial_file_read (mem_pool_t *pool, const char *path, uint64_t max_size,
 struct collect_jpg_cb_clsr_t {
     mem_pool_t *pool;
     uint64_t count;
+    struct progress_t progress;
     struct file_header_t *files;
     char *match_extension;
 };
 
+static inline
+bool collect_files_match (struct collect_jpg_cb_clsr_t *clsr, char *fname)
+{
+    char *extension = get_extension (fname);
+    return clsr->match_extension == NULL || (extension != NULL && strncasecmp (extension, clsr->match_extension, 3) == 0);
+}
+
 ITERATE_DIR_CB (collect_files_cb)
 {
     struct collect_jpg_cb_clsr_t *clsr = (struct collect_jpg_cb_clsr_t*) data;
 
-    char *extension = get_extension (fname);
     if (!is_dir) {
-        if (clsr->match_extension == NULL || (extension != NULL && strncasecmp (extension, clsr->match_extension, 3) == 0)) {
+        if (collect_files_match (clsr, fname)) {
             LINKED_LIST_PUSH_NEW (clsr->pool, struct file_header_t, clsr->files, new_node);
             str_set (&new_node->path, fname);
             clsr->count++;
+            progress_add (&clsr->progress, 1, 0);
         }
     }
-    cli_status ("Files collected: ", clsr->count);
 }
 
 ITERATE_DIR_CB (find_duplicates_by_hash)
@@ -367,8 +555,8 @@ ITERATE_DIR_CB (find_duplicates_by_hash)
 
         push_file_hash (sb, hash_64 (file_data, file_len), fname);
         mem_pool_destroy (&pool_l);
+        progress_add (&sb->progress, 1, file_len);
     }
-    cli_status ("read files: ", sb->processed_files);
 }
 
 void test_relevance_characteristics (char *fname)
@@ -434,195 +622,888 @@ void print_bucket_list (struct file_bucket_t *bucket_lst, enum path_format_t for
     }
 }
 
-void print_bucket_duplicates (char **paths, int paths_len,
-                              struct file_bucket_t *bucket_lst, enum path_format_t format)
-{
-    assert (paths != NULL);
+// Parallel directory walk
+//
+// Directories are kept in a shared queue. Each worker takes one, lists it
+// without holding the lock, then queues the subdirectories and adds the
+// matching files it found. pending counts the directories that are queued or
+// being listed, the walk ends when it gets to zero. This helps when stat()
+// latency dominates, like with a cold cache or a network file system. For the
+// same reason at least COLLECT_WALK_MIN_THREADS are used, even with fewer CPUs.
+
+#define COLLECT_WALK_MIN_THREADS 4
+
+struct collect_dir_t {
+    char *path;
+    bool is_dir;
+    struct collect_dir_t *next;
+};
 
-    printf ("Manually append to: ~/.weaver/data/deduplication.tsplx\n");
+struct collect_walk_t {
+    struct collect_jpg_cb_clsr_t *clsr;
 
-    // TODO: Also print this for name and image deduplication
-    printf ("file-content-deduplication{\n");
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    mem_pool_t pool;
+    struct collect_dir_t *dirs;
+    uint64_t pending;
+};
 
-    printf ("  path");
-    for (int i=0; i<paths_len; i++) {
-        printf (" \"%s\"", paths[i]);
-    }
-    printf (";\n");
+// Must be called with the lock held.
+void collect_walk_push_dir (struct collect_walk_t *walk, char *path)
+{
+    LINKED_LIST_PUSH_NEW (&walk->pool, struct collect_dir_t, walk->dirs, new_dir);
+    new_dir->path = pom_strdup (&walk->pool, path);
+    new_dir->is_dir = true;
+    walk->pending++;
+    pthread_cond_signal (&walk->cond);
+}
 
-    printf ("  duplicates {\n");
-    struct file_bucket_t *curr_bucket = bucket_lst;
-    while (curr_bucket != NULL) {
-        struct file_header_t *curr_str = curr_bucket->strings;
-        if (curr_bucket->strings->next != NULL) {
-            bool is_first = true;
-            while (curr_str != NULL) {
-                if (is_first) {
-                    printf ("    ");
-                    is_first = false;
-                }
+void* collect_walk_worker (void *data)
+{
+    struct collect_walk_t *walk = (struct collect_walk_t*)data;
+    struct collect_jpg_cb_clsr_t *clsr = walk->clsr;
 
-                if (format == PATH_FORMAT_FNAME) {
-                    char *fname = NULL;
-                    path_split (NULL, str_data(&curr_str->path), NULL, &fname);
-                    printf ("\"%s\"", fname);
-                    free (fname);
+    mem_pool_t pool_l = {0};
+    string_t path = {0};
 
-                } else if (format == PATH_FORMAT_ABSOLUTE) {
-                    printf ("\"%s\"", str_data(&curr_str->path));
-                }
+    pthread_mutex_lock (&walk->mutex);
+    while (true) {
+        while (walk->dirs == NULL && walk->pending > 0) {
+            pthread_cond_wait (&walk->cond, &walk->mutex);
+        }
 
-                if (curr_str->next != NULL) {
-                    printf (" ");
+        if (walk->dirs == NULL) break;
+
+        struct collect_dir_t *dir = LINKED_LIST_POP (walk->dirs);
+        str_set (&path, dir->path);
+        pthread_mutex_unlock (&walk->mutex);
+
+        struct collect_dir_t *entries = NULL;
+        int path_len = str_len (&path);
+        DIR *d = opendir (str_data(&path));
+        if (d != NULL) {
+            struct dirent *entry_info;
+            while (read_dir (d, &entry_info)) {
+                char *name = entry_info->d_name;
+                if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0) continue;
+
+                struct stat st;
+                str_put_c (&path, path_len, name);
+                if (stat(str_data(&path), &st) == 0) {
+                    if (S_ISREG(st.st_mode) && collect_files_match (clsr, str_data(&path))) {
+                        LINKED_LIST_PUSH_NEW (&pool_l, struct collect_dir_t, entries, new_entry);
+                        new_entry->path = pom_strdup (&pool_l, str_data(&path));
+                        progress_add (&clsr->progress, 1, 0);
+
+                    } else if (S_ISDIR(st.st_mode)) {
+                        str_cat_c (&path, "/");
+                        LINKED_LIST_PUSH_NEW (&pool_l, struct collect_dir_t, entries, new_entry);
+                        new_entry->path = pom_strdup (&pool_l, str_data(&path));
+                        new_entry->is_dir = true;
+                    }
                 }
+            }
+            closedir (d);
 
-                curr_str = curr_str->next;
+        } else {
+            printf ("error: can't open directory '%s'\n", str_data(&path));
+        }
+
+        pthread_mutex_lock (&walk->mutex);
+        LINKED_LIST_FOR (struct collect_dir_t*, curr_entry, entries) {
+            if (curr_entry->is_dir) {
+                collect_walk_push_dir (walk, curr_entry->path);
+            } else {
+                LINKED_LIST_PUSH_NEW (clsr->pool, struct file_header_t, clsr->files, new_node);
+                str_set (&new_node->path, curr_entry->path);
+                clsr->count++;
             }
-            printf (";\n");
         }
 
-        curr_bucket = curr_bucket->next;
+        walk->pending--;
+        if (walk->pending == 0) {
+            pthread_cond_broadcast (&walk->cond);
+        }
+
+        mem_pool_reset (&pool_l);
+    }
+    pthread_mutex_unlock (&walk->mutex);
+
+    str_free (&path);
+    mem_pool_destroy (&pool_l);
+    return NULL;
+}
+
+void collect_files_parallel (char *path, struct collect_jpg_cb_clsr_t *clsr, int num_threads)
+{
+    struct collect_walk_t walk = {0};
+    walk.clsr = clsr;
+    pthread_mutex_init (&walk.mutex, NULL);
+    pthread_cond_init (&walk.cond, NULL);
+
+    string_t root = str_new (path);
+    if (str_last (&root) != '/') {
+        str_cat_c (&root, "/");
+    }
+    collect_walk_push_dir (&walk, str_data(&root));
+    str_free (&root);
+
+    pthread_t threads[num_threads];
+    for (int i=0; i<num_threads; i++) {
+        pthread_create (&threads[i], NULL, collect_walk_worker, &walk);
+    }
+
+    for (int i=0; i<num_threads; i++) {
+        pthread_join (threads[i], NULL);
     }
-    printf ("  }\n");
 
-    printf ("}\n");
+    pthread_cond_destroy (&walk.cond);
+    pthread_mutex_destroy (&walk.mutex);
+    mem_pool_destroy (&walk.pool);
 }
 
+templ_sort_ll (file_path_sort, struct file_header_t, strcmp (str_data(&a->path), str_data(&b->path)) < 0);
+
 // Looks up directory names passed as cli arguments and recursiveley collects
 // all image files inside of them. If a file name is passsed, the absolute path
 // to the file is appended to the resulting list.
-struct file_header_t* collect_files_from_cli (mem_pool_t *pool, char *extension, char **paths, int paths_len)
+//
+// If verbose is false nothing is printed to stdout, this is used by modes
+// whose output is meant to be consumed by other programs.
+//
+// With more than one thread directories are walked in parallel. The order in
+// which files are found then changes from run to run, so the result is sorted
+// by path.
+struct file_header_t* collect_files_from_cli_full (mem_pool_t *pool, char *extension, char **paths, int paths_len,
+                                                   bool verbose, int num_threads)
 {
+    TRACE_SCOPE ("collect_files");
+
     struct collect_jpg_cb_clsr_t clsr = {0};
     clsr.match_extension = extension;
     clsr.pool = pool;
+    progress_begin (&clsr.progress, "Files collected: ", 0);
 
     uint64_t file_cnt = 0;
-    printf (ECMA_S_DEFAULT(1, "Creating file list\n"));
+    if (verbose) printf (ECMA_S_DEFAULT(1, "Creating file list\n"));
     for (int i=0; i<paths_len; i++) {
         char *path = abs_path (paths[i], NULL);
-        printf ("PATH: %s\n", path);
+        if (path == NULL || *path == '\0') {
+            // abs_path() returns an empty path if the path doesn't exist.
+            fprintf (verbose ? stdout : stderr, "%s (not found, ignoring)\n", paths[i]);
+            free (path);
+            continue;
+        }
+
+        if (verbose) printf ("PATH: %s\n", path);
         if (dir_exists (path)) {
-            printf ("%s/**\n", path);
-            iterate_dir_full (path, collect_files_cb, &clsr, true);
-            cli_status_end ();
+            if (verbose) printf ("%s/**\n", path);
+            if (num_threads > 1) {
+                collect_files_parallel (path, &clsr, num_threads);
+            } else {
+                iterate_dir_full (path, collect_files_cb, &clsr, true);
+            }
+            progress_end (&clsr.progress);
 
         } else if (path_exists (path)) {
-            printf ("%s\n", path);
+            if (verbose) printf ("%s\n", path);
             LINKED_LIST_PUSH_NEW (pool, struct file_header_t, clsr.files, new_node);
             str_set (&new_node->path, path);
             file_cnt++;
 
         } else {
-            printf ("%s (not found, ignoring)\n", path);
+            fprintf (verbose ? stdout : stderr, "%s (not found, ignoring)\n", path);
         }
 
-        if (path != NULL) {
-            free (path);
-        }
+        free (path);
+    }
+
+    if (verbose) {
+        printf ("Total files: %lu\n", file_cnt + clsr.count);
+        printf ("\n");
+    }
+
+    if (num_threads > 1) {
+        file_path_sort (&clsr.files, file_cnt + clsr.count);
     }
-    printf ("Total files: %lu\n", file_cnt + clsr.count);
-    printf ("\n");
 
     return clsr.files;
 }
 
+struct file_header_t* collect_files_from_cli (mem_pool_t *pool, char *extension, char **paths, int paths_len)
+{
+    return collect_files_from_cli_full (pool, extension, paths, paths_len, true, 1);
+}
+
 struct file_header_t* collect_jpg_from_cli (mem_pool_t *pool, char **paths, int paths_len)
 {
     return collect_files_from_cli (pool, "jpg", paths, paths_len);
 }
 
-// Finds duplicates that are identical at file level.
+///////////////////////////////
+// Partial reads
 //
-// When a file has multiple duplicates we automatically decide which one to
-// remove according to the criteria of duplicate_file_name_cmp(). Any path that
-// contains remove_substr as substring will be prefered for removal over one
-// that doesn't contaín it.
-struct file_bucket_t* find_file_duplicates (struct scrapbook_t *sb, struct file_header_t *files)
+// find_file_duplicates() groups files by a hash of a sample of their content
+// and only compares files in full within a group. The sample is a prefix of
+// the file, and for container formats also a suffix, their headers are often
+// the same across unrelated files while the index at the end isn't.
+//
+// Sample sizes depend on the type of the file, which is detected from its
+// first bytes. It can't come from the path, copies are sometimes renamed to
+// a different extension and then they must still get the same hash.
+//
+// Files of a group that turn out to be unique, either by their sample signature
+// (see below) or in the full comparison, are false positives and the bytes read
+// to tell them apart were wasted. These are counted for each type and the
+// sample sizes are adapted at the end of a run, then stored in the cache so the
+// next run starts from them:
+//
+//  - If false positives cost more bytes than doubling the sample would add to
+//    the partial reads, the sample is doubled. The prefix before doubling is
+//    remembered as the smallest one to use for the type.
+//
+//  - After a run without false positives the sample is halved, as long as the
+//    prefix doesn't go below that minimum. The suffix doesn't go below
+//    PARTIAL_READ_MIN_SIZE.
+//
+// Types with less than PARTIAL_READ_MIN_FILES files in a run are not adapted.
+// Passing --partial-read-size disables this and uses a fixed prefix for all
+// files.
+
+#define PARTIAL_READ_DEFAULT_PREFIX kilobyte(5)
+#define PARTIAL_READ_DEFAULT_SUFFIX kilobyte(4)
+#define PARTIAL_READ_MIN_SIZE kilobyte(1)
+#define PARTIAL_READ_MAX_SIZE kilobyte(256)
+#define PARTIAL_READ_MIN_FILES 16
+#define PARTIAL_READ_CACHE_FILE "scrapbook/partial_read"
+
+#define PARTIAL_READ_NAME_SIZE 16
+
+struct partial_read_type_t {
+    char name[PARTIAL_READ_NAME_SIZE];
+
+    uint64_t prefix_size;
+    uint64_t suffix_size;
+    uint64_t min_prefix_size;
+
+    // Telemetry of the current run.
+    uint64_t files;
+    uint64_t bytes_read;
+    uint64_t split_buckets;
+    uint64_t false_positive_files;
+    uint64_t false_positive_bytes;
+};
+
+// Type of the last file seen with an extension. Its prefix size is used for
+// the first read, so we usually read each file with a single call.
+struct partial_read_extension_t {
+    char extension[PARTIAL_READ_NAME_SIZE];
+    int type_idx;
+};
+
+struct partial_reads_t {
+    mem_pool_t pool;
+    DYNAMIC_ARRAY_DEFINE (struct partial_read_type_t, types);
+    DYNAMIC_ARRAY_DEFINE (struct partial_read_extension_t, extensions);
+
+    // If not 0, the prefix size used for all files, nothing is adapted.
+    uint64_t fixed_size;
+};
+
+// ISO base media files, like HEIF and MP4, have an ftyp box at the start
+// that's the same for all files of a brand, the brand tells them apart.
+char* partial_read_detect_type (uint8_t *data, uint64_t len, bool *is_container)
 {
-    struct file_header_t *curr_str = files;
-    while (curr_str != NULL) {
-        mem_pool_t pool_l = {0};
-        sb->processed_files++;
+    *is_container = false;
+    if (len >= 3 && memcmp (data, "\xFF\xD8\xFF", 3) == 0) {
+        return "jpeg";
+
+    } else if (len >= 12 && memcmp (data + 4, "ftyp", 4) == 0) {
+        *is_container = true;
+        char *heif_brands[] = {"heic", "heix", "hevc", "mif1", "msf1", "avif"};
+        for (int i=0; i<ARRAY_SIZE(heif_brands); i++) {
+            if (memcmp (data + 8, heif_brands[i], 4) == 0) return "heif";
+        }
+        return memcmp (data + 8, "qt  ", 4) == 0 ? "mov" : "mp4";
 
-        uint64_t file_len = 0;
-        char *fname = str_data(&curr_str->path);
-        // TODO: The length of the initial partial read is currently hardcoded
-        // to the smallest value I've found to work fo pictures such that we
-        // don't group together files that should actually be separate. 1kB
-        // worked fine for a while, but for HEIC/HEIF files we got lots of false
-        // positives, so it's now been increased to 5kB. Should this be a CLI
-        // parameter?.
-        char *file_data = partial_file_read (&pool_l, fname, kilobyte(5), &file_len);
-        sb->total_size += file_len;
+    } else if (len >= 4 && memcmp (data, "\x89PNG", 4) == 0) {
+        return "png";
 
-        push_file_hash (sb, hash_64 (file_data, file_len), fname);
+    } else if (len >= 4 && memcmp (data, "GIF8", 4) == 0) {
+        return "gif";
 
-        mem_pool_destroy (&pool_l);
-        curr_str = curr_str->next;
-        cli_status ("Files processed: ", sb->processed_files);
+    } else if (len >= 4 && memcmp (data, "RIFF", 4) == 0) {
+        return "riff";
+
+    } else if (len >= 4 && memcmp (data, "%PDF", 4) == 0) {
+        return "pdf";
+
+    } else if (len >= 4 && memcmp (data, "PK\x03\x04", 4) == 0) {
+        return "zip";
     }
-    cli_status_end ();
 
-    printf ("Total files read: %lu\n", sb->processed_files);
-    printf ("Total size read: %lu bytes\n", sb->total_size);
+    return "other";
+}
 
-    struct file_bucket_t *tentative_duplicates = NULL;
-    uint32_t num_tentative_non_unique_files = 0;
-    BINARY_TREE_FOR(uint64_to_str_list, &sb->hash_to_path, curr_node) {
-        struct file_bucket_t *bucket = curr_node->value;
-        if (bucket->count > 1) {
-            struct file_header_t *curr_path = bucket->strings;
-            while (curr_path != NULL) {
-                num_tentative_non_unique_files++;
+int partial_reads_type_idx (struct partial_reads_t *partial_reads, char *name, bool is_container)
+{
+    for (int i=0; i<partial_reads->types_len; i++) {
+        if (strcmp (partial_reads->types[i].name, name) == 0) {
+            return i;
+        }
+    }
 
-                curr_path = curr_path->next;
-            }
+    struct partial_read_type_t type = {0};
+    strncpy (type.name, name, sizeof(type.name) - 1);
+    type.prefix_size = PARTIAL_READ_DEFAULT_PREFIX;
+    type.suffix_size = is_container ? PARTIAL_READ_DEFAULT_SUFFIX : 0;
+    DYNAMIC_ARRAY_APPEND (partial_reads->types, type);
+    return partial_reads->types_len - 1;
+}
+
+struct partial_read_extension_t* partial_reads_extension (struct partial_reads_t *partial_reads, char *path)
+{
+    char extension[PARTIAL_READ_NAME_SIZE] = "";
+    char *path_extension = get_extension (path);
+    if (path_extension != NULL) {
+        strncpy (extension, path_extension, sizeof(extension) - 1);
+    }
 
-            LINKED_LIST_PUSH (tentative_duplicates, bucket);
+    for (int i=0; i<partial_reads->extensions_len; i++) {
+        if (strcasecmp (partial_reads->extensions[i].extension, extension) == 0) {
+            return &partial_reads->extensions[i];
         }
     }
-    printf ("Tentative non unique file count: %d\n", num_tentative_non_unique_files);
 
-    struct file_bucket_t *exact_duplicates = NULL;
-    uint64_t exact_duplicates_len = 0;
-    if (num_tentative_non_unique_files > 0) {
-        printf ("\n");
-        printf ("Executing full comparison\n");
+    struct partial_read_extension_t new_extension = {.type_idx = -1};
+    strcpy (new_extension.extension, extension);
+    DYNAMIC_ARRAY_APPEND (partial_reads->extensions, new_extension);
+    return &DYNAMIC_ARRAY_GET_LAST (partial_reads->extensions);
+}
 
-        bool had_to_split_buckets = false;
-        while (tentative_duplicates != NULL)
-        {
-            struct file_bucket_t *curr_bucket = LINKED_LIST_POP(tentative_duplicates);
+void partial_reads_sizes (struct partial_reads_t *partial_reads, int type_idx,
+                          uint64_t *prefix_size, uint64_t *suffix_size)
+{
+    if (partial_reads->fixed_size != 0) {
+        *prefix_size = partial_reads->fixed_size;
+        *suffix_size = 0;
 
-            mem_pool_t pool_l = {0};
+    } else if (type_idx == -1) {
+        *prefix_size = PARTIAL_READ_DEFAULT_PREFIX;
+        *suffix_size = 0;
 
-            // Load all files in the bucket into memory
-            //
-            // TODO: If the cumulative size of files in the bucket is too big
-            // we will run out of memory. This can happen if for instance the
-            // partial equality test is done with a short size and all files
-            // pass as being equal (for example comparing less that 5 bytes of
-            // JPG files). In such case, we should bail out of this algorithm
-            // and move to one where files are sorted but only loaded into
-            // memory for each comparison. Ideally we should have a bucket size
-            // limit as a parameter and preemptively execute the correct
-            // algorithm, not wait until we run out of memory.
-            LINKED_LIST_FOR (struct file_header_t*, curr_file, curr_bucket->strings) {
-                curr_file->data = full_file_read (&pool_l, str_data(&curr_file->path), &curr_file->size);
-                curr_file->status = FILE_HEADER_LOADED;
-            }
+    } else {
+        *prefix_size = partial_reads->types[type_idx].prefix_size;
+        *suffix_size = partial_reads->types[type_idx].suffix_size;
+    }
+}
 
-            // Sort files by comparing their content
-            // This is O(n log(n)) on the size of the bucket and each performed
-            // operation is a full file comparison, which can be slow.
-            file_equality_sort (&curr_bucket->strings, curr_bucket->count);
+bool file_pread_full (int file, char *buff, uint64_t len, uint64_t offset, uint64_t *bytes_read)
+{
+    *bytes_read = 0;
+    while (*bytes_read < len) {
+        ssize_t status = pread (file, buff + *bytes_read, len - *bytes_read, offset + *bytes_read);
+        trace_count (TRACE_COUNTER_READ, 1);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        } else if (status == -1) {
+            return false;
+        } else if (status == 0) {
+            // The file got shorter since we called fstat().
+            break;
+        }
+        *bytes_read += status;
+    }
 
-            // Split bucket if there are non-equal files in it
-            //
-            // TODO: This makes O(n) full file comparisons which can get
-            // expensive. Is there a way we can use comparisons made during
-            // sorting and just require making O(n) fast comparisons here
+    trace_count (TRACE_COUNTER_BYTES_READ, *bytes_read);
+    return true;
+}
+
+// Computes the hash of the sample of the file at path. The prefix is read
+// with the size of the type last seen for the file's extension, then
+// completed or cut once the actual type is known. Returns the type of the
+// file, or -1 if it couldn't be read.
+int partial_reads_hash (struct partial_reads_t *partial_reads, char *path, mem_pool_t *pool,
+                        uint64_t *hash, uint64_t *bytes_read)
+{
+    *bytes_read = 0;
+
+    int file = open (path, O_RDONLY);
+    trace_count (TRACE_COUNTER_OPEN, 1);
+    if (file == -1) {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    trace_count (TRACE_COUNTER_STAT, 1);
+    if (fstat (file, &st) != 0) {
+        printf ("Could not stat %s: %s\n", path, strerror(errno));
+        close (file);
+        return -1;
+    }
+
+    bool success = true;
+    struct partial_read_extension_t *extension = partial_reads_extension (partial_reads, path);
+    uint64_t guess_prefix_size, suffix_size;
+    partial_reads_sizes (partial_reads, extension->type_idx, &guess_prefix_size, &suffix_size);
+
+    uint64_t max_prefix_size = MAX(guess_prefix_size, PARTIAL_READ_MAX_SIZE);
+    char *data = pom_push_size (pool, max_prefix_size + PARTIAL_READ_MAX_SIZE);
+
+    uint64_t prefix_len = 0;
+    success = file_pread_full (file, data, MIN(st.st_size, guess_prefix_size), 0, &prefix_len);
+
+    int type_idx = -1;
+    if (success) {
+        bool is_container;
+        char *type_name = partial_read_detect_type ((uint8_t*)data, prefix_len, &is_container);
+        type_idx = partial_reads_type_idx (partial_reads, type_name, is_container);
+        extension->type_idx = type_idx;
+
+        uint64_t prefix_size;
+        partial_reads_sizes (partial_reads, type_idx, &prefix_size, &suffix_size);
+        prefix_size = MIN(st.st_size, prefix_size);
+
+        if (prefix_len < prefix_size && prefix_len == guess_prefix_size) {
+            uint64_t rest_len;
+            success = file_pread_full (file, data + prefix_len, prefix_size - prefix_len, prefix_len, &rest_len);
+            prefix_len += rest_len;
+        }
+        prefix_len = MIN(prefix_len, prefix_size);
+
+        uint64_t suffix_len = 0;
+        if (success && prefix_len == prefix_size) {
+            suffix_size = MIN(st.st_size - prefix_len, suffix_size);
+            success = file_pread_full (file, data + prefix_len, suffix_size, st.st_size - suffix_size, &suffix_len);
+        }
+
+        *bytes_read = prefix_len + suffix_len;
+        *hash = hash_64 (data, *bytes_read);
+    }
+
+    if (!success) {
+        printf ("Error reading %s: %s\n", path, strerror(errno));
+        type_idx = -1;
+    }
+
+    close (file);
+    return type_idx;
+}
+
+// The cache goes in $XDG_CACHE_HOME or ~/.cache, returns NULL if neither is
+// set.
+char* partial_reads_cache_path (mem_pool_t *pool)
+{
+    char *cache_home = getenv ("XDG_CACHE_HOME");
+    if (cache_home != NULL && *cache_home != '\0') {
+        return pprintf (pool, "%s/%s", cache_home, PARTIAL_READ_CACHE_FILE);
+
+    } else if (getenv ("HOME") != NULL) {
+        return pprintf (pool, "%s/.cache/%s", getenv ("HOME"), PARTIAL_READ_CACHE_FILE);
+    }
+
+    return NULL;
+}
+
+// Cache format, one type per line with fields separated by spaces:
+//
+//   TYPE PREFIX_SIZE SUFFIX_SIZE MIN_PREFIX_SIZE
+//
+// Lines that can't be parsed are ignored.
+void partial_reads_begin (struct partial_reads_t *partial_reads, uint64_t fixed_size)
+{
+    *partial_reads = ZERO_INIT (struct partial_reads_t);
+    DYNAMIC_ARRAY_INIT (&partial_reads->pool, partial_reads->types, 0);
+    DYNAMIC_ARRAY_INIT (&partial_reads->pool, partial_reads->extensions, 0);
+    partial_reads->fixed_size = fixed_size;
+    if (fixed_size != 0) return;
+
+    mem_pool_t pool_l = {0};
+    char *cache_path = partial_reads_cache_path (&pool_l);
+    char *cache = cache_path != NULL && path_exists (cache_path) ?
+        full_file_read (&pool_l, cache_path, NULL) : NULL;
+
+    char *line = cache;
+    while (line != NULL && *line != '\0') {
+        char name[PARTIAL_READ_NAME_SIZE];
+        uint64_t prefix_size, suffix_size, min_prefix_size;
+        if (sscanf (line, "%15s %lu %lu %lu", name, &prefix_size, &suffix_size, &min_prefix_size) == 4) {
+            struct partial_read_type_t *type = &partial_reads->types[partial_reads_type_idx (partial_reads, name, false)];
+            type->prefix_size = CLAMP (prefix_size, PARTIAL_READ_MIN_SIZE, PARTIAL_READ_MAX_SIZE);
+            type->suffix_size = MIN (suffix_size, PARTIAL_READ_MAX_SIZE);
+            type->min_prefix_size = MIN (min_prefix_size, PARTIAL_READ_MAX_SIZE);
+        }
+
+        line = strchr (line, '\n');
+        if (line != NULL) line++;
+    }
+
+    mem_pool_destroy (&pool_l);
+}
+
+void partial_reads_print (struct partial_reads_t *partial_reads)
+{
+    bool has_false_positives = false;
+    for (int i=0; i<partial_reads->types_len; i++) {
+        has_false_positives = has_false_positives || partial_reads->types[i].false_positive_files > 0;
+    }
+    if (!has_false_positives) return;
+
+    printf ("Partial hash false positives by type:\n");
+    for (int i=0; i<partial_reads->types_len; i++) {
+        struct partial_read_type_t *type = &partial_reads->types[i];
+        if (type->false_positive_files == 0) continue;
+
+        uint64_t prefix_size, suffix_size;
+        partial_reads_sizes (partial_reads, i, &prefix_size, &suffix_size);
+        printf ("  %s: %lu of %lu files, %lu split groups, %lu bytes read after the partial hash (prefix %lu, suffix %lu)\n",
+                type->name, type->false_positive_files, type->files, type->split_buckets,
+                type->false_positive_bytes, prefix_size, suffix_size);
+    }
+    printf ("\n");
+}
+
+void partial_reads_adapt (struct partial_read_type_t *type)
+{
+    if (type->files < PARTIAL_READ_MIN_FILES) return;
+
+    uint64_t doubling_cost = type->files * (type->prefix_size + type->suffix_size);
+    if (type->false_positive_bytes > doubling_cost && type->prefix_size < PARTIAL_READ_MAX_SIZE) {
+        type->min_prefix_size = type->prefix_size;
+        type->prefix_size = MIN (2*type->prefix_size, PARTIAL_READ_MAX_SIZE);
+        type->suffix_size = MIN (2*type->suffix_size, PARTIAL_READ_MAX_SIZE);
+
+    } else if (type->false_positive_files == 0 &&
+               type->prefix_size/2 >= MAX (type->min_prefix_size, PARTIAL_READ_MIN_SIZE)) {
+        type->prefix_size /= 2;
+        if (type->suffix_size/2 >= PARTIAL_READ_MIN_SIZE) {
+            type->suffix_size /= 2;
+        }
+    }
+}
+
+// Adapts the sample sizes to the telemetry of this run and stores them.
+void partial_reads_end (struct partial_reads_t *partial_reads)
+{
+    mem_pool_t pool_l = {0};
+    char *cache_path = partial_reads->fixed_size == 0 ? partial_reads_cache_path (&pool_l) : NULL;
+    if (cache_path != NULL) {
+        string_t cache = {0};
+        for (int i=0; i<partial_reads->types_len; i++) {
+            struct partial_read_type_t *type = &partial_reads->types[i];
+            partial_reads_adapt (type);
+            str_cat_printf (&cache, "%s %lu %lu %lu\n",
+                            type->name, type->prefix_size, type->suffix_size, type->min_prefix_size);
+        }
+
+        // This is only an optimization, failing to store it isn't an error.
+        if (!ensure_path_exists (cache_path) || full_file_write (str_data(&cache), str_len(&cache), cache_path)) {
+            fprintf (stderr, ECMA_YELLOW("warning:") " could not store partial read sizes in %s\n", cache_path);
+        }
+        str_free (&cache);
+    }
+
+    mem_pool_destroy (&pool_l);
+    mem_pool_destroy (&partial_reads->pool);
+}
+
+///////////////////////////////
+// Sample signatures
+//
+// Files with the same partial hash often only share their headers, like HEIF
+// files from the same camera or JPEG files with the same Exif preamble. Before
+// they are read in full, they are split again by a signature that hashes the
+// file size and SAMPLE_SIGNATURE_SIZE bytes from the start, the middle and the
+// end of the file. A file with a unique signature can't have a duplicate, so
+// only groups that still have more than one file are compared in full.
+//
+// Files shorter than the three samples are hashed completely.
+
+#define SAMPLE_SIGNATURE_SIZE kilobyte(16)
+
+// buff must have space for 3*SAMPLE_SIGNATURE_SIZE bytes. After returning it
+// starts with the first bytes of the file.
+bool file_sample_signature (char *path, char *buff, uint64_t *signature, uint64_t *file_size, uint64_t *bytes_read)
+{
+    *bytes_read = 0;
+    *file_size = 0;
+
+    int file = open (path, O_RDONLY);
+    trace_count (TRACE_COUNTER_OPEN, 1);
+    if (file == -1) {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    trace_count (TRACE_COUNTER_STAT, 1);
+    bool success = fstat (file, &st) == 0;
+    if (success) {
+        uint64_t size = st.st_size;
+        *file_size = size;
+
+        uint64_t offsets[3] = {0};
+        uint64_t lens[3] = {0};
+        if (size <= 3*SAMPLE_SIGNATURE_SIZE) {
+            lens[0] = size;
+        } else {
+            offsets[1] = size/2 - SAMPLE_SIGNATURE_SIZE/2;
+            offsets[2] = size - SAMPLE_SIGNATURE_SIZE;
+            lens[0] = lens[1] = lens[2] = SAMPLE_SIGNATURE_SIZE;
+        }
+
+        meow_state state;
+        MeowBegin (&state, MeowDefaultSeed);
+        MeowAbsorb (&state, sizeof(size), &size);
+        for (int i=0; success && i<ARRAY_SIZE(offsets) && lens[i] > 0; i++) {
+            uint64_t len;
+            char *part = buff + *bytes_read;
+            success = file_pread_full (file, part, lens[i], offsets[i], &len);
+            MeowAbsorb (&state, len, part);
+            *bytes_read += len;
+        }
+        *signature = MeowU64From (MeowEnd (&state, NULL), 0);
+    }
+
+    if (!success) {
+        printf ("Error reading %s: %s\n", path, strerror(errno));
+    }
+
+    close (file);
+    return success;
+}
+
+struct file_signature_t {
+    uint64_t signature;
+    uint64_t bytes_read;
+    struct file_header_t *file;
+};
+templ_radix_sort (file_signature_sort, struct file_signature_t, a->signature);
+
+// Splits buckets of tentative duplicates by sample signature and returns the
+// groups that have more than one file, the number of files in them is stored
+// in num_files. Buckets and files keep their order.
+//
+// Files left alone are counted as false positives of the partial read and
+// returned in unique, each one in its own bucket like the full comparison
+// does.
+struct file_bucket_t* sample_signature_duplicates (struct scrapbook_t *sb, struct partial_reads_t *partial_reads,
+                                                   struct file_bucket_t *buckets, uint64_t *num_files,
+                                                   struct file_bucket_t **unique)
+{
+    TRACE_SCOPE ("sample_signature");
+
+    mem_pool_t pool_l = {0};
+    char *buff = mem_pool_push_size (&pool_l, 3*SAMPLE_SIGNATURE_SIZE);
+
+    struct file_bucket_t *duplicates = NULL, *duplicates_end = NULL;
+    uint64_t duplicates_len = 0;
+    progress_begin (&sb->progress, "Files sampled: ", *num_files);
+    while (buckets != NULL) {
+        struct file_bucket_t *curr_bucket = LINKED_LIST_POP (buckets);
+
+        mem_pool_marker_t mrk = mem_pool_begin_temporary_memory (&pool_l);
+        struct file_signature_t *signatures =
+            mem_pool_push_array (&pool_l, curr_bucket->count, struct file_signature_t);
+        int signatures_len = 0;
+
+        // Files in the bucket share their partial read, so they have the
+        // same type.
+        struct partial_read_type_t *type = NULL;
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, curr_bucket->strings) {
+            struct file_signature_t *signature = &signatures[signatures_len];
+            signature->file = curr_file;
+
+            uint64_t file_size;
+            if (file_sample_signature (str_data(&curr_file->path), buff, &signature->signature,
+                                       &file_size, &signature->bytes_read)) {
+                curr_file->size = file_size;
+                signatures_len++;
+
+                if (type == NULL) {
+                    bool is_container;
+                    char *type_name = partial_read_detect_type ((uint8_t*)buff, signature->bytes_read, &is_container);
+                    type = &partial_reads->types[partial_reads_type_idx (partial_reads, type_name, is_container)];
+                }
+            }
+            progress_add (&sb->progress, 1, signature->bytes_read);
+        }
+
+        file_signature_sort (signatures, signatures_len);
+
+        bool bucket_split = false;
+        int run_start = 0;
+        while (run_start < signatures_len) {
+            int run_end = run_start + 1;
+            while (run_end < signatures_len && signatures[run_end].signature == signatures[run_start].signature) {
+                run_end++;
+            }
+
+            struct file_bucket_t *bucket = mem_pool_push_struct (&sb->buckets_pool, struct file_bucket_t);
+            *bucket = ZERO_INIT (struct file_bucket_t);
+            bucket->hash = curr_bucket->hash;
+
+            // The radix sort is stable, files of a run are in bucket order.
+            struct file_header_t *strings = NULL, *strings_end = NULL;
+            for (int i=run_start; i<run_end; i++) {
+                signatures[i].file->next = NULL;
+                LINKED_LIST_APPEND (strings, signatures[i].file);
+                bucket->count++;
+            }
+            bucket->strings = strings;
+
+            if (bucket->count > 1) {
+                duplicates_len += bucket->count;
+                LINKED_LIST_APPEND (duplicates, bucket);
+
+            } else {
+                LINKED_LIST_PUSH (*unique, bucket);
+
+                bucket_split = true;
+                if (type != NULL) {
+                    type->false_positive_files++;
+                    type->false_positive_bytes += signatures[run_start].bytes_read;
+                }
+            }
+
+            run_start = run_end;
+        }
+
+        if (bucket_split && type != NULL) {
+            type->split_buckets++;
+        }
+
+        mem_pool_end_temporary_memory (mrk);
+    }
+    progress_end (&sb->progress);
+    mem_pool_destroy (&pool_l);
+
+    *num_files = duplicates_len;
+    return duplicates;
+}
+
+// Finds duplicates that are identical at file level.
+//
+// When a file has multiple duplicates we automatically decide which one to
+// remove according to the criteria of file_relevance_key(). Any path that
+// contains remove_substr as substring will be prefered for removal over one
+// that doesn't contaín it.
+//
+// Files are first grouped by the hash of a sample of their content, then by
+// their sample signature, see the sections above.
+struct file_bucket_t* find_file_duplicates (struct scrapbook_t *sb, struct file_header_t *files)
+{
+    TRACE_SCOPE ("find_file_duplicates");
+
+    struct partial_reads_t partial_reads;
+    partial_reads_begin (&partial_reads, sb->partial_read_size);
+
+    mem_pool_t pool_l = {0};
+    struct trace_scope_t partial_hash_scope = trace_scope_begin ("partial_hash");
+    progress_begin (&sb->progress, "Files processed: ", file_list_len (files));
+    struct file_header_t *curr_str = files;
+    while (curr_str != NULL) {
+        sb->processed_files++;
+
+        uint64_t file_len = 0;
+        char *fname = str_data(&curr_str->path);
+
+        // Files that can't be read are left out, otherwise they would all
+        // be grouped together as duplicates.
+        uint64_t hash;
+        int type_idx = partial_reads_hash (&partial_reads, fname, &pool_l, &hash, &file_len);
+        if (type_idx != -1) {
+            sb->total_size += file_len;
+            partial_reads.types[type_idx].files++;
+            partial_reads.types[type_idx].bytes_read += file_len;
+            push_file_hash (sb, hash, fname);
+        }
+
+        mem_pool_reset (&pool_l);
+        curr_str = curr_str->next;
+        progress_add (&sb->progress, 1, file_len);
+    }
+    progress_end (&sb->progress);
+    mem_pool_destroy (&pool_l);
+    trace_scope_end (&partial_hash_scope);
+
+    printf ("Total files read: %lu\n", sb->processed_files);
+    printf ("Total size read: %lu bytes\n", sb->total_size);
+
+    uint64_t num_tentative_non_unique_files;
+    struct file_bucket_t *tentative_duplicates = file_hash_duplicates (sb, &num_tentative_non_unique_files);
+    printf ("Tentative non unique file count: %lu\n", num_tentative_non_unique_files);
+
+    struct file_bucket_t *sampled_unique = NULL;
+    if (num_tentative_non_unique_files > 0) {
+        tentative_duplicates = sample_signature_duplicates (sb, &partial_reads, tentative_duplicates,
+                                                            &num_tentative_non_unique_files, &sampled_unique);
+        printf ("Non unique file count after sampling: %lu\n", num_tentative_non_unique_files);
+    }
+
+    // Unique files found by sampling are kept as single file buckets, same as
+    // the ones left by the full comparison.
+    struct file_bucket_t *exact_duplicates = sampled_unique;
+    uint64_t exact_duplicates_len = 0;
+    if (num_tentative_non_unique_files > 0) {
+        TRACE_SCOPE ("full_compare");
+
+        printf ("\n");
+        printf ("Executing full comparison\n");
+
+        bool had_to_split_buckets = false;
+        while (tentative_duplicates != NULL)
+        {
+            struct file_bucket_t *curr_bucket = LINKED_LIST_POP(tentative_duplicates);
+
+            mem_pool_t pool_l = {0};
+
+            // Load all files in the bucket into memory
+            //
+            // TODO: If the cumulative size of files in the bucket is too big
+            // we will run out of memory. This can happen if for instance the
+            // partial equality test is done with a short size and all files
+            // pass as being equal (for example comparing less that 5 bytes of
+            // JPG files). In such case, we should bail out of this algorithm
+            // and move to one where files are sorted but only loaded into
+            // memory for each comparison. Ideally we should have a bucket size
+            // limit as a parameter and preemptively execute the correct
+            // algorithm, not wait until we run out of memory.
+            uint64_t bucket_bytes = 0;
+            LINKED_LIST_FOR (struct file_header_t*, curr_file, curr_bucket->strings) {
+                curr_file->data = full_file_read (&pool_l, str_data(&curr_file->path), &curr_file->size);
+                curr_file->status = FILE_HEADER_LOADED;
+                bucket_bytes += curr_file->size;
+
+                trace_count (TRACE_COUNTER_OPEN, 1);
+                trace_count (TRACE_COUNTER_READ, 1);
+                trace_count (TRACE_COUNTER_BYTES_READ, curr_file->size);
+            }
+
+            int bucket_type_idx = -1;
+            if (curr_bucket->strings->data != NULL) {
+                bool is_container;
+                char *type_name = partial_read_detect_type ((uint8_t*)curr_bucket->strings->data,
+                                                            curr_bucket->strings->size, &is_container);
+                bucket_type_idx = partial_reads_type_idx (&partial_reads, type_name, is_container);
+            }
+
+            // Sort files by comparing their content
+            // This is O(n log(n)) on the size of the bucket and each performed
+            // operation is a full file comparison, which can be slow.
+            if (bucket_bytes >= FILE_EQUALITY_PARALLEL_MIN_BYTES) {
+                file_equality_sort_parallel (&curr_bucket->strings, curr_bucket->count, 0);
+            } else {
+                file_equality_sort (&curr_bucket->strings, curr_bucket->count);
+            }
+
+            // Split bucket if there are non-equal files in it
+            //
+            // TODO: This makes O(n) full file comparisons which can get
+            // expensive. Is there a way we can use comparisons made during
+            // sorting and just require making O(n) fast comparisons here
             // instead of the full file?. Maybe using a stable sort and marking
             // when a comparison results in a difference we can get the points
             // at which a sequence of equal files ends. Still, stable sorting
@@ -631,6 +1512,8 @@ struct file_bucket_t* find_file_duplicates (struct scrapbook_t *sb, struct file_
             // 3-way compare, so maybe it would be faster because we would avoid
             // calling memcmp from 2 places.
             uint64_t equal_file_run_len = 1;
+            struct file_bucket_t *prev_exact_duplicates = exact_duplicates;
+            bool bucket_split = false;
             curr_file = curr_bucket->strings;
             while (curr_file != NULL && curr_file->next != NULL) {
                 uint64_t f1_len = curr_file->size;
@@ -644,12 +1527,15 @@ struct file_bucket_t* find_file_duplicates (struct scrapbook_t *sb, struct file_
 
                 if (f1_len != f2_len || memcmp (f1, f2, f1_len) != 0) {
                     had_to_split_buckets = true;
+                    bucket_split = true;
+                    trace_count (TRACE_COUNTER_HASH_COLLISIONS, 1);
 
                     struct file_bucket_t *new_bucket =
-                        mem_pool_push_struct (&sb->hash_to_path.pool, struct file_bucket_t);
+                        mem_pool_push_struct (&sb->buckets_pool, struct file_bucket_t);
                     *new_bucket = ZERO_INIT (struct file_bucket_t);
                     new_bucket->strings = curr_bucket->strings;
                     new_bucket->count = equal_file_run_len;
+                    new_bucket->hash = curr_bucket->hash;
 
                     curr_bucket->strings = new_first_file;
                     curr_bucket->count -= equal_file_run_len;
@@ -677,6 +1563,21 @@ struct file_bucket_t* find_file_duplicates (struct scrapbook_t *sb, struct file_
             LINKED_LIST_PUSH (exact_duplicates, curr_bucket);
             exact_duplicates_len += curr_bucket->count;
 
+            // Files left alone after the split are the false positives of the
+            // partial read. Files in the bucket share their sample, so they
+            // have the same type.
+            if (bucket_split && bucket_type_idx != -1) {
+                struct partial_read_type_t *type = &partial_reads.types[bucket_type_idx];
+                type->split_buckets++;
+
+                for (struct file_bucket_t *b = exact_duplicates; b != prev_exact_duplicates; b = b->next) {
+                    if (b->count == 1) {
+                        type->false_positive_files++;
+                        type->false_positive_bytes += b->strings->size;
+                    }
+                }
+            }
+
             mem_pool_destroy (&pool_l);
 
             cli_progress_bar (exact_duplicates_len, num_tentative_non_unique_files);
@@ -686,10 +1587,12 @@ struct file_bucket_t* find_file_duplicates (struct scrapbook_t *sb, struct file_
         if (had_to_split_buckets) {
             printf (ECMA_YELLOW("warning:") " non-equal files passed the partial equality test by hash. "
                     "Either there was a hash collision or the content of the file was "
-                    "the same only up to a certain point.\n\n");
+                    "the same only up to a certain point.\n");
         }
     }
 
+    partial_reads_print (&partial_reads);
+    partial_reads_end (&partial_reads);
     return exact_duplicates;
 }
 
@@ -712,8 +1615,11 @@ void push_file_path (mem_pool_t *pool, struct str_to_str_list_tree_t *filename_t
 // Finds files with the same name.
 struct file_bucket_t* find_file_name_duplicates (struct scrapbook_t *sb, struct file_header_t *files)
 {
+    TRACE_SCOPE ("find_file_name_duplicates");
+
     struct str_to_str_list_tree_t filename_to_path = {0};
 
+    progress_begin (&sb->progress, "Files processed: ", file_list_len (files));
     struct file_header_t *curr_str = files;
     while (curr_str != NULL) {
         sb->processed_files++;
@@ -722,9 +1628,9 @@ struct file_bucket_t* find_file_name_duplicates (struct scrapbook_t *sb, struct
         push_file_path (&sb->pool, &filename_to_path, fname);
 
         curr_str = curr_str->next;
-        cli_status ("Files processed: ", sb->processed_files);
+        progress_add (&sb->progress, 1, 0);
     }
-    cli_status_end ();
+    progress_end (&sb->progress);
 
     printf ("Total files: %lu\n", sb->processed_files);
 
@@ -750,9 +1656,12 @@ struct file_bucket_t* find_file_name_duplicates (struct scrapbook_t *sb, struct
 // metadata (exif tags) have changed.
 struct file_bucket_t* find_image_duplicates (struct scrapbook_t *sb, struct file_header_t *files)
 {
+    TRACE_SCOPE ("find_image_duplicates");
+
+    mem_pool_t pool_l = {0};
+    progress_begin (&sb->progress, "Files processed: ", file_list_len (files));
     struct file_header_t *curr_str = files;
     while (curr_str != NULL) {
-        mem_pool_t pool_l = {0};
         sb->processed_files++;
 
         uint64_t file_len = 0;
@@ -762,31 +1671,19 @@ struct file_bucket_t* find_image_duplicates (struct scrapbook_t *sb, struct file
 
         push_file_hash (sb, hash_64 (file_data, file_len), fname);
 
-        mem_pool_destroy (&pool_l);
+        mem_pool_reset (&pool_l);
         curr_str = curr_str->next;
-        cli_status ("Files processed: ", sb->processed_files);
+        progress_add (&sb->progress, 1, file_len);
     }
-    cli_status_end ();
+    progress_end (&sb->progress);
+    mem_pool_destroy (&pool_l);
 
     printf ("Total files read: %lu\n", sb->processed_files);
     printf ("Total size read: %lu bytes\n", sb->total_size);
 
-    struct file_bucket_t *tentative_duplicates = NULL;
-    uint32_t num_tentative_non_unique_files = 0;
-    BINARY_TREE_FOR(uint64_to_str_list, &sb->hash_to_path, curr_node) {
-        struct file_bucket_t *bucket = curr_node->value;
-        if (bucket->count > 1) {
-            struct file_header_t *curr_path = bucket->strings;
-            while (curr_path != NULL) {
-                num_tentative_non_unique_files++;
-
-                curr_path = curr_path->next;
-            }
-
-            LINKED_LIST_PUSH (tentative_duplicates, bucket);
-        }
-    }
-    printf ("Tentative non unique file count: %d\n", num_tentative_non_unique_files);
+    uint64_t num_tentative_non_unique_files;
+    struct file_bucket_t *tentative_duplicates = file_hash_duplicates (sb, &num_tentative_non_unique_files);
+    printf ("Tentative non unique file count: %lu\n", num_tentative_non_unique_files);
 
     print_bucket_list (tentative_duplicates, PATH_FORMAT_FNAME);
     print_bucket_list (tentative_duplicates, PATH_FORMAT_ABSOLUTE);
@@ -827,6 +1724,7 @@ struct file_bucket_t* find_image_duplicates (struct scrapbook_t *sb, struct file
                 exact_duplicates_len += curr_bucket->count;
                 LINKED_LIST_PUSH (exact_duplicates, curr_bucket);
             } else {
+                trace_count (TRACE_COUNTER_HASH_COLLISIONS, 1);
                 non_duplicates_len += curr_bucket->count;
                 LINKED_LIST_PUSH (non_duplicates, curr_bucket);
             }
@@ -849,58 +1747,1400 @@ struct file_bucket_t* find_image_duplicates (struct scrapbook_t *sb, struct file
     return exact_duplicates;
 }
 
-void remove_duplicates (struct scrapbook_t *sb,
-                        struct file_bucket_t *bucket_list,
-                        char *remove_substr, char *removal_filter, bool is_dry_run)
+// Only JPEG and HEIF files have an image stream we can fingerprint, they are
+// recognized by their extension.
+bool is_image_stream_path (char *path, bool *is_heif)
 {
-    if (bucket_list == NULL) return;
+    char *extension = get_extension (path);
+    *is_heif = extension != NULL &&
+        (strcasecmp (extension, "heic") == 0 || strcasecmp (extension, "heif") == 0);
+    return *is_heif || (extension != NULL && strncasecmp (extension, "jpg", 3) == 0);
+}
 
-    // Sort each bucket and build a list of all files that will be removed.
-    // NOTE: This mutates the order of each bucket in the input list.
-    uint64_t num_buckets = 0;
-    struct file_header_t *files_to_remove = NULL;
-    uint64_t files_to_remove_len = 0;
-    LINKED_LIST_FOR (struct file_bucket_t*, curr_bucket, bucket_list) {
-        duplicate_relevance_sort_user_data (&curr_bucket->strings, curr_bucket->count, remove_substr);
+bool image_stream_fingerprint (char *path, bool is_heif, struct jpg_fingerprint_t *fingerprint, string_t *error_msg)
+{
+    return is_heif ?
+        heif_fingerprint (path, fingerprint, error_msg) :
+        jpg_fingerprint (path, fingerprint, error_msg);
+}
 
-        LINKED_LIST_FOR(struct file_header_t*, curr_str, curr_bucket->strings->next) {
-            if (removal_filter == NULL ||
-                strstr(str_data(&curr_str->path), removal_filter) == str_data(&curr_str->path))
-            {
-                LINKED_LIST_PUSH_NEW (&sb->pool, struct file_header_t, files_to_remove, new_string);
-                files_to_remove_len++;
-                str_set(&new_string->path, str_data(&curr_str->path));
-            }
-        }
+// Finds JPEG files with the same image stream, that is, the same frame
+// headers, tables and entropy coded data, but possibly different APPn or COM
+// segments. These are usually copies where only the metadata was edited. No
+// image data is decoded, each file is read once in a single streaming pass.
+//
+// HEIF files are compared by the coded data of their primary image.
+//
+// Groups are only reported, removing a copy would lose its metadata.
+struct file_bucket_t* find_image_stream_duplicates (struct scrapbook_t *sb, struct file_header_t *files)
+{
+    TRACE_SCOPE ("find_image_stream_duplicates");
 
-        num_buckets++;
-    }
+    mem_pool_t pool_l = {0};
+    uint64_t *file_hashes = NULL;
+    int file_hashes_len = 0;
+    int file_hashes_size = 0;
+    DYNAMIC_ARRAY_INIT (&pool_l, file_hashes, 0);
+    uint64_t failed_files = 0;
+
+    string_t error_msg = {0};
+    progress_begin (&sb->progress, "Files processed: ", 0);
+    LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+        char *fname = str_data(&curr_file->path);
+
+        bool is_heif;
+        if (!is_image_stream_path (fname, &is_heif)) {
+            continue;
+        }
+        sb->processed_files++;
 
-    printf ("Unique files: %ld\n", num_buckets);
-    printf ("Files to be removed: %ld\n", files_to_remove_len);
-    printf ("\n");
+        struct jpg_fingerprint_t fingerprint;
+        if (image_stream_fingerprint (fname, is_heif, &fingerprint, &error_msg)) {
+            push_file_hash (sb, fingerprint.image_hash, fname);
+            DYNAMIC_ARRAY_APPEND (file_hashes, fingerprint.file_hash);
 
-    // Print the list of files to be removed
-    if (files_to_remove_len > 0) {
-        LINKED_LIST_FOR (struct file_header_t*, curr_str, files_to_remove) {
-            printf ("D '%s'\n", str_data(&curr_str->path));
+        } else {
+            failed_files++;
+            fprintf (stderr, "\r\e[K" ECMA_RED("error:") " %s: %s\n", fname, str_data(&error_msg));
         }
-        printf ("\n");
-    }
 
-    // Actually remove all duplicate files
-    if (!is_dry_run) {
-        LINKED_LIST_FOR (struct file_header_t*, curr_str, files_to_remove) {
-            unlink (str_data(&curr_str->path));
+        progress_add (&sb->progress, 1, 0);
+    }
+    progress_end (&sb->progress);
+    str_free (&error_msg);
+
+    uint64_t byte_identical_files = 0;
+    uint64_radix_sort (file_hashes, file_hashes_len);
+    for (int i=1; i<file_hashes_len; i++) {
+        if (file_hashes[i] == file_hashes[i-1]) {
+            byte_identical_files++;
         }
     }
+    mem_pool_destroy (&pool_l);
+
+    printf ("Total files read: %lu\n", sb->processed_files);
+    printf ("Failed files: %lu\n", failed_files);
+
+    uint64_t duplicates_len;
+    struct file_bucket_t *duplicates = file_hash_duplicates (sb, &duplicates_len);
+    printf ("Image stream duplicates: %lu\n", duplicates_len);
+
+    // Files whose full content matched an earlier file. The rest of the
+    // duplicates differ only in metadata.
+    printf ("Byte identical files: %lu\n", byte_identical_files);
+    printf ("\n");
+
+    return duplicates;
 }
 
-void print_hex_bytes (void *data, uint64_t data_len)
+// Finds pictures taken with iOS devices that have the same identifiers in their
+// MakerNote. Only the Exif metadata of each file is read, so this is much
+// cheaper than hashing content. The key is ImageUniqueID, or if it's missing,
+// ContentIdentifier together with the capture date.
+//
+// Files without these identifiers are grouped by their image stream, like in
+// find_image_stream_duplicates().
+//
+// Edited exports and re-encodes keep the identifiers of the original, so
+// groups aren't made of equal files. They are only reported, like in
+// find_image_stream_duplicates().
+struct file_bucket_t* find_apple_id_duplicates (struct scrapbook_t *sb, struct file_header_t *files)
 {
-    for (uint32_t value_idx = 0; value_idx < data_len; value_idx++) {
-        uint8_t byte = ((uint8_t*)data)[value_idx];
-        printf ("%.2X", byte);
+    TRACE_SCOPE ("find_apple_id_duplicates");
+
+    uint64_t keyed_files = 0;
+    uint64_t fingerprinted_files = 0;
+    uint64_t failed_files = 0;
+
+    string_t key = {0};
+    string_t error_msg = {0};
+    progress_begin (&sb->progress, "Files processed: ", 0);
+    mem_pool_t pool_l = {0};
+    LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+        char *fname = str_data(&curr_file->path);
+
+        bool is_heif;
+        if (!is_image_stream_path (fname, &is_heif)) {
+            continue;
+        }
+        sb->processed_files++;
+
+        struct exif_fields_t fields;
+        bool has_fields = is_heif ?
+            heif_read_exif_fields (fname, &pool_l, &fields, NULL) :
+            jpg_read_exif_fields (fname, &pool_l, &fields, NULL);
+
+        str_set (&key, "");
+        if (has_fields && fields.apple_image_unique_id != NULL) {
+            str_cat_printf (&key, "ImageUniqueID:%s", fields.apple_image_unique_id);
+
+        } else if (has_fields && fields.apple_content_identifier != NULL && fields.date_time != NULL) {
+            str_cat_printf (&key, "ContentIdentifier:%s@%s", fields.apple_content_identifier, fields.date_time);
+        }
+        mem_pool_reset (&pool_l);
+
+        struct jpg_fingerprint_t fingerprint;
+        if (str_len (&key) > 0) {
+            keyed_files++;
+            push_file_hash (sb, hash_64_unpadded (str_data(&key), str_len(&key)), fname);
+
+        } else if (image_stream_fingerprint (fname, is_heif, &fingerprint, &error_msg)) {
+            fingerprinted_files++;
+            push_file_hash (sb, fingerprint.image_hash, fname);
+
+        } else {
+            failed_files++;
+            fprintf (stderr, "\r\e[K" ECMA_RED("error:") " %s: %s\n", fname, str_data(&error_msg));
+        }
+
+        progress_add (&sb->progress, 1, 0);
+    }
+    progress_end (&sb->progress);
+    str_free (&key);
+    str_free (&error_msg);
+    mem_pool_destroy (&pool_l);
+
+    printf ("Total files read: %lu\n", sb->processed_files);
+    printf ("Keyed by Apple identifiers: %lu\n", keyed_files);
+    printf ("Keyed by image stream: %lu\n", fingerprinted_files);
+    printf ("Failed files: %lu\n", failed_files);
+
+    uint64_t duplicates_len;
+    struct file_bucket_t *duplicates = file_hash_duplicates (sb, &duplicates_len);
+    printf ("Duplicates: %lu\n", duplicates_len);
+    printf ("\n");
+
+    return duplicates;
+}
+
+// Chunks that show up in more files than this are things like blocks of
+// zeros or common headers. They would add a pair for every two files that
+// contain them without telling us anything, so they are ignored. This also
+// bounds the pairs added by each chunk to C(16,2) = 120, so memory grows with
+// the number of chunks, not with the square of the number of files.
+#define OVERLAP_MAX_CHUNK_FILES 16
+
+struct chunk_file_t {
+    uint32_t file_idx;
+    struct chunk_file_t *next;
+};
+
+struct chunk_files_t {
+    uint64_t len;
+    uint32_t count;
+    struct chunk_file_t *files;
+};
+
+BINARY_TREE_NEW(chunk_to_files, uint64_t, struct chunk_files_t*, a <= b ? (a == b ? 0 : -1) : 1);
+BINARY_TREE_NEW(pair_to_size, uint64_t, uint64_t, a <= b ? (a == b ? 0 : -1) : 1);
+
+struct find_overlap_clsr_t {
+    struct chunk_to_files_tree_t *index;
+    uint32_t file_idx;
+    uint64_t chunk_count;
+};
+
+CDC_CHUNK_CB (push_file_chunk)
+{
+    struct find_overlap_clsr_t *clsr = (struct find_overlap_clsr_t*) data;
+    clsr->chunk_count++;
+
+    struct chunk_files_t *entry = chunk_to_files_get (clsr->index, chunk->hash);
+    if (entry == NULL) {
+        entry = mem_pool_push_struct (&clsr->index->pool, struct chunk_files_t);
+        *entry = ZERO_INIT (struct chunk_files_t);
+        entry->len = chunk->len;
+        chunk_to_files_tree_insert (clsr->index, chunk->hash, entry);
+    }
+
+    // Chunks of a file are pushed one after the other, so if this file
+    // already has the chunk it's at the head of the list. A chunk repeated
+    // inside a file is counted once.
+    if (entry->files == NULL || entry->files->file_idx != clsr->file_idx) {
+        LINKED_LIST_PUSH_NEW (&clsr->index->pool, struct chunk_file_t, entry->files, new_file);
+        new_file->file_idx = clsr->file_idx;
+        entry->count++;
+    }
+}
+
+struct overlap_pair_t {
+    uint64_t shared_size;
+    struct file_header_t *a;
+    struct file_header_t *b;
+
+    struct overlap_pair_t *next;
+};
+
+templ_sort_ll (overlap_pair_sort, struct overlap_pair_t, a->shared_size > b->shared_size);
+
+// Splits files into content defined chunks and lists pairs of files that
+// share chunks, sorted by the number of shared bytes. Unlike hashing
+// whole files or prefixes this finds trimmed or partially copied files.
+void print_file_overlap (struct scrapbook_t *sb, struct file_header_t *files)
+{
+    TRACE_SCOPE ("find_overlap");
+
+    mem_pool_t pool_l = {0};
+
+    uint64_t files_len = file_list_len (files);
+    struct file_header_t **file_arr = mem_pool_push_array (&pool_l, files_len, struct file_header_t*);
+
+    struct chunk_to_files_tree_t index = {0};
+    struct find_overlap_clsr_t clsr = {0};
+    clsr.index = &index;
+
+    string_t error_msg = {0};
+    progress_begin (&sb->progress, "Files processed: ", files_len);
+    LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+        char *fname = str_data(&curr_file->path);
+        sb->processed_files++;
+
+        curr_file->size = 0;
+        if (cdc_file_chunks (fname, push_file_chunk, &clsr, &curr_file->size, &error_msg)) {
+            sb->total_size += curr_file->size;
+        } else {
+            fprintf (stderr, "\r\e[K" ECMA_RED("error:") " %s: %s\n", fname, str_data(&error_msg));
+        }
+
+        file_arr[clsr.file_idx++] = curr_file;
+        progress_add (&sb->progress, 1, curr_file->size);
+    }
+    progress_end (&sb->progress);
+    str_free (&error_msg);
+
+    // Add the size of each shared chunk to every pair of files containing it.
+    struct pair_to_size_tree_t shared_sizes = {0};
+    uint64_t ignored_chunks = 0;
+    BINARY_TREE_FOR(chunk_to_files, &index, curr_node) {
+        struct chunk_files_t *entry = curr_node->value;
+        if (entry->count < 2) continue;
+
+        if (entry->count > OVERLAP_MAX_CHUNK_FILES) {
+            ignored_chunks++;
+            continue;
+        }
+
+        for (struct chunk_file_t *f1 = entry->files; f1 != NULL; f1 = f1->next) {
+            for (struct chunk_file_t *f2 = f1->next; f2 != NULL; f2 = f2->next) {
+                uint64_t key = ((uint64_t)MIN(f1->file_idx, f2->file_idx) << 32) | MAX(f1->file_idx, f2->file_idx);
+
+                struct pair_to_size_tree_node_t *node;
+                if (pair_to_size_tree_lookup (&shared_sizes, key, &node)) {
+                    node->value += entry->len;
+                } else {
+                    pair_to_size_tree_insert (&shared_sizes, key, entry->len);
+                }
+            }
+        }
+    }
+
+    struct overlap_pair_t *pairs = NULL;
+    uint64_t pairs_len = 0;
+    BINARY_TREE_FOR(pair_to_size, &shared_sizes, curr_pair_node) {
+        LINKED_LIST_PUSH_NEW (&pool_l, struct overlap_pair_t, pairs, new_pair);
+        new_pair->shared_size = curr_pair_node->value;
+        new_pair->a = file_arr[curr_pair_node->key >> 32];
+        new_pair->b = file_arr[curr_pair_node->key & 0xFFFFFFFF];
+        pairs_len++;
+    }
+    overlap_pair_sort (&pairs, pairs_len);
+
+    printf ("Total files read: %lu\n", sb->processed_files);
+    printf ("Total size read: %lu bytes\n", sb->total_size);
+    printf ("Chunks: %lu (%u unique)\n", clsr.chunk_count, index.num_nodes);
+    if (ignored_chunks > 0) {
+        printf ("Chunks shared by more than %d files (ignored): %lu\n", OVERLAP_MAX_CHUNK_FILES, ignored_chunks);
+    }
+    printf ("Overlapping pairs: %lu\n", pairs_len);
+
+    LINKED_LIST_FOR (struct overlap_pair_t*, curr_pair, pairs) {
+        printf ("\n");
+        printf ("%lu bytes shared (%.1f%% of first, %.1f%% of second)\n", curr_pair->shared_size,
+                100.0*curr_pair->shared_size/curr_pair->a->size,
+                100.0*curr_pair->shared_size/curr_pair->b->size);
+        printf ("  '%s'\n", str_data(&curr_pair->a->path));
+        printf ("  '%s'\n", str_data(&curr_pair->b->path));
+    }
+
+    pair_to_size_tree_destroy (&shared_sizes);
+    chunk_to_files_tree_destroy (&index);
+    mem_pool_destroy (&pool_l);
+}
+
+// Buffers used to stream whole files, reused across calls.
+struct buff_recycler_t g_io_buffs = BUFF_RECYCLER_INIT(megabyte(1));
+
+bool fd_read_full (int file, char *buff, uint64_t len)
+{
+    uint64_t bytes_read = 0;
+    while (bytes_read < len) {
+        ssize_t status = read (file, buff + bytes_read, len - bytes_read);
+        trace_count (TRACE_COUNTER_READ, 1);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        } else if (status <= 0) {
+            return false;
+        }
+        bytes_read += status;
+    }
+    trace_count (TRACE_COUNTER_BYTES_READ, bytes_read);
+
+    return true;
+}
+
+// Compares the content of two files without loading them completely into
+// memory. Returns false if they differ or if one of them can't be read.
+bool file_content_equal (char *path_a, char *path_b, string_t *error_msg)
+{
+    bool is_equal = false;
+
+    int file_a = open (path_a, O_RDONLY);
+    int file_b = open (path_b, O_RDONLY);
+    trace_count (TRACE_COUNTER_OPEN, 2);
+    trace_count (TRACE_COUNTER_STAT, 2);
+    struct stat st_a, st_b;
+    if (file_a == -1 || file_b == -1 || fstat (file_a, &st_a) != 0 || fstat (file_b, &st_b) != 0) {
+        if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+
+    } else if (st_a.st_size == st_b.st_size) {
+        uint64_t buff_size = g_io_buffs.buff_size;
+        char *buff_a = buff_recycler_get (&g_io_buffs);
+        char *buff_b = buff_recycler_get (&g_io_buffs);
+
+        is_equal = true;
+        uint64_t remaining = st_a.st_size;
+        while (is_equal && remaining > 0) {
+            uint64_t len = MIN(remaining, buff_size);
+            if (!fd_read_full (file_a, buff_a, len) || !fd_read_full (file_b, buff_b, len)) {
+                if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+                is_equal = false;
+
+            } else if (memcmp (buff_a, buff_b, len) != 0) {
+                if (error_msg != NULL) str_set (error_msg, "content differs");
+                is_equal = false;
+            }
+
+            remaining -= len;
+        }
+
+        buff_recycler_put (&g_io_buffs, buff_a);
+        buff_recycler_put (&g_io_buffs, buff_b);
+
+    } else {
+        if (error_msg != NULL) str_set (error_msg, "size differs");
+    }
+
+    if (file_a != -1) close (file_a);
+    if (file_b != -1) close (file_b);
+    return is_equal;
+}
+
+#define LINK_MODE_TABLE            \
+    LINK_MODE_ROW(NONE,     NULL)       \
+    LINK_MODE_ROW(HARDLINK, "hardlink") \
+    LINK_MODE_ROW(REFLINK,  "reflink")  \
+    LINK_MODE_ROW(SYMLINK,  "symlink")
+
+#define LINK_MODE_ROW(SYMBOL,NAME) LINK_MODE_ ## SYMBOL,
+enum link_mode_t {
+    LINK_MODE_TABLE
+};
+#undef LINK_MODE_ROW
+
+#define LINK_MODE_ROW(SYMBOL,NAME) NAME,
+char *g_link_mode_names[] = {
+    LINK_MODE_TABLE
+};
+#undef LINK_MODE_ROW
+
+bool link_mode_from_str (char *str, enum link_mode_t *mode)
+{
+    for (int i=0; i<ARRAY_SIZE(g_link_mode_names); i++) {
+        if (g_link_mode_names[i] != NULL && strcmp (str, g_link_mode_names[i]) == 0) {
+            *mode = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Replaces the file at path with a link to target. The link is created
+// with a temporary name in the same directory and then renamed over path,
+// so path always exists and has the same content.
+//
+// A reflink is a copy that shares the data blocks of target until one of
+// them is modified, it needs a filesystem that supports FICLONE like btrfs
+// or XFS. Unlike hardlinks, editing one of the copies doesn't change the
+// other.
+bool replace_with_link (char *path, char *target, enum link_mode_t mode, string_t *error_msg)
+{
+    assert (mode != LINK_MODE_NONE);
+
+    string_t tmp_path = {0};
+    str_set_printf (&tmp_path, "%s.scrapbook-%d", path, getpid());
+
+    bool success = true;
+    if (mode == LINK_MODE_HARDLINK) {
+        success = link (target, str_data(&tmp_path)) == 0;
+
+    } else if (mode == LINK_MODE_SYMLINK) {
+        success = symlink (target, str_data(&tmp_path)) == 0;
+
+    } else if (mode == LINK_MODE_REFLINK) {
+        struct stat st;
+        int src = open (target, O_RDONLY);
+        int dst = -1;
+        success = src != -1 && stat (path, &st) == 0;
+        if (success) {
+            dst = open (str_data(&tmp_path), O_WRONLY|O_CREAT|O_EXCL, st.st_mode & 07777);
+            success = dst != -1 && ioctl (dst, FICLONE, src) == 0;
+        }
+
+        if (src != -1) close (src);
+        if (dst != -1) close (dst);
+    }
+
+    trace_count (TRACE_COUNTER_LINK, 1);
+    if (!success) {
+        if (error_msg != NULL) str_set_printf (error_msg, "could not create %s: %s", g_link_mode_names[mode], strerror(errno));
+
+    } else if (rename (str_data(&tmp_path), path) != 0) {
+        if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+        success = false;
+    }
+
+    if (!success) {
+        // If the reflink failed the temporary file may have been created.
+        unlink (str_data(&tmp_path));
+    }
+
+    str_free (&tmp_path);
+    return success;
+}
+
+// Removals are planned before anything is touched. Each entry records the
+// identity of the file at planning time, right before acting on it the file
+// is checked again and skipped if it changed. If --verify-hash is passed, the
+// content hash is checked too.
+//
+// Entries can be written to a journal before any file is removed, each
+// finished entry is then appended as a separate line. If a run is
+// interrupted, --resume reads the journal and continues with the entries that
+// weren't finished. An existing journal is never overwritten, it may have
+// unfinished entries.
+//
+// Journal format, one record per line and fields separated by tabs:
+//
+//   SBJOURNAL 1
+//   I IDX MODE DEV INO SIZE MTIME_NS HASH PATH TARGET    (planned)
+//   C IDX                                                (done)
+//   S IDX                                                (skipped)
+//
+// HASH is "-" if it wasn't computed. In PATH and TARGET backslashes, tabs and
+// newlines are escaped as \\, \t and \n. An incomplete last line, from a crash
+// while writing it, is ignored.
+#define REMOVAL_JOURNAL_MAGIC "SBJOURNAL 1"
+
+struct removal_entry_t {
+    uint64_t idx;
+    enum link_mode_t link_mode;
+    string_t path;
+    string_t target;
+
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    bool has_hash;
+    uint64_t hash;
+
+    bool is_done;
+    struct removal_entry_t *next;
+};
+
+// Compares directories first so removals are grouped by directory.
+int removal_entry_cmp (struct removal_entry_t *a, struct removal_entry_t *b)
+{
+    char *path_a = str_data(&a->path);
+    char *path_b = str_data(&b->path);
+    char *base_a = strrchr (path_a, '/');
+    char *base_b = strrchr (path_b, '/');
+    uint64_t dir_len_a = base_a != NULL ? base_a - path_a : 0;
+    uint64_t dir_len_b = base_b != NULL ? base_b - path_b : 0;
+
+    int c = memcmp (path_a, path_b, MIN(dir_len_a, dir_len_b));
+    if (c == 0 && dir_len_a != dir_len_b) {
+        c = dir_len_a < dir_len_b ? -1 : 1;
+    }
+    if (c == 0) {
+        c = strcmp (path_a + dir_len_a, path_b + dir_len_b);
+    }
+
+    return c;
+}
+
+templ_sort_ll (removal_entry_sort, struct removal_entry_t, removal_entry_cmp(a, b) < 0);
+
+bool file_hash_64 (char *path, uint64_t *hash, string_t *error_msg)
+{
+    int file = open (path, O_RDONLY);
+    trace_count (TRACE_COUNTER_OPEN, 1);
+    if (file == -1) {
+        if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+        return false;
+    }
+
+    bool success = true;
+    uint64_t buff_size = g_io_buffs.buff_size;
+    char *buff = buff_recycler_get (&g_io_buffs);
+
+    meow_state state;
+    MeowBegin (&state, MeowDefaultSeed);
+    while (true) {
+        ssize_t status = read (file, buff, buff_size);
+        trace_count (TRACE_COUNTER_READ, 1);
+        if (status == -1 && errno == EINTR) {
+            continue;
+
+        } else if (status == -1) {
+            if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+            success = false;
+            break;
+
+        } else if (status == 0) {
+            break;
+        }
+
+        MeowAbsorb (&state, status, buff);
+        trace_count (TRACE_COUNTER_BYTES_READ, status);
+    }
+    *hash = MeowU64From (MeowEnd (&state, NULL), 0);
+
+    buff_recycler_put (&g_io_buffs, buff);
+    close (file);
+    return success;
+}
+
+bool removal_entry_stat (struct removal_entry_t *entry, bool verify_hash, string_t *error_msg)
+{
+    struct stat st;
+    trace_count (TRACE_COUNTER_STAT, 1);
+    if (lstat (str_data(&entry->path), &st) != 0) {
+        if (error_msg != NULL) str_set_printf (error_msg, "%s", strerror(errno));
+        return false;
+    }
+
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+
+    entry->has_hash = verify_hash;
+    if (verify_hash) {
+        return file_hash_64 (str_data(&entry->path), &entry->hash, error_msg);
+    }
+
+    return true;
+}
+
+// Detects links that were already created by an interrupted run, but didn't
+// get marked as done in the journal. A missing file can't be told apart from
+// one removed by someone else, so removals are only done if the journal says
+// so, otherwise removal_entry_check() skips them.
+bool removal_entry_is_applied (struct removal_entry_t *entry)
+{
+    char *path = str_data(&entry->path);
+    char *target = str_data(&entry->target);
+
+    struct stat st_path, st_target;
+    if (entry->link_mode == LINK_MODE_HARDLINK) {
+        return lstat (path, &st_path) == 0 && stat (target, &st_target) == 0 &&
+            st_path.st_dev == st_target.st_dev && st_path.st_ino == st_target.st_ino;
+
+    } else if (entry->link_mode == LINK_MODE_SYMLINK) {
+        char link_target[PATH_MAX];
+        ssize_t len = readlink (path, link_target, sizeof(link_target)-1);
+        if (len == -1) return false;
+        link_target[len] = '\0';
+        return strcmp (link_target, target) == 0;
+    }
+
+    return false;
+}
+
+// Checks the file is still the one that was planned for removal and that the
+// copy we keep still exists.
+bool removal_entry_check (struct removal_entry_t *entry, string_t *error_msg)
+{
+    struct stat st;
+    if (stat (str_data(&entry->target), &st) != 0) {
+        if (error_msg != NULL) str_set_printf (error_msg, "kept file '%s' is missing", str_data(&entry->target));
+        return false;
+    }
+
+    struct removal_entry_t current = *entry;
+    if (!removal_entry_stat (&current, entry->has_hash, error_msg)) {
+        return false;
+    }
+
+    if (current.dev != entry->dev || current.ino != entry->ino ||
+        current.size != entry->size || current.mtime_ns != entry->mtime_ns) {
+        if (error_msg != NULL) str_set (error_msg, "file changed since removal was planned");
+        return false;
+    }
+
+    if (entry->has_hash && current.hash != entry->hash) {
+        if (error_msg != NULL) str_set (error_msg, "content hash changed since removal was planned");
+        return false;
+    }
+
+    return true;
+}
+
+void str_cat_journal_escaped (string_t *str, char *s)
+{
+    for (char *c = s; *c != '\0'; c++) {
+        if (*c == '\\') str_cat_c (str, "\\\\");
+        else if (*c == '\t') str_cat_c (str, "\\t");
+        else if (*c == '\n') str_cat_c (str, "\\n");
+        else strn_cat_c (str, c, 1);
+    }
+}
+
+void journal_unescape (char *s)
+{
+    char *dst = s;
+    for (char *c = s; *c != '\0'; c++) {
+        if (*c == '\\' && *(c+1) != '\0') {
+            c++;
+            if (*c == 't') *dst++ = '\t';
+            else if (*c == 'n') *dst++ = '\n';
+            else *dst++ = *c;
+
+        } else {
+            *dst++ = *c;
+        }
+    }
+    *dst = '\0';
+}
+
+void removal_journal_sync (FILE *journal)
+{
+    if (journal != NULL) {
+        fflush (journal);
+        fsync (fileno (journal));
+        trace_count (TRACE_COUNTER_FSYNC, 1);
+    }
+}
+
+void removal_journal_mark (FILE *journal, char type, struct removal_entry_t *entry)
+{
+    if (journal != NULL) {
+        fprintf (journal, "%c\t%lu\n", type, entry->idx);
+    }
+}
+
+bool removal_journal_write (FILE *journal, struct removal_entry_t *entries)
+{
+    string_t line = {0};
+    fprintf (journal, REMOVAL_JOURNAL_MAGIC "\n");
+    LINKED_LIST_FOR (struct removal_entry_t*, curr_entry, entries) {
+        str_set_printf (&line, "I\t%lu\t%d\t%lu\t%lu\t%lu\t%ld\t",
+                        curr_entry->idx, curr_entry->link_mode, curr_entry->dev,
+                        curr_entry->ino, curr_entry->size, curr_entry->mtime_ns);
+        if (curr_entry->has_hash) {
+            str_cat_printf (&line, "%lu\t", curr_entry->hash);
+        } else {
+            str_cat_c (&line, "-\t");
+        }
+        str_cat_journal_escaped (&line, str_data(&curr_entry->path));
+        str_cat_c (&line, "\t");
+        str_cat_journal_escaped (&line, str_data(&curr_entry->target));
+        str_cat_c (&line, "\n");
+
+        fputs (str_data(&line), journal);
+    }
+    str_free (&line);
+
+    removal_journal_sync (journal);
+    return !ferror (journal);
+}
+
+// Entries are allocated in pool, in journal order.
+struct removal_entry_t* removal_journal_load (mem_pool_t *pool, char *path, uint64_t *entries_len, string_t *error_msg)
+{
+    uint64_t data_len;
+    char *data = full_file_read (pool, path, &data_len);
+    if (data == NULL || strncmp (data, REMOVAL_JOURNAL_MAGIC "\n", strlen(REMOVAL_JOURNAL_MAGIC "\n")) != 0) {
+        if (error_msg != NULL) str_set (error_msg, "not a removal journal");
+        return NULL;
+    }
+
+    struct removal_entry_t *entries = NULL;
+    struct removal_entry_t *entries_end = NULL;
+    struct removal_entry_t **entry_arr = NULL;
+    bool has_done_records = false;
+    uint64_t len = 0;
+
+    char *line = data + strlen(REMOVAL_JOURNAL_MAGIC "\n");
+    char *line_end;
+    while ((line_end = strchr (line, '\n')) != NULL) {
+        *line_end = '\0';
+
+        char *fields[10];
+        int num_fields = 0;
+        for (char *field = line; field != NULL && num_fields < ARRAY_SIZE(fields); num_fields++) {
+            fields[num_fields] = field;
+            field = strchr (field, '\t');
+            if (field != NULL) *field++ = '\0';
+        }
+
+        if (fields[0][0] == 'I' && num_fields == 10) {
+            // entry_arr is sized for the planned entries read so far.
+            if (has_done_records) {
+                if (error_msg != NULL) str_set (error_msg, "planned entry after a done record");
+                return NULL;
+            }
+
+            LINKED_LIST_APPEND_NEW (pool, struct removal_entry_t, entries, new_entry);
+            new_entry->idx = strtoull (fields[1], NULL, 10);
+            new_entry->link_mode = strtol (fields[2], NULL, 10);
+            new_entry->dev = strtoull (fields[3], NULL, 10);
+            new_entry->ino = strtoull (fields[4], NULL, 10);
+            new_entry->size = strtoull (fields[5], NULL, 10);
+            new_entry->mtime_ns = strtoll (fields[6], NULL, 10);
+            new_entry->has_hash = strcmp (fields[7], "-") != 0;
+            if (new_entry->has_hash) new_entry->hash = strtoull (fields[7], NULL, 10);
+
+            journal_unescape (fields[8]);
+            journal_unescape (fields[9]);
+            str_set (&new_entry->path, fields[8]);
+            str_set (&new_entry->target, fields[9]);
+            len++;
+
+            if (new_entry->link_mode >= ARRAY_SIZE(g_link_mode_names) || new_entry->idx != len-1) {
+                if (error_msg != NULL) str_set (error_msg, "invalid planned entry");
+                return NULL;
+            }
+
+        } else if ((fields[0][0] == 'C' || fields[0][0] == 'S') && num_fields == 2) {
+            // Done records come after all planned ones.
+            has_done_records = true;
+            if (entry_arr == NULL) {
+                entry_arr = mem_pool_push_array (pool, len, struct removal_entry_t*);
+                uint64_t i = 0;
+                LINKED_LIST_FOR (struct removal_entry_t*, curr_entry, entries) {
+                    entry_arr[i++] = curr_entry;
+                }
+            }
+
+            uint64_t idx = strtoull (fields[1], NULL, 10);
+            if (idx < len) {
+                entry_arr[idx]->is_done = true;
+            }
+        }
+
+        line = line_end + 1;
+    }
+
+    *entries_len = len;
+    return entries;
+}
+
+void fsync_dir (char *path, uint64_t dir_len)
+{
+    string_t dir = {0};
+    strn_set (&dir, path, dir_len);
+    int fd = open (str_data(&dir), O_RDONLY|O_DIRECTORY);
+    if (fd != -1) {
+        fsync (fd);
+        close (fd);
+        trace_count (TRACE_COUNTER_FSYNC, 1);
+    }
+    str_free (&dir);
+}
+
+// Entries must be sorted by directory. The journal and each directory are
+// synced after the last entry of the directory is done.
+void removal_execute (struct removal_entry_t *entries, FILE *journal)
+{
+    TRACE_SCOPE ("removal_execute");
+
+    uint64_t done = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+
+    string_t error_msg = {0};
+    LINKED_LIST_FOR (struct removal_entry_t*, curr_entry, entries) {
+        if (curr_entry->is_done) continue;
+
+        char *path = str_data(&curr_entry->path);
+        char *target = str_data(&curr_entry->target);
+
+        bool success = false;
+        if (removal_entry_is_applied (curr_entry)) {
+            success = true;
+
+        } else if (!removal_entry_check (curr_entry, &error_msg)) {
+            printf (ECMA_YELLOW("warning:") " skipped '%s': %s\n", path, str_data(&error_msg));
+            removal_journal_mark (journal, 'S', curr_entry);
+            skipped++;
+
+        } else if (curr_entry->link_mode == LINK_MODE_NONE) {
+            // After a run with --link-mode symlink the kept file may be a
+            // symlink to the one we are about to remove.
+            struct stat st_path, st_target;
+            if (lstat (target, &st_target) == 0 && S_ISLNK(st_target.st_mode) &&
+                stat (target, &st_target) == 0 && stat (path, &st_path) == 0 &&
+                st_path.st_dev == st_target.st_dev && st_path.st_ino == st_target.st_ino) {
+                printf (ECMA_YELLOW("warning:") " skipped '%s': '%s' is a symlink to it\n", path, target);
+                removal_journal_mark (journal, 'S', curr_entry);
+                skipped++;
+
+            } else if (unlink (path) != 0) {
+                printf (ECMA_RED("error:") " '%s': %s\n", path, strerror(errno));
+                trace_count (TRACE_COUNTER_UNLINK, 1);
+                failed++;
+
+            } else {
+                trace_count (TRACE_COUNTER_UNLINK, 1);
+                success = true;
+            }
+
+        } else {
+            struct stat st_path, st_target;
+            if (stat (path, &st_path) == 0 && stat (target, &st_target) == 0 &&
+                st_path.st_dev == st_target.st_dev && st_path.st_ino == st_target.st_ino) {
+                // Already a link to the kept file.
+                removal_journal_mark (journal, 'S', curr_entry);
+                skipped++;
+
+            } else if (!file_content_equal (path, target, &error_msg)) {
+                printf (ECMA_YELLOW("warning:") " skipped '%s': %s\n", path, str_data(&error_msg));
+                removal_journal_mark (journal, 'S', curr_entry);
+                skipped++;
+
+            } else if (!replace_with_link (path, target, curr_entry->link_mode, &error_msg)) {
+                printf (ECMA_RED("error:") " '%s': %s\n", path, str_data(&error_msg));
+                failed++;
+
+            } else {
+                success = true;
+            }
+        }
+
+        if (success) {
+            removal_journal_mark (journal, 'C', curr_entry);
+            curr_entry->is_done = true;
+            done++;
+        }
+
+        // Sync once per directory.
+        char *base = strrchr (path, '/');
+        uint64_t dir_len = base != NULL ? base - path : 0;
+        struct removal_entry_t *next = curr_entry->next;
+        if (next == NULL || strncmp (path, str_data(&next->path), dir_len+1) != 0 ||
+            strchr (str_data(&next->path) + dir_len + 1, '/') != NULL) {
+            removal_journal_sync (journal);
+            if (dir_len > 0) fsync_dir (path, dir_len);
+        }
+    }
+    str_free (&error_msg);
+
+    printf ("Done: %ld\n", done);
+    printf ("Skipped: %ld\n", skipped);
+    printf ("Failed: %ld\n", failed);
+}
+
+void resume_removals (char *journal_path)
+{
+    mem_pool_t pool = {0};
+    string_t error_msg = {0};
+
+    uint64_t entries_len = 0;
+    struct removal_entry_t *entries = removal_journal_load (&pool, journal_path, &entries_len, &error_msg);
+    if (entries == NULL) {
+        printf (ECMA_RED("error:") " %s: %s\n", journal_path, str_data(&error_msg));
+
+    } else {
+        uint64_t pending = 0;
+        LINKED_LIST_FOR (struct removal_entry_t*, curr_entry, entries) {
+            if (!curr_entry->is_done) pending++;
+        }
+        printf ("Pending removals: %lu of %lu\n", pending, entries_len);
+
+        FILE *journal = fopen (journal_path, "a");
+        if (journal == NULL) {
+            printf (ECMA_RED("error:") " %s: %s\n", journal_path, strerror(errno));
+        } else {
+            removal_execute (entries, journal);
+            fclose (journal);
+        }
+    }
+
+    str_free (&error_msg);
+    mem_pool_destroy (&pool);
+}
+
+// Sorts each bucket so the file that's kept comes first, according to
+// file_relevance_key(). File sizes are stored too, so they can be reported
+// after files are removed.
+void duplicate_buckets_sort (struct file_bucket_t *bucket_list, char *remove_substr)
+{
+    TRACE_SCOPE ("sort_buckets");
+
+    LINKED_LIST_FOR (struct file_bucket_t*, curr_bucket, bucket_list) {
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, curr_bucket->strings) {
+            curr_file->relevance_key = file_relevance_key (str_data(&curr_file->path), remove_substr);
+
+            struct stat st;
+            curr_file->size = stat (str_data(&curr_file->path), &st) == 0 ? st.st_size : 0;
+            trace_count (TRACE_COUNTER_STAT, 1);
+        }
+
+        duplicate_relevance_sort (&curr_bucket->strings, curr_bucket->count);
+    }
+}
+
+// Only files whose path starts with removal_filter are removed, if it's set.
+bool is_removal_candidate (char *path, char *removal_filter)
+{
+    return removal_filter == NULL || strstr (path, removal_filter) == path;
+}
+
+// Files are either removed or, if link_mode is set, replaced by links to the
+// copy that's kept. Before replacing a file its content is compared again
+// with the kept one, file name duplicates aren't necessarily byte for byte
+// equal and replacing those with links would lose data.
+void remove_duplicates (struct scrapbook_t *sb,
+                        struct file_bucket_t *bucket_list,
+                        char *remove_substr, char *removal_filter, bool is_dry_run,
+                        enum link_mode_t link_mode, char *journal_path, bool verify_hash)
+{
+    if (bucket_list == NULL) return;
+
+    TRACE_SCOPE ("remove_duplicates");
+
+    // Sort each bucket and build a list of all files that will be removed.
+    // NOTE: This mutates the order of each bucket in the input list.
+    duplicate_buckets_sort (bucket_list, remove_substr);
+
+    uint64_t num_buckets = 0;
+    struct file_header_t *files_to_remove = NULL;
+    uint64_t files_to_remove_len = 0;
+    LINKED_LIST_FOR (struct file_bucket_t*, curr_bucket, bucket_list) {
+        LINKED_LIST_FOR(struct file_header_t*, curr_str, curr_bucket->strings->next) {
+            if (is_removal_candidate (str_data(&curr_str->path), removal_filter)) {
+                LINKED_LIST_PUSH_NEW (&sb->pool, struct file_header_t, files_to_remove, new_string);
+                files_to_remove_len++;
+                str_set(&new_string->path, str_data(&curr_str->path));
+                new_string->duplicate_of = curr_bucket->strings;
+            }
+        }
+
+        num_buckets++;
+    }
+
+    printf ("Unique files: %ld\n", num_buckets);
+    if (link_mode == LINK_MODE_NONE) {
+        printf ("Files to be removed: %ld\n", files_to_remove_len);
+    } else {
+        printf ("Files to be replaced by %ss: %ld\n", g_link_mode_names[link_mode], files_to_remove_len);
+    }
+    printf ("\n");
+
+    // Print the list of files to be removed
+    if (files_to_remove_len > 0) {
+        LINKED_LIST_FOR (struct file_header_t*, curr_str, files_to_remove) {
+            if (link_mode == LINK_MODE_NONE) {
+                printf ("D '%s'\n", str_data(&curr_str->path));
+            } else {
+                printf ("L '%s' -> '%s'\n", str_data(&curr_str->path), str_data(&curr_str->duplicate_of->path));
+            }
+        }
+        printf ("\n");
+    }
+
+    if (is_dry_run || files_to_remove_len == 0) return;
+
+    FILE *journal = NULL;
+    if (journal_path != NULL) {
+        int journal_fd = open (journal_path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+        if (journal_fd == -1 && errno == EEXIST) {
+            printf (ECMA_RED("error:") " journal %s already exists, finish it with --resume or remove it\n", journal_path);
+            return;
+        }
+
+        journal = journal_fd != -1 ? fdopen (journal_fd, "w") : NULL;
+        if (journal == NULL) {
+            printf (ECMA_RED("error:") " could not create journal %s: %s\n", journal_path, strerror(errno));
+            if (journal_fd != -1) close (journal_fd);
+            return;
+        }
+    }
+
+    mem_pool_t pool_l = {0};
+    string_t error_msg = {0};
+
+    struct removal_entry_t *entries = NULL;
+    uint64_t entries_len = 0;
+    LINKED_LIST_FOR (struct file_header_t*, curr_str, files_to_remove) {
+        struct removal_entry_t *new_entry = mem_pool_push_struct (&pool_l, struct removal_entry_t);
+        *new_entry = ZERO_INIT (struct removal_entry_t);
+        new_entry->link_mode = link_mode;
+        str_set (&new_entry->path, str_data(&curr_str->path));
+        str_set (&new_entry->target, str_data(&curr_str->duplicate_of->path));
+
+        if (removal_entry_stat (new_entry, verify_hash, &error_msg)) {
+            LINKED_LIST_PUSH (entries, new_entry);
+            entries_len++;
+        } else {
+            printf (ECMA_RED("error:") " '%s': %s\n", str_data(&new_entry->path), str_data(&error_msg));
+        }
+    }
+
+    removal_entry_sort (&entries, entries_len);
+    uint64_t idx = 0;
+    LINKED_LIST_FOR (struct removal_entry_t*, curr_entry, entries) {
+        curr_entry->idx = idx++;
+    }
+
+    if (journal != NULL && !removal_journal_write (journal, entries)) {
+        printf (ECMA_RED("error:") " could not write journal %s: %s\n", journal_path, strerror(errno));
+        fclose (journal);
+        str_free (&error_msg);
+        mem_pool_destroy (&pool_l);
+        return;
+    }
+
+    removal_execute (entries, journal);
+
+    if (journal != NULL) fclose (journal);
+    str_free (&error_msg);
+    mem_pool_destroy (&pool_l);
+}
+
+///////////////////////////////
+// Duplicates report
+//
+// Duplicate groups are written as one record per group through a large
+// buffer, instead of calling printf for each path. Formats:
+//
+//  - tsplx: The default, meant to be appended to the deduplication data of
+//    weaver. Each mode writes its own block, like file-content-deduplication
+//    or image-stream-deduplication.
+//
+//  - ndjson: One JSON object per line with the group's id and key hash and,
+//    for each file, its path, size and planned action.
+//
+//  - binary: Little endian. An 8 byte magic "SBDUPS01" followed by one
+//    record per group:
+//
+//      u64 group
+//      u64 key_hash
+//      u32 file_count
+//      file_count times:
+//        u64 size
+//        u8  planned_action (0 keep, 1 remove, 2 hardlink, 3 reflink, 4 symlink)
+//        u32 path_len
+//        path_len bytes of path, not NULL terminated
+//
+// Groups are numbered from 0 in the order they are written, use the group
+// id to tell them apart. The key hash is the one files were bucketed by, for
+// file content duplicates that's the hash of a partial read, so groups split
+// by the full comparison share it.
+//
+// Files are listed in the order of duplicate_buckets_sort(), the first one
+// of each group is the one that's kept. The planned action is what --remove
+// attempts for each file, it may still skip files that changed or fail to
+// remove them, the outcome is only printed by the run itself. Modes that
+// don't remove files report all of them as kept.
+
+#define OUTPUT_FORMAT_TABLE             \
+    OUTPUT_FORMAT_ROW(TSPLX,  "tsplx")  \
+    OUTPUT_FORMAT_ROW(NDJSON, "ndjson") \
+    OUTPUT_FORMAT_ROW(BINARY, "binary")
+
+#define OUTPUT_FORMAT_ROW(SYMBOL,NAME) OUTPUT_FORMAT_ ## SYMBOL,
+enum output_format_t {
+    OUTPUT_FORMAT_TABLE
+};
+#undef OUTPUT_FORMAT_ROW
+
+#define OUTPUT_FORMAT_ROW(SYMBOL,NAME) NAME,
+char *g_output_format_names[] = {
+    OUTPUT_FORMAT_TABLE
+};
+#undef OUTPUT_FORMAT_ROW
+
+bool output_format_from_str (char *str, enum output_format_t *format)
+{
+    for (int i=0; i<ARRAY_SIZE(g_output_format_names); i++) {
+        if (strcmp (str, g_output_format_names[i]) == 0) {
+            *format = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#define DUPLICATES_BINARY_MAGIC "SBDUPS01"
+
+#define OUT_BUFF_SIZE megabyte(4)
+
+// Output buffer written directly to a file descriptor when it fills up.
+struct out_buff_t {
+    mem_pool_t pool;
+
+    int fd;
+    char *data;
+    uint64_t len;
+    bool error;
+};
+
+// If path is NULL output goes to stdout.
+bool out_buff_open (struct out_buff_t *out, char *path)
+{
+    *out = ZERO_INIT (struct out_buff_t);
+
+    if (path == NULL) {
+        // Anything already printed with stdio has to come before our output.
+        fflush (stdout);
+        out->fd = STDOUT_FILENO;
+
+    } else {
+        out->fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (out->fd == -1) return false;
+    }
+
+    out->data = pom_push_size (&out->pool, OUT_BUFF_SIZE);
+    return true;
+}
+
+void out_buff_flush (struct out_buff_t *out)
+{
+    uint64_t written = 0;
+    while (!out->error && written < out->len) {
+        ssize_t status = write (out->fd, out->data + written, out->len - written);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        } else if (status == -1) {
+            out->error = true;
+        } else {
+            written += status;
+        }
+    }
+    out->len = 0;
+}
+
+void out_buff_write (struct out_buff_t *out, void *data, uint64_t len)
+{
+    char *src = data;
+    while (len > 0) {
+        if (out->len == OUT_BUFF_SIZE) {
+            out_buff_flush (out);
+        }
+
+        uint64_t copy_len = MIN(len, OUT_BUFF_SIZE - out->len);
+        memcpy (out->data + out->len, src, copy_len);
+        out->len += copy_len;
+        src += copy_len;
+        len -= copy_len;
+    }
+}
+
+void out_buff_str (struct out_buff_t *out, string_t *str)
+{
+    out_buff_write (out, str_data(str), str_len(str));
+}
+
+// Returns false if any write failed.
+bool out_buff_close (struct out_buff_t *out)
+{
+    out_buff_flush (out);
+    if (out->fd != STDOUT_FILENO) {
+        close (out->fd);
+    }
+    mem_pool_destroy (&out->pool);
+
+    return !out->error;
+}
+
+void str_cat_json_string (string_t *str, char *s)
+{
+    if (s == NULL) {
+        str_cat_c (str, "null");
+        return;
+    }
+
+    str_cat_c (str, "\"");
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            str_cat_printf (str, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            str_cat_printf (str, "\\u%04x", (unsigned char)*s);
+        } else {
+            strn_cat_c (str, s, 1);
+        }
+    }
+    str_cat_c (str, "\"");
+}
+
+// Value of the action field of the binary format, the ndjson format uses the
+// names in g_link_mode_names instead.
+uint8_t duplicate_file_action (struct file_header_t *file, bool is_first,
+                               bool removes_files, char *removal_filter, enum link_mode_t link_mode)
+{
+    if (is_first || !removes_files || !is_removal_candidate (str_data(&file->path), removal_filter)) {
+        return 0;
+    }
+
+    return 1 + link_mode;
+}
+
+void print_bucket_duplicates (struct out_buff_t *out, char *block_name, char **paths, int paths_len, struct file_bucket_t *bucket_lst)
+{
+    assert (paths != NULL);
+
+    string_t buff = {0};
+    if (out->fd == STDOUT_FILENO) {
+        str_cat_c (&buff, "Manually append to: ~/.weaver/data/deduplication.tsplx\n");
+    }
+
+    str_cat_printf (&buff, "%s{\n", block_name);
+
+    str_cat_c (&buff, "  path");
+    for (int i=0; i<paths_len; i++) {
+        str_cat_printf (&buff, " \"%s\"", paths[i]);
+    }
+    str_cat_c (&buff, ";\n");
+
+    str_cat_c (&buff, "  duplicates {\n");
+    out_buff_str (out, &buff);
+
+    LINKED_LIST_FOR (struct file_bucket_t*, curr_bucket, bucket_lst) {
+        if (curr_bucket->strings->next == NULL) continue;
+
+        str_set (&buff, "    ");
+        LINKED_LIST_FOR (struct file_header_t*, curr_str, curr_bucket->strings) {
+            str_cat_printf (&buff, "\"%s\"", str_data(&curr_str->path));
+            if (curr_str->next != NULL) {
+                str_cat_c (&buff, " ");
+            }
+        }
+        str_cat_c (&buff, ";\n");
+        out_buff_str (out, &buff);
+    }
+
+    str_set (&buff, "  }\n");
+    str_cat_c (&buff, "}\n");
+    out_buff_str (out, &buff);
+
+    str_free (&buff);
+}
+
+void write_duplicates_ndjson (struct out_buff_t *out, struct file_bucket_t *bucket_lst,
+                              bool removes_files, char *removal_filter, enum link_mode_t link_mode)
+{
+    string_t buff = {0};
+    uint64_t group = 0;
+    LINKED_LIST_FOR (struct file_bucket_t*, curr_bucket, bucket_lst) {
+        if (curr_bucket->strings->next == NULL) continue;
+
+        uint64_t removed_size = 0;
+        str_set_printf (&buff, "{\"group\":%lu,\"key_hash\":\"%016lx\",\"count\":%u,\"files\":[",
+                        group++, curr_bucket->hash, curr_bucket->count);
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, curr_bucket->strings) {
+            uint8_t action = duplicate_file_action (curr_file, curr_file == curr_bucket->strings,
+                                                    removes_files, removal_filter, link_mode);
+            if (action != 0) {
+                removed_size += curr_file->size;
+            }
+
+            str_cat_c (&buff, "{\"path\":");
+            str_cat_json_string (&buff, str_data(&curr_file->path));
+            str_cat_printf (&buff, ",\"size\":%lu,\"planned_action\":\"%s\"}%s", curr_file->size,
+                            action == 0 ? "keep" : (action == 1 ? "remove" : g_link_mode_names[action-1]),
+                            curr_file->next != NULL ? "," : "");
+        }
+        str_cat_printf (&buff, "],\"reclaimable_size\":%lu}\n", removed_size);
+
+        out_buff_str (out, &buff);
+    }
+    str_free (&buff);
+}
+
+void write_duplicates_binary (struct out_buff_t *out, struct file_bucket_t *bucket_lst,
+                              bool removes_files, char *removal_filter, enum link_mode_t link_mode)
+{
+    out_buff_write (out, DUPLICATES_BINARY_MAGIC, strlen(DUPLICATES_BINARY_MAGIC));
+
+    uint64_t group = 0;
+    LINKED_LIST_FOR (struct file_bucket_t*, curr_bucket, bucket_lst) {
+        if (curr_bucket->strings->next == NULL) continue;
+
+        out_buff_write (out, &group, sizeof(uint64_t));
+        out_buff_write (out, &curr_bucket->hash, sizeof(uint64_t));
+        out_buff_write (out, &curr_bucket->count, sizeof(uint32_t));
+        group++;
+
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, curr_bucket->strings) {
+            uint64_t size = curr_file->size;
+            uint8_t action = duplicate_file_action (curr_file, curr_file == curr_bucket->strings,
+                                                    removes_files, removal_filter, link_mode);
+            uint32_t path_len = str_len(&curr_file->path);
+
+            out_buff_write (out, &size, sizeof(size));
+            out_buff_write (out, &action, sizeof(action));
+            out_buff_write (out, &path_len, sizeof(path_len));
+            out_buff_write (out, str_data(&curr_file->path), path_len);
+        }
+    }
+}
+
+// Buckets must be sorted with duplicate_buckets_sort(), remove_duplicates()
+// does this. Pass removes_files as false for modes that never remove files,
+// block_name is the name of the tsplx block.
+void print_duplicates_report (enum output_format_t format, char *output_path, char *block_name,
+                              char **paths, int paths_len, struct file_bucket_t *bucket_lst,
+                              bool removes_files, char *removal_filter, enum link_mode_t link_mode)
+{
+    TRACE_SCOPE ("report");
+
+    // Keep the old behavior of not printing anything if there are no
+    // duplicates.
+    if (format == OUTPUT_FORMAT_TSPLX && (bucket_lst == NULL || bucket_lst->count == 0)) {
+        return;
+    }
+
+    struct out_buff_t out;
+    if (!out_buff_open (&out, output_path)) {
+        printf (ECMA_RED("error:") " could not open %s: %s\n", output_path, strerror(errno));
+        return;
+    }
+
+    if (format == OUTPUT_FORMAT_TSPLX) {
+        print_bucket_duplicates (&out, block_name, paths, paths_len, bucket_lst);
+
+    } else if (format == OUTPUT_FORMAT_NDJSON) {
+        write_duplicates_ndjson (&out, bucket_lst, removes_files, removal_filter, link_mode);
+
+    } else if (format == OUTPUT_FORMAT_BINARY) {
+        write_duplicates_binary (&out, bucket_lst, removes_files, removal_filter, link_mode);
+    }
+
+    if (!out_buff_close (&out)) {
+        printf (ECMA_RED("error:") " failed writing report: %s\n", strerror(errno));
+    }
+}
+
+void print_hex_bytes (void *data, uint64_t data_len)
+{
+    for (uint32_t value_idx = 0; value_idx < data_len; value_idx++) {
+        uint8_t byte = ((uint8_t*)data)[value_idx];
+        printf ("%.2X", byte);
 
         if (value_idx < data_len-1) {
             printf (" ");
@@ -908,6 +3148,326 @@ void print_hex_bytes (void *data, uint64_t data_len)
     }
 }
 
+///////////////////////////////
+// Exif export
+//
+// Extracts a few Exif fields of a lot of files in parallel and writes them
+// into a single file, so other tools can query them without parsing images
+// again. The default output is a columnar binary file:
+//
+//   Header
+//     char     magic[8]       "SBEXIF01"
+//     uint32_t version        EXIF_STORE_VERSION
+//     uint32_t column_count
+//     uint64_t row_count
+//     uint64_t reserved
+//
+//   Column directory, column_count of
+//     char     name[24]       NULL terminated
+//     uint32_t type           enum exif_store_column_type_t
+//     uint32_t reserved
+//     uint64_t offset         from the start of the file, 8 byte aligned
+//     uint64_t size           in bytes
+//
+//   Column data
+//     EXIF_STORE_STRING  uint64_t offsets[row_count+1] relative to the end of
+//                        the offsets array, then the string bytes. Strings
+//                        aren't NULL terminated, missing values are empty.
+//     EXIF_STORE_I64     int64_t[row_count], missing is INT64_MIN.
+//     EXIF_STORE_F64     double[row_count], missing is NAN.
+//     EXIF_STORE_U16     uint16_t[row_count], missing is 0.
+//
+// All values are little endian. Dates are stored as seconds since the epoch,
+// interpreting the Exif date, which has no time zone, as UTC.
+//
+// With --ndjson, a JSON object per line is written instead.
+
+#define EXIF_STORE_MAGIC "SBEXIF01"
+#define EXIF_STORE_VERSION 1
+
+enum exif_store_column_type_t {
+    EXIF_STORE_STRING,
+    EXIF_STORE_I64,
+    EXIF_STORE_F64,
+    EXIF_STORE_U16
+};
+
+struct exif_store_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t column_count;
+    uint64_t row_count;
+    uint64_t reserved;
+};
+
+struct exif_store_column_t {
+    char name[24];
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct exif_export_row_t {
+    char *path;
+    bool success;
+    struct exif_fields_t fields;
+};
+
+struct exif_export_t {
+    struct exif_export_row_t *rows;
+    uint64_t rows_len;
+
+    // Index of the next row to be processed, workers take rows from here
+    // atomically.
+    volatile uint64_t next_row;
+    volatile uint64_t failed_count;
+
+    struct progress_t progress;
+};
+
+struct exif_export_worker_t {
+    pthread_t thread;
+    mem_pool_t pool;
+    struct exif_export_t *ctx;
+};
+
+void* exif_export_worker (void *data)
+{
+    struct exif_export_worker_t *worker = (struct exif_export_worker_t*)data;
+    struct exif_export_t *ctx = worker->ctx;
+
+    string_t error_msg = {0};
+    uint64_t row_idx;
+    while ((row_idx = __sync_fetch_and_add (&ctx->next_row, 1)) < ctx->rows_len) {
+        struct exif_export_row_t *row = &ctx->rows[row_idx];
+        row->success = jpg_read_exif_fields (row->path, &worker->pool, &row->fields, &error_msg);
+        if (!row->success) {
+            fprintf (stderr, "\r\e[K" ECMA_RED("error:") " %s: %s\n", row->path, str_data(&error_msg));
+            __sync_fetch_and_add (&ctx->failed_count, 1);
+        }
+        progress_add (&ctx->progress, 1, 0);
+    }
+    str_free (&error_msg);
+
+    return NULL;
+}
+
+int64_t exif_date_to_timestamp (char *date_time)
+{
+    int64_t timestamp = INT64_MIN;
+    if (date_time != NULL) {
+        struct tm tm = {0};
+        char *end = strptime (date_time, "%Y:%m:%d %H:%M:%S", &tm);
+        if (end != NULL) {
+            timestamp = timegm (&tm);
+        }
+    }
+    return timestamp;
+}
+
+bool exif_export_write_ndjson (FILE *out, struct exif_export_t *ctx)
+{
+    string_t line = {0};
+    for (uint64_t i=0; i<ctx->rows_len; i++) {
+        struct exif_export_row_t *row = &ctx->rows[i];
+        struct exif_fields_t *fields = &row->fields;
+
+        str_set (&line, "{\"path\":");
+        str_cat_json_string (&line, row->path);
+
+        str_cat_c (&line, ",\"make\":");
+        str_cat_json_string (&line, fields->make);
+
+        str_cat_c (&line, ",\"model\":");
+        str_cat_json_string (&line, fields->model);
+
+        str_cat_c (&line, ",\"date_time\":");
+        int64_t timestamp = exif_date_to_timestamp (fields->date_time);
+        if (timestamp != INT64_MIN) {
+            str_cat_printf (&line, "%ld", timestamp);
+        } else {
+            str_cat_c (&line, "null");
+        }
+
+        str_cat_printf (&line, ",\"orientation\":%u", fields->orientation);
+
+        if (fields->has_gps) {
+            str_cat_printf (&line, ",\"latitude\":%.7f,\"longitude\":%.7f", fields->latitude, fields->longitude);
+        } else {
+            str_cat_c (&line, ",\"latitude\":null,\"longitude\":null");
+        }
+
+        str_cat_c (&line, "}\n");
+        fwrite (str_data(&line), 1, str_len(&line), out);
+    }
+    str_free (&line);
+
+    return !ferror (out);
+}
+
+#define EXIF_STORE_STRING_COLUMNS \
+    EXIF_STORE_STRING_COLUMN(path,  row->path) \
+    EXIF_STORE_STRING_COLUMN(make,  row->fields.make) \
+    EXIF_STORE_STRING_COLUMN(model, row->fields.model)
+
+#define EXIF_STORE_FIXED_COLUMNS \
+    EXIF_STORE_FIXED_COLUMN(date_time,   EXIF_STORE_I64, int64_t,  exif_date_to_timestamp(row->fields.date_time)) \
+    EXIF_STORE_FIXED_COLUMN(orientation, EXIF_STORE_U16, uint16_t, row->fields.orientation) \
+    EXIF_STORE_FIXED_COLUMN(latitude,    EXIF_STORE_F64, double,   row->fields.has_gps ? row->fields.latitude : NAN) \
+    EXIF_STORE_FIXED_COLUMN(longitude,   EXIF_STORE_F64, double,   row->fields.has_gps ? row->fields.longitude : NAN)
+
+#define EXIF_STORE_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+
+void exif_store_write_padding (FILE *out, uint64_t size)
+{
+    static const char zeros[8] = {0};
+    fwrite (zeros, 1, EXIF_STORE_ALIGN(size) - size, out);
+}
+
+bool exif_export_write_columnar (FILE *out, struct exif_export_t *ctx)
+{
+    struct exif_store_column_t columns[] = {
+#define EXIF_STORE_STRING_COLUMN(NAME,EXPR) {#NAME, EXIF_STORE_STRING},
+        EXIF_STORE_STRING_COLUMNS
+#undef EXIF_STORE_STRING_COLUMN
+#define EXIF_STORE_FIXED_COLUMN(NAME,TYPE,C_TYPE,EXPR) {#NAME, TYPE},
+        EXIF_STORE_FIXED_COLUMNS
+#undef EXIF_STORE_FIXED_COLUMN
+    };
+
+    // Compute the layout of the file.
+    uint64_t offset = sizeof(struct exif_store_header_t) + sizeof(columns);
+    int column_idx = 0;
+
+#define EXIF_STORE_STRING_COLUMN(NAME,EXPR)                                  \
+    {                                                                        \
+        uint64_t size = (ctx->rows_len + 1)*sizeof(uint64_t);                \
+        for (uint64_t i=0; i<ctx->rows_len; i++) {                           \
+            struct exif_export_row_t *row = &ctx->rows[i];                   \
+            char *value = EXPR;                                              \
+            size += value != NULL ? strlen (value) : 0;                      \
+        }                                                                    \
+        columns[column_idx].offset = offset;                                 \
+        columns[column_idx].size = size;                                     \
+        offset += EXIF_STORE_ALIGN(size);                                    \
+        column_idx++;                                                        \
+    }
+    EXIF_STORE_STRING_COLUMNS
+#undef EXIF_STORE_STRING_COLUMN
+
+#define EXIF_STORE_FIXED_COLUMN(NAME,TYPE,C_TYPE,EXPR)                       \
+    columns[column_idx].offset = offset;                                     \
+    columns[column_idx].size = ctx->rows_len*sizeof(C_TYPE);                 \
+    offset += EXIF_STORE_ALIGN(columns[column_idx].size);                    \
+    column_idx++;
+    EXIF_STORE_FIXED_COLUMNS
+#undef EXIF_STORE_FIXED_COLUMN
+
+    struct exif_store_header_t header = {0};
+    memcpy (header.magic, EXIF_STORE_MAGIC, sizeof(header.magic));
+    header.version = EXIF_STORE_VERSION;
+    header.column_count = ARRAY_SIZE(columns);
+    header.row_count = ctx->rows_len;
+
+    fwrite (&header, sizeof(header), 1, out);
+    fwrite (columns, sizeof(columns), 1, out);
+
+    // Write column data.
+#define EXIF_STORE_STRING_COLUMN(NAME,EXPR)                                  \
+    {                                                                        \
+        uint64_t string_offset = 0;                                          \
+        fwrite (&string_offset, sizeof(uint64_t), 1, out);                   \
+        for (uint64_t i=0; i<ctx->rows_len; i++) {                           \
+            struct exif_export_row_t *row = &ctx->rows[i];                   \
+            char *value = EXPR;                                              \
+            string_offset += value != NULL ? strlen (value) : 0;             \
+            fwrite (&string_offset, sizeof(uint64_t), 1, out);               \
+        }                                                                    \
+        for (uint64_t i=0; i<ctx->rows_len; i++) {                           \
+            struct exif_export_row_t *row = &ctx->rows[i];                   \
+            char *value = EXPR;                                              \
+            if (value != NULL) fwrite (value, 1, strlen (value), out);       \
+        }                                                                    \
+        exif_store_write_padding (out, (ctx->rows_len + 1)*sizeof(uint64_t) + string_offset); \
+    }
+    EXIF_STORE_STRING_COLUMNS
+#undef EXIF_STORE_STRING_COLUMN
+
+#define EXIF_STORE_FIXED_COLUMN(NAME,TYPE,C_TYPE,EXPR)                       \
+    for (uint64_t i=0; i<ctx->rows_len; i++) {                               \
+        struct exif_export_row_t *row = &ctx->rows[i];                       \
+        C_TYPE value = EXPR;                                                 \
+        fwrite (&value, sizeof(C_TYPE), 1, out);                             \
+    }                                                                        \
+    exif_store_write_padding (out, ctx->rows_len*sizeof(C_TYPE));
+    EXIF_STORE_FIXED_COLUMNS
+#undef EXIF_STORE_FIXED_COLUMN
+
+    return !ferror (out);
+}
+
+void exif_export (char *out_path, struct file_header_t *files, bool ndjson)
+{
+    TRACE_SCOPE ("exif_export");
+
+    mem_pool_t pool = {0};
+    struct exif_export_t ctx = {0};
+
+    LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+        ctx.rows_len++;
+    }
+
+    ctx.rows = mem_pool_push_array (&pool, ctx.rows_len, struct exif_export_row_t);
+    {
+        uint64_t i = 0;
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, files) {
+            ctx.rows[i] = ZERO_INIT (struct exif_export_row_t);
+            ctx.rows[i].path = str_data(&curr_file->path);
+            i++;
+        }
+    }
+
+    progress_begin (&ctx.progress, "Files read: ", ctx.rows_len);
+    int num_workers = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+    struct exif_export_worker_t workers[num_workers];
+    for (int i=0; i<num_workers; i++) {
+        workers[i] = ZERO_INIT (struct exif_export_worker_t);
+        workers[i].ctx = &ctx;
+        pthread_create (&workers[i].thread, NULL, exif_export_worker, &workers[i]);
+    }
+
+    for (int i=0; i<num_workers; i++) {
+        pthread_join (workers[i].thread, NULL);
+    }
+    progress_end (&ctx.progress);
+
+    FILE *out = fopen (out_path, "w");
+    if (out != NULL) {
+        bool success;
+        if (ndjson) {
+            success = exif_export_write_ndjson (out, &ctx);
+        } else {
+            success = exif_export_write_columnar (out, &ctx);
+        }
+
+        if (fclose (out) != 0 || !success) {
+            printf ("Error writing %s: %s\n", out_path, strerror(errno));
+        }
+
+    } else {
+        printf ("Error opening %s: %s\n", out_path, strerror(errno));
+    }
+
+    printf ("Exported: %lu\n", ctx.rows_len - ctx.failed_count);
+    printf ("Failed: %lu\n", ctx.failed_count);
+
+    for (int i=0; i<num_workers; i++) {
+        mem_pool_destroy (&workers[i].pool);
+    }
+    mem_pool_destroy (&pool);
+}
+
 // Debug procedure to test stuff in all images in a list of file names.
 void testing_function (struct scrapbook_t *sb, struct file_header_t *files)
 {
@@ -927,6 +3487,11 @@ void testing_function (struct scrapbook_t *sb, struct file_header_t *files)
 int main (int argc, char **argv)
 {
     struct scrapbook_t scrapbook = {0};
+    // These hold paths and tree nodes for every collected file, so they grow
+    // large on big trees.
+    scrapbook.pool.huge_pages = true;
+    scrapbook.buckets_pool.huge_pages = true;
+
     int paths_count = argc - 2;
     char **paths = argv + 2;
 
@@ -949,6 +3514,84 @@ int main (int argc, char **argv)
     }
     bool is_dry_run = !is_remove;
 
+    enum link_mode_t link_mode = LINK_MODE_NONE;
+    char *link_mode_str = get_cli_arg_opt ("--link-mode", argv, argc);
+    if (link_mode_str != NULL) {
+        paths_count -= 2;
+        paths += 2;
+
+        if (!link_mode_from_str (link_mode_str, &link_mode)) {
+            printf (ECMA_RED("error:") " invalid link mode '%s', expected hardlink, reflink or symlink.\n", link_mode_str);
+            return 1;
+        }
+    }
+
+    enum output_format_t output_format = OUTPUT_FORMAT_TSPLX;
+    char *output_format_str = get_cli_arg_opt ("--format", argv, argc);
+    if (output_format_str != NULL) {
+        paths_count -= 2;
+        paths += 2;
+
+        if (!output_format_from_str (output_format_str, &output_format)) {
+            printf (ECMA_RED("error:") " invalid format '%s', expected tsplx, ndjson or binary.\n", output_format_str);
+            return 1;
+        }
+    }
+
+    char *output_path = get_cli_arg_opt ("--output", argv, argc);
+    if (output_path != NULL) {
+        paths_count -= 2;
+        paths += 2;
+    }
+
+    char *journal_path = get_cli_arg_opt ("--journal", argv, argc);
+    if (journal_path != NULL) {
+        paths_count -= 2;
+        paths += 2;
+    }
+
+    bool verify_hash = get_cli_bool_opt ("--verify-hash", argv, argc);
+    if (verify_hash) {
+        paths_count -= 1;
+        paths += 1;
+    }
+
+    bool is_ndjson = get_cli_bool_opt ("--ndjson", argv, argc);
+    if (is_ndjson) {
+        paths_count -= 1;
+        paths += 1;
+    }
+
+    bool is_stats = get_cli_bool_opt ("--stats", argv, argc);
+    if (is_stats) {
+        paths_count -= 1;
+        paths += 1;
+    }
+
+    char *partial_read_size_str = get_cli_arg_opt ("--partial-read-size", argv, argc);
+    if (partial_read_size_str != NULL) {
+        paths_count -= 2;
+        paths += 2;
+
+        char *end;
+        scrapbook.partial_read_size = strtoull (partial_read_size_str, &end, 10);
+        if (*end != '\0' || scrapbook.partial_read_size == 0) {
+            printf (ECMA_RED("error:") " invalid partial read size '%s', expected a number of bytes.\n", partial_read_size_str);
+            return 1;
+        }
+    }
+
+    char *trace_path = get_cli_arg_opt ("--trace", argv, argc);
+    if (trace_path != NULL) {
+        paths_count -= 2;
+        paths += 2;
+    }
+
+    if (is_stats || trace_path != NULL) {
+        trace_begin (trace_path != NULL);
+    }
+    struct trace_scope_t main_scope = trace_scope_begin ("main");
+
     char *argument = NULL;
     if ((argument = get_cli_arg_opt ("--jpeg-structure", argv, argc)) != NULL) {
         print_jpeg_structure (argument);
@@ -956,6 +3599,46 @@ int main (int argc, char **argv)
     } else if ((argument = get_cli_arg_opt ("--exif", argv, argc)) != NULL) {
         print_exif (argument);
 
+    } else if ((argument = get_cli_arg_opt ("--resume", argv, argc)) != NULL) {
+        resume_removals (argument);
+
+    } else if ((argument = get_cli_arg_opt ("--heif-info", argv, argc)) != NULL) {
+        print_heif_info (argument);
+
+    } else if ((argument = get_cli_arg_opt ("--probe", argv, argc)) != NULL) {
+        struct file_header_t *images = collect_files_from_cli_full (&scrapbook.pool, "jpg", paths, paths_count, false, 1);
+
+        TRACE_SCOPE ("probe");
+
+        string_t error_msg = {0};
+        string_t warning_msg = {0};
+        LINKED_LIST_FOR (struct file_header_t*, curr_file, images) {
+            char *path = str_data(&curr_file->path);
+
+            struct jpg_probe_t probe;
+            if (jpg_probe (path, &probe, &error_msg, &warning_msg)) {
+                print_jpg_probe (path, &probe);
+            } else {
+                fprintf (stderr, ECMA_RED("error:") " %s: %s\n", path, str_data(&error_msg));
+            }
+
+            if (str_len(&warning_msg) > 0) {
+                fprintf (stderr, "%s: %s", path, str_data(&warning_msg));
+            }
+        }
+        str_free (&error_msg);
+        str_free (&warning_msg);
+
+    } else if ((argument = get_cli_arg_opt ("--exif-export", argv, argc)) != NULL) {
+        // The output file is the mode's argument, paths start after it.
+        paths_count -= 1;
+        paths += 1;
+
+        int num_threads = MAX (COLLECT_WALK_MIN_THREADS, sysconf (_SC_NPROCESSORS_ONLN));
+        struct file_header_t *images =
+            collect_files_from_cli_full (&scrapbook.pool, "jpg", paths, paths_count, true, num_threads);
+        exif_export (argument, images, is_ndjson);
+
     } else if ((argument = get_cli_arg_opt ("--image-info", argv, argc)) != NULL) {
         mem_pool_t pool = {0};
 
@@ -974,6 +3657,12 @@ int main (int argc, char **argv)
         printf ("image data hash: ");
         printf ("%lu\n", hash_64 (image_data, image_data_len));
 
+        struct jpg_fingerprint_t fingerprint;
+        if (jpg_fingerprint (argument, &fingerprint, NULL)) {
+            printf ("image stream hash: ");
+            printf ("%lu\n", fingerprint.image_hash);
+        }
+
         printf ("image data partial hash: ");
         printf ("%lu\n", hash_64 (image_data, MIN(kilobyte(5), image_data_len)));
 
@@ -990,35 +3679,77 @@ int main (int argc, char **argv)
     } else if ((argument = get_cli_arg_opt ("--find-duplicates-file-name", argv, argc)) != NULL) {
         struct file_header_t *images = collect_files_from_cli (&scrapbook.pool, NULL, paths, paths_count);
         struct file_bucket_t *duplicates = find_file_name_duplicates (&scrapbook, images);
-        remove_duplicates (&scrapbook, duplicates, remove_substr, removal_filter, is_dry_run);
+        remove_duplicates (&scrapbook, duplicates, remove_substr, removal_filter, is_dry_run, link_mode, journal_path, verify_hash);
+
+        print_duplicates_report (output_format, output_path, "file-name-deduplication", paths, paths_count, duplicates, true, removal_filter, link_mode);
 
     } else if ((argument = get_cli_arg_opt ("--find-duplicates-file", argv, argc)) != NULL) {
         struct file_header_t *images = collect_files_from_cli (&scrapbook.pool, NULL, paths, paths_count);
         struct file_bucket_t *duplicates = find_file_duplicates (&scrapbook, images);
-        remove_duplicates (&scrapbook, duplicates, remove_substr, removal_filter, is_dry_run);
+        remove_duplicates (&scrapbook, duplicates, remove_substr, removal_filter, is_dry_run, link_mode, journal_path, verify_hash);
 
         //print_bucket_list (duplicates, PATH_FORMAT_FNAME);
         //printf ("\n");
 
-        if (duplicates != NULL && duplicates->count > 0) {
-            print_bucket_duplicates (paths, paths_count, duplicates, PATH_FORMAT_ABSOLUTE);
-        }
+        print_duplicates_report (output_format, output_path, "file-content-deduplication", paths, paths_count, duplicates, true, removal_filter, link_mode);
 
 
     } else if ((argument = get_cli_arg_opt ("--find-duplicates-image", argv, argc)) != NULL) {
-        struct file_header_t *images = collect_jpg_from_cli (&scrapbook.pool, argv+2, argc-2);
+        struct file_header_t *images = collect_jpg_from_cli (&scrapbook.pool, paths, paths_count);
         struct file_bucket_t *duplicates = find_image_duplicates (&scrapbook, images);
+        duplicate_buckets_sort (duplicates, remove_substr);
+
+        print_duplicates_report (output_format, output_path, "image-deduplication", paths, paths_count, duplicates, false, removal_filter, link_mode);
+
+    } else if ((argument = get_cli_arg_opt ("--find-duplicates-image-stream", argv, argc)) != NULL) {
+        // Copies found this way differ in their metadata, removing them would
+        // lose it.
+        if (is_remove || link_mode_str != NULL) {
+            printf (ECMA_RED("error:") " --find-duplicates-image-stream only reports duplicates, it can't be used with --remove or --link-mode.\n");
+            return 1;
+        }
+
+        struct file_header_t *images = collect_files_from_cli (&scrapbook.pool, NULL, paths, paths_count);
+        struct file_bucket_t *duplicates = find_image_stream_duplicates (&scrapbook, images);
+        duplicate_buckets_sort (duplicates, remove_substr);
+
+        print_duplicates_report (output_format, output_path, "image-stream-deduplication", paths, paths_count, duplicates, false, removal_filter, link_mode);
 
-        if (duplicates != NULL && duplicates->count > 0) {
-            print_bucket_duplicates (paths, paths_count, duplicates, PATH_FORMAT_ABSOLUTE);
+    } else if ((argument = get_cli_arg_opt ("--find-duplicates-apple-id", argv, argc)) != NULL) {
+        if (is_remove || link_mode_str != NULL) {
+            printf (ECMA_RED("error:") " --find-duplicates-apple-id only reports duplicates, it can't be used with --remove or --link-mode.\n");
+            return 1;
         }
 
+        struct file_header_t *images = collect_files_from_cli (&scrapbook.pool, NULL, paths, paths_count);
+        struct file_bucket_t *duplicates = find_apple_id_duplicates (&scrapbook, images);
+        duplicate_buckets_sort (duplicates, remove_substr);
+
+        print_duplicates_report (output_format, output_path, "apple-id-deduplication", paths, paths_count, duplicates, false, removal_filter, link_mode);
+
+    } else if ((argument = get_cli_arg_opt ("--find-overlap", argv, argc)) != NULL) {
+        struct file_header_t *files = collect_files_from_cli (&scrapbook.pool, NULL, paths, paths_count);
+        print_file_overlap (&scrapbook, files);
+
     } else {
         printf ("Usage:\n");
         printf ("scrapbook --jpeg-structure FILE\n");
-        printf ("scrapbook [--find-duplicates-file-name | --find-duplicates-file | --find-duplicates-image] [--remove] PATHS...\n");
+        printf ("scrapbook --heif-info FILE\n");
+        printf ("scrapbook --probe PATHS...\n");
+        printf ("scrapbook --exif-export OUTPUT_FILE [--ndjson] PATHS...\n");
+        printf ("scrapbook [--find-duplicates-file-name | --find-duplicates-file] [--remove [--link-mode hardlink|reflink|symlink] [--journal FILE] [--verify-hash]] [--format tsplx|ndjson|binary] [--output FILE] [--partial-read-size BYTES] PATHS...\n");
+        printf ("scrapbook [--find-duplicates-image | --find-duplicates-image-stream | --find-duplicates-apple-id] [--format tsplx|ndjson|binary] [--output FILE] PATHS...\n");
+        printf ("scrapbook --resume JOURNAL_FILE\n");
+        printf ("scrapbook --find-overlap PATHS...\n");
+        printf ("\n");
+        printf ("Any mode also accepts --stats, to print time spent in each stage and counters, and\n");
+        printf ("--trace FILE, to write them in Chrome trace format.\n");
     }
 
+    trace_scope_end (&main_scope);
+    trace_end (is_stats, trace_path);
+
+    mem_pool_destroy (&scrapbook.buckets_pool);
     mem_pool_destroy (&scrapbook.pool);
     return 0;
 }
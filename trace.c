@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// Instrumentation of the stages of a run.
+//
+// TRACE_SCOPE(name) times the rest of the enclosing block, the scope ends when
+// its variable goes out of scope through the cleanup attribute, so early
+// returns are timed too. Names must be string literals. Counters in
+// TRACE_COUNTER_TABLE are incremented with trace_count().
+//
+// Scopes are meant for stages. Ending one takes a lock and, when writing a
+// trace file, stores an event, so work done for each file is counted instead.
+//
+// Nothing is recorded until trace_begin() is called, until then a scope costs
+// a branch. Aggregates for each scope name are always kept, individual scopes
+// are only stored when writing a trace file. Scopes and counters can be used
+// from any thread.
+//
+// The trace file uses the Chrome trace event format, with one complete event
+// ("ph": "X") for each scope. It can be opened in chrome://tracing or
+// https://ui.perfetto.dev.
+
+// Syscalls are counted where they are made by scrapbook, for the helpers in
+// common.h we count the calls they make when they succeed.
+#define TRACE_COUNTER_TABLE                                       \
+    TRACE_COUNTER_ROW(OPEN,                "open")                \
+    TRACE_COUNTER_ROW(STAT,                "stat")                \
+    TRACE_COUNTER_ROW(READ,                "read")                \
+    TRACE_COUNTER_ROW(MMAP,                "mmap")                \
+    TRACE_COUNTER_ROW(UNLINK,              "unlink")              \
+    TRACE_COUNTER_ROW(LINK,                "link")                \
+    TRACE_COUNTER_ROW(FSYNC,               "fsync")               \
+    TRACE_COUNTER_ROW(BYTES_READ,          "bytes_read")          \
+    TRACE_COUNTER_ROW(FILES_HASHED,        "files_hashed")        \
+    TRACE_COUNTER_ROW(FILES_PROBED,        "files_probed")        \
+    TRACE_COUNTER_ROW(FILES_EXIF_READ,     "files_exif_read")     \
+    TRACE_COUNTER_ROW(FILES_FINGERPRINTED, "files_fingerprinted") \
+    TRACE_COUNTER_ROW(BUCKETS,             "buckets")             \
+    TRACE_COUNTER_ROW(BUCKET_FILES,        "bucket_files")        \
+    TRACE_COUNTER_ROW(MAX_BUCKET_SIZE,     "max_bucket_size")     \
+    TRACE_COUNTER_ROW(HASH_COLLISIONS,     "hash_collisions")
+
+#define TRACE_COUNTER_ROW(SYMBOL,NAME) TRACE_COUNTER_ ## SYMBOL,
+enum trace_counter_t {
+    TRACE_COUNTER_TABLE
+    TRACE_COUNTER_COUNT
+};
+#undef TRACE_COUNTER_ROW
+
+#define TRACE_COUNTER_ROW(SYMBOL,NAME) NAME,
+char *g_trace_counter_names[] = {
+    TRACE_COUNTER_TABLE
+};
+#undef TRACE_COUNTER_ROW
+
+// Only these counters are syscalls, they are added up in the summary.
+#define TRACE_SYSCALLS_END TRACE_COUNTER_BYTES_READ
+
+#define TRACE_MAX_SCOPE_NAMES 64
+
+struct trace_scope_stats_t {
+    char *name;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+struct trace_event_t {
+    char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t tid;
+};
+
+struct trace_t {
+    bool enabled;
+    bool record_events;
+    uint64_t start_ns;
+
+    pthread_mutex_t mutex;
+    struct trace_scope_stats_t scopes[TRACE_MAX_SCOPE_NAMES];
+    int scopes_len;
+
+    mem_pool_t pool;
+    DYNAMIC_ARRAY_DEFINE (struct trace_event_t, events);
+
+    uint64_t counters[TRACE_COUNTER_COUNT];
+};
+
+struct trace_t g_trace = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread uint32_t t_trace_tid = 0;
+static uint32_t g_trace_last_tid = 0;
+
+uint64_t trace_time_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Threads are numbered in the order they first end a scope, the main thread
+// is usually 1.
+uint32_t trace_tid ()
+{
+    if (t_trace_tid == 0) {
+        t_trace_tid = __sync_add_and_fetch (&g_trace_last_tid, 1);
+    }
+    return t_trace_tid;
+}
+
+void trace_begin (bool record_events)
+{
+    g_trace.record_events = record_events;
+    if (record_events) {
+        DYNAMIC_ARRAY_INIT (&g_trace.pool, g_trace.events, 0);
+    }
+
+    g_trace.start_ns = trace_time_ns ();
+    g_trace.enabled = true;
+}
+
+static inline
+void trace_count (enum trace_counter_t counter, uint64_t value)
+{
+    if (!g_trace.enabled) return;
+    __sync_fetch_and_add (&g_trace.counters[counter], value);
+}
+
+static inline
+void trace_count_max (enum trace_counter_t counter, uint64_t value)
+{
+    if (!g_trace.enabled) return;
+
+    uint64_t old_value = g_trace.counters[counter];
+    while (value > old_value) {
+        uint64_t seen = __sync_val_compare_and_swap (&g_trace.counters[counter], old_value, value);
+        if (seen == old_value) break;
+        old_value = seen;
+    }
+}
+
+struct trace_scope_t {
+    char *name;
+    uint64_t start_ns;
+};
+
+static inline
+struct trace_scope_t trace_scope_begin (char *name)
+{
+    struct trace_scope_t scope = {.name = name};
+    if (g_trace.enabled) {
+        scope.start_ns = trace_time_ns ();
+    }
+    return scope;
+}
+
+void trace_scope_end (struct trace_scope_t *scope)
+{
+    // Scopes that started before trace_begin() aren't recorded.
+    if (!g_trace.enabled || scope->start_ns == 0) return;
+
+    uint64_t duration_ns = trace_time_ns () - scope->start_ns;
+    uint32_t tid = trace_tid ();
+
+    pthread_mutex_lock (&g_trace.mutex);
+
+    struct trace_scope_stats_t *stats = NULL;
+    for (int i=0; i<g_trace.scopes_len; i++) {
+        if (g_trace.scopes[i].name == scope->name) {
+            stats = &g_trace.scopes[i];
+            break;
+        }
+    }
+
+    if (stats == NULL && g_trace.scopes_len < TRACE_MAX_SCOPE_NAMES) {
+        stats = &g_trace.scopes[g_trace.scopes_len++];
+        stats->name = scope->name;
+    }
+
+    if (stats != NULL) {
+        stats->count++;
+        stats->total_ns += duration_ns;
+        stats->max_ns = MAX(stats->max_ns, duration_ns);
+    }
+
+    if (g_trace.record_events) {
+        struct trace_event_t event = {
+            .name = scope->name,
+            .start_ns = scope->start_ns,
+            .duration_ns = duration_ns,
+            .tid = tid
+        };
+        DYNAMIC_ARRAY_APPEND (g_trace.events, event);
+    }
+
+    pthread_mutex_unlock (&g_trace.mutex);
+}
+
+#define TRACE_SCOPE_VAR_2(line) _trace_scope_ ## line
+#define TRACE_SCOPE_VAR(line) TRACE_SCOPE_VAR_2(line)
+#define TRACE_SCOPE(name)                                                          \
+    struct trace_scope_t TRACE_SCOPE_VAR(__LINE__) __attribute__((cleanup(trace_scope_end))) = \
+        trace_scope_begin (name)
+
+void trace_print_stats (FILE *out)
+{
+    fprintf (out, "\n");
+    fprintf (out, "%-32s %10s %12s %12s %12s\n", "Scope", "Count", "Total (ms)", "Mean (ms)", "Max (ms)");
+    for (int i=0; i<g_trace.scopes_len; i++) {
+        struct trace_scope_stats_t *stats = &g_trace.scopes[i];
+        fprintf (out, "%-32s %10lu %12.3f %12.3f %12.3f\n",
+                 stats->name, stats->count, stats->total_ns/1e6,
+                 stats->total_ns/1e6/stats->count, stats->max_ns/1e6);
+    }
+    fprintf (out, "\n");
+
+    uint64_t syscalls = 0;
+    for (int i=0; i<TRACE_COUNTER_COUNT; i++) {
+        fprintf (out, "%-32s %10lu\n", g_trace_counter_names[i], g_trace.counters[i]);
+        if (i < TRACE_SYSCALLS_END) {
+            syscalls += g_trace.counters[i];
+        }
+    }
+    fprintf (out, "%-32s %10lu\n", "syscalls", syscalls);
+}
+
+bool trace_write (char *path)
+{
+    FILE *out = fopen (path, "w");
+    if (out == NULL) {
+        return false;
+    }
+
+    // Timestamps are in microseconds, relative to trace_begin().
+    fprintf (out, "{\"traceEvents\": [\n");
+    for (int i=0; i<g_trace.events_len; i++) {
+        struct trace_event_t *event = &g_trace.events[i];
+        fprintf (out, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u},\n",
+                 event->name, (event->start_ns - g_trace.start_ns)/1e3, event->duration_ns/1e3, event->tid);
+    }
+
+    // Counters are written as a single counter event at the end of the run.
+    fprintf (out, "{\"name\": \"counters\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 1, \"args\": {",
+             (trace_time_ns () - g_trace.start_ns)/1e3);
+    for (int i=0; i<TRACE_COUNTER_COUNT; i++) {
+        fprintf (out, "%s\"%s\": %lu", i > 0 ? ", " : "", g_trace_counter_names[i], g_trace.counters[i]);
+    }
+    fprintf (out, "}}\n");
+    fprintf (out, "], \"displayTimeUnit\": \"ms\"}\n");
+
+    bool success = ferror (out) == 0;
+    return fclose (out) == 0 && success;
+}
+
+// Prints the summary to stderr if stats is true, and writes the trace file if
+// trace_path isn't NULL.
+void trace_end (bool stats, char *trace_path)
+{
+    if (!g_trace.enabled) return;
+
+    if (stats) {
+        trace_print_stats (stderr);
+    }
+
+    if (trace_path != NULL && !trace_write (trace_path)) {
+        fprintf (stderr, ECMA_RED("error:") " could not write trace %s: %s\n", trace_path, strerror(errno));
+    }
+
+    g_trace.enabled = false;
+    mem_pool_destroy (&g_trace.pool);
+    g_trace.events = NULL;
+    g_trace.events_len = 0;
+    g_trace.events_size = 0;
+}